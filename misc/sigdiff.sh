@@ -0,0 +1,42 @@
+#!/bin/bash
+###############################################################################
+# sigdiff.sh - Differential test of fpcc sig
+#
+# Fingerprints the given files with a single thread reading them through
+# stdio, and compares the output with several threads (JOBS, default 4)
+# and with the files mapped into memory (-m).
+# Further options for fpcc-sig can be passed in SIGOPTS, e.g. to test
+# the hand-written tokenizer instead of the flex scanner:
+#   SIGOPTS="-l fast" misc/sigdiff.sh $(find /usr/include -name "*.h")
+# Exits with status 1 if there is any difference.
+#
+# (c)2017 Daniel Prokesch <daniel.prokesch@gmail.com>
+#
+###############################################################################
+
+if [ $# -lt 1 ]; then
+  echo "$0 file..." >&2
+  exit 1
+fi
+
+SIG=${SIG:-$(dirname "$0")/../bin/fpcc-sig}
+JOBS=${JOBS:-4}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+"$SIG" $SIGOPTS -j 1 "$@" > "$TMP/ref.out" || exit 1
+
+NDIFF=0
+for opts in "-j $JOBS" "-m" "-m -j $JOBS"; do
+  "$SIG" $SIGOPTS $opts "$@" > "$TMP/test.out" || exit 1
+  if ! cmp -s "$TMP/ref.out" "$TMP/test.out"; then
+    NDIFF=$((NDIFF + 1))
+    echo "DIFF $opts"
+    diff "$TMP/ref.out" "$TMP/test.out" | head -n 6
+  else
+    echo "SAME $opts"
+  fi
+done
+
+echo "$# files, $NDIFF runs differ from -j 1"
+[ $NDIFF -eq 0 ]
@@ -0,0 +1,43 @@
+#!/bin/bash
+###############################################################################
+# tokbench.sh - Benchmark fpcc sig from a token file against scanning
+#
+# Saves the tokens of the given files to a token file once, then
+# fingerprints them with several chainlengths, by scanning the files and
+# from the token file (-t), and prints the time taken by each and whether
+# the outputs are the same.  Further options for fpcc-sig can be passed in
+# SIGOPTS, e.g. to compare with the hand-written tokenizer and the rolling
+# hash:
+#   SIGOPTS="-l fast -r" misc/tokbench.sh $(find . -name "*.c")
+#
+# (c)2017 Daniel Prokesch <daniel.prokesch@gmail.com>
+#
+###############################################################################
+
+if [ $# -lt 1 ]; then
+  echo "$0 file..." >&2
+  exit 1
+fi
+
+SIG=${SIG:-$(dirname "$0")/../bin/fpcc-sig}
+TIMEFORMAT="%3R"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# tokens are saved with the scanner of SIGOPTS
+secs=$( { time "$SIG" $SIGOPTS -T "$TMP/tokens" "$@" > /dev/null; } 2>&1 ) \
+  || exit 1
+echo "saving the tokens: $secs seconds, $(stat -c %s "$TMP/tokens") bytes"
+
+printf "%8s %10s %10s %8s %6s\n" "chain" "scan" "tokfile" "speedup" "same"
+for n in 5 10 20 50; do
+  # run once to warm the page cache, then measure
+  "$SIG" $SIGOPTS -n $n "$@" > /dev/null || exit 1
+  scan=$( { time "$SIG" $SIGOPTS -n $n "$@" > "$TMP/scan.out"; } 2>&1 )
+  tok=$( { time "$SIG" $SIGOPTS -n $n -t "$TMP/tokens" > "$TMP/tok.out"; } \
+    2>&1 )
+  same=no
+  cmp -s "$TMP/scan.out" "$TMP/tok.out" && same=yes
+  speedup=$(awk -v a="$scan" -v b="$tok" 'BEGIN { printf "%.1fx", a / b }')
+  printf "%8d %10s %10s %8s %6s\n" $n "$scan" "$tok" "$speedup" $same
+done
@@ -0,0 +1,47 @@
+#!/bin/bash
+###############################################################################
+# tokdiff.sh - Differential test of the C tokenizers
+#
+# Builds the token dumpers of the flex scanner (src/ccode.lex) and of the
+# hand-written tokenizer (src/tokenize.c), runs both on each given file and
+# reports the files for which the token IDs or line numbers differ.
+# Exits with status 1 if there is any difference.
+#
+# Example:
+#   misc/tokdiff.sh $(find /usr/include -name "*.h")
+#
+# (c)2017 Daniel Prokesch <daniel.prokesch@gmail.com>
+#
+###############################################################################
+
+if [ $# -lt 1 ]; then
+  echo "$0 file..." >&2
+  exit 1
+fi
+
+SRC=$(cd "$(dirname "$0")/../src" && pwd)
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+make -s -C "$SRC/.." src/ccode.tab.h || exit 1
+# flex writes the header lex.yy.h to the current directory
+(cd "$TMP" && flex -o lex.yy.c "$SRC/ccode.lex") || exit 1
+gcc -O2 -DLEXMAIN -I"$SRC" -o "$TMP/lexmain" "$TMP/lex.yy.c" || exit 1
+gcc -O2 -DTOKMAIN -I"$SRC" -o "$TMP/tokmain" "$SRC/tokenize.c" -lpthread \
+  || exit 1
+
+NFILES=0
+NDIFF=0
+for f in "$@"; do
+  NFILES=$((NFILES + 1))
+  "$TMP/lexmain" < "$f" > "$TMP/flex.out"
+  "$TMP/tokmain" < "$f" > "$TMP/fast.out"
+  if ! cmp -s "$TMP/flex.out" "$TMP/fast.out"; then
+    NDIFF=$((NDIFF + 1))
+    echo "DIFF $f"
+    diff "$TMP/flex.out" "$TMP/fast.out" | head -n 6
+  fi
+done
+
+echo "$NFILES files, $NDIFF differ"
+[ $NDIFF -eq 0 ]
@@ -0,0 +1,30 @@
+#!/bin/bash
+###############################################################################
+# winnowbench.sh - Benchmark fpcc sig over a range of window sizes
+#
+# Fingerprints the given files with window sizes from 4 to 1024 and prints
+# the time taken and the number of selected hashes for each size.
+# Further options for fpcc-sig can be passed in SIGOPTS, e.g. to exclude
+# the scanner and hashing as far as possible:
+#   SIGOPTS="-l fast -r" misc/winnowbench.sh $(find . -name "*.c")
+#
+# (c)2017 Daniel Prokesch <daniel.prokesch@gmail.com>
+#
+###############################################################################
+
+if [ $# -lt 1 ]; then
+  echo "$0 file..." >&2
+  exit 1
+fi
+
+SIG=${SIG:-$(dirname "$0")/../bin/fpcc-sig}
+TIMEFORMAT="%3R"
+
+printf "%8s %10s %10s\n" "winnow" "seconds" "hashes"
+for w in 4 8 16 32 64 128 256 512 1024; do
+  # run once to warm the page cache, then measure
+  "$SIG" $SIGOPTS -w $w "$@" > /dev/null || exit 1
+  secs=$( { time "$SIG" $SIGOPTS -w $w "$@" > /dev/null; } 2>&1 )
+  hashes=$("$SIG" $SIGOPTS -w $w "$@" | grep -vc "^/")
+  printf "%8d %10s %10d\n" $w "$secs" "$hashes"
+done
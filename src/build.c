@@ -0,0 +1,234 @@
+/**
+ * fpcc-build - Create a fingerprint index directly from C source files.
+ *
+ * This fuses fpcc-sig and fpcc-idx into a single process: the winnowed
+ * hashes are added to the index in memory instead of being formatted as
+ * text and parsed again.  The resulting index is the same as the one of
+ *   fpcc sig file... | fpcc idx -o outfile
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "fprint.h"
+#include "idxio.h"
+
+const char *program_name = "fpcc-build";
+
+// the indices under construction, for each of the parameters
+static struct idx_builder *ib;
+static const char **outnames;
+static FILE **outfiles;
+static int noutfiles;
+
+
+/**
+ * Add the outfile for the next index, opened by open_outfiles().
+ */
+static void add_outfile(const char *name)
+{
+  const char **new_outnames = realloc(outnames,
+      (noutfiles + 1) * sizeof(const char *));
+  if (new_outnames == NULL)
+    error_exit("cannot allocate memory");
+  outnames = new_outnames;
+  outnames[noutfiles++] = name;
+}
+
+
+/**
+ * Open the outfiles, once the options are checked, so that an invalid
+ * command line truncates none of them.
+ */
+static void open_outfiles(void)
+{
+  outfiles = malloc(noutfiles * sizeof(FILE *));
+  if (outfiles == NULL)
+    error_exit("cannot allocate memory");
+  for (int i = 0; i < noutfiles; i++) {
+    outfiles[i] = fopen(outnames[i], "w");
+    if (outfiles[i] == NULL) {
+      error_exit("cannot open outfile");
+    }
+  }
+}
+
+
+void usage(void)
+{
+  (void) fprintf(stderr, "USAGE: %s [-0] [-f] [-k] [-m] [-r] [-R]"
+                         " [-C cachefile] [-e ext,...] [-j threads] [-l lexer]"
+                         " [-M memory] [-z] [-n chainlength] [-t tokfile]"
+                         " [-T tokfile] [-w winnow]"
+                         " {-o outfile | -p chainlength,winnow,outfile...}"
+                         " [file...]\n",
+                         program_name);
+  (void) fprintf(stderr, "  lexer: flex (default) or fast\n");
+  (void) fprintf(stderr, "  file - or none: read the list of files"
+                         " from stdin\n");
+  (void) fprintf(stderr, "  -T: save the tokens to tokfile, -t: fingerprint"
+                         " the tokens of tokfile\n");
+  (void) fprintf(stderr, "  defaults: chainlength=%d winnow=%d ext=%s\n",
+      DEFAULT_NTOKEN, DEFAULT_WINNOWSIZE, DEFAULT_EXTENSIONS);
+  exit(EXIT_FAILURE);
+}
+
+
+/**
+ * Add the fingerprint of a file to the index
+ */
+void add_result(const struct fpresult *res)
+{
+  struct idx_builder *b = &ib[res->param];
+  idx_add_path(b, res->path);
+  for (size_t i = 0; i < res->nfuncs; i++) {
+    idx_add_func(b, res->funcs[i].name, res->funcs[i].first_line,
+        res->funcs[i].last_line);
+  }
+  for (size_t i = 0; i < res->count; i++) {
+    idx_add_hash(b, res->recs[i].hash, res->recs[i].linepos,
+        res->recs[i].func);
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt_n=0, opt_w=0, opt_j=0, opt_l=0, opt_e=0, opt_C=0, opt_o=0;
+  int opt_t=0, opt_T=0, opt_p=0, opt_M=0, opt_z=0;
+  size_t memory = 0;
+  char *stdin_list[] = { "-" };
+  int c;
+
+  if (argc > 0) program_name = argv[0];
+
+  while ((c = getopt(argc, argv, "0C:e:fj:kl:mM:n:o:p:Rrt:T:w:z")) != -1) {
+    switch (c) {
+      case '0':
+        if (Nullsep++ > 0) usage();
+        break;
+      case 'C':
+        if (opt_C++ > 0) usage();
+        Cachefile = optarg;
+        break;
+      case 'e':
+        if (opt_e++ > 0) usage();
+        Extensions = optarg;
+        break;
+      case 'j':
+        if (opt_j++ > 0) usage();
+        Nthreads = parse_num(optarg);
+        if (Nthreads <= 0)
+          usage();
+        break;
+      case 'l':
+        if (opt_l++ > 0) usage();
+        if (strcmp(optarg, "fast") == 0)
+          Fastlex = 1;
+        else if (strcmp(optarg, "flex") != 0)
+          usage();
+        break;
+      case 'M':
+        if (opt_M++ > 0) usage();
+        memory = parse_size(optarg);
+        if (memory == 0)
+          usage();
+        break;
+      case 'n':
+        if (opt_n++ > 0) usage();
+        Ntoken = parse_num(optarg);
+        if (Ntoken <= 0)
+          usage();
+        break;
+      case 'o':
+        if (opt_o++ > 0) usage();
+        add_outfile(optarg);
+        break;
+      case 'p':
+        opt_p++;
+        add_outfile(fp_parse_param(optarg));
+        break;
+      case 't':
+        if (opt_t++ > 0) usage();
+        Tokenload = optarg;
+        break;
+      case 'T':
+        if (opt_T++ > 0) usage();
+        Tokensave = optarg;
+        break;
+      case 'w':
+        if (opt_w++ > 0) usage();
+        Winnowsize = parse_num(optarg);
+        if (Winnowsize <= 0)
+          usage();
+        break;
+      case 'f':
+        if (Functions++ > 0) usage();
+        break;
+      case 'k':
+        if (Cachecheck++ > 0) usage();
+        break;
+      case 'm':
+        if (Mmap++ > 0) usage();
+        break;
+      case 'r':
+        if (Rolling++ > 0) usage();
+        break;
+      case 'R':
+        if (Recursive++ > 0) usage();
+        break;
+      case 'z':
+        if (opt_z++ > 0) usage();
+        break;
+      case '?':
+      default:
+        usage();
+    }
+  }
+  // an outfile is mandatory, either with -o or for each -p
+  if ((opt_o == 0) == (opt_p == 0)) usage();
+  if (opt_p && (opt_n || opt_w)) usage();
+  // extensions only apply to directories, contents only to the cache
+  if (opt_e > 0 && !Recursive) usage();
+  if (Cachecheck && Cachefile == NULL) usage();
+  // the cache holds no functions
+  if (Functions && Cachefile != NULL) usage();
+  // the cache holds the fingerprints of a single chainlength and winnow size
+  if (opt_p && Cachefile != NULL) usage();
+  // the tokens are saved as scanned, without names of identifiers
+  if ((opt_t || opt_T) && Cachefile != NULL) usage();
+  if (opt_t && (opt_T || Functions || Recursive || opt_e)) usage();
+  if (opt_t && argc - optind > 0) usage();
+  open_outfiles();
+
+  ib = malloc(noutfiles * sizeof(struct idx_builder));
+  if (ib == NULL)
+    error_exit("cannot allocate memory");
+  for (int i = 0; i < noutfiles; i++) {
+    idx_init(&ib[i]);
+    ib[i].threads = Nthreads;
+    ib[i].memory = memory;
+    ib[i].compress = opt_z;
+  }
+  // a token file replaces the files; without files, read the list from stdin
+  if (opt_t)
+    fp_run(NULL, 0, add_result);
+  else if (argc - optind < 1)
+    fp_run(stdin_list, 1, add_result);
+  else
+    fp_run(&argv[optind], argc - optind, add_result);
+  for (int i = 0; i < noutfiles; i++) {
+    idx_write(&ib[i], outfiles[i]);
+    if (fclose(outfiles[i]) != 0) {
+      error_exit("cannot close outfile");
+    }
+  }
+
+  exit(EXIT_SUCCESS);
+}
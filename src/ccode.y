@@ -1,3 +1,23 @@
+/*
+ * The grammar serves two purposes: the token IDs shared by the scanners,
+ * and a parser finding the function definitions in a token stream, see
+ * fparse.c.  Semantic values are identifiers, as offsets of their names,
+ * locations are the line and index of tokens.
+ */
+%define api.prefix {cc}
+%define api.pure full
+%define api.value.type {int}
+%locations
+%param {struct fparser *fp}
+
+%code requires {
+struct fparser;
+}
+
+%code {
+#include "fparse.h"
+}
+
 %token  IDENTIFIER 512
 %token  PREPROC
 %token  I_CONSTANT F_CONSTANT STRING_LITERAL FUNC_NAME SIZEOF
@@ -191,8 +211,8 @@ constant_expression
         ;
 
 declaration
-        : declaration_specifiers ';'
-        | declaration_specifiers init_declarator_list ';'
+        : declaration_specifiers ';'                      { fp_end_decl(fp); }
+        | declaration_specifiers init_declarator_list ';' { fp_end_decl(fp); }
         | static_assert_declaration
         ;
 
@@ -215,12 +235,13 @@ init_declarator_list
         ;
 
 init_declarator
-        : declarator '=' initializer
-        | declarator
+        : declarator '=' initializer    { fp_declare(fp, $1); }
+        | declarator                    { fp_declare(fp, $1); }
         ;
 
 storage_class_specifier
-        : TYPEDEF       /* identifiers must be flagged as TYPEDEF_NAME */
+        : TYPEDEF       { fp_typedef(fp); }
+                        /* identifiers must be flagged as TYPEDEF_NAME */
         | EXTERN
         | STATIC
         | THREAD_LOCAL
@@ -327,13 +348,13 @@ alignment_specifier
         ;
 
 declarator
-        : pointer direct_declarator
+        : pointer direct_declarator     { $$ = $2; }
         | direct_declarator
         ;
 
 direct_declarator
         : IDENTIFIER
-        | '(' declarator ')'
+        | '(' declarator ')'            { $$ = $2; }
         | direct_declarator '[' ']'
         | direct_declarator '[' '*' ']'
         | direct_declarator '[' STATIC type_qualifier_list assignment_expression ']'
@@ -476,6 +497,7 @@ block_item_list
 block_item
         : declaration
         | statement
+        | error ';'                     { fp_end_decl(fp); }
         ;
 
 expression_statement
@@ -514,11 +536,14 @@ translation_unit
 external_declaration
         : function_definition
         | declaration
+        | error                         { fp_end_decl(fp); }
         ;
 
 function_definition
         : declaration_specifiers declarator declaration_list compound_statement
+                                        { fp_function(fp, $2, &@$, &@2); }
         | declaration_specifiers declarator compound_statement
+                                        { fp_function(fp, $2, &@$, &@2); }
         ;
 
 declaration_list
@@ -1,4 +1,6 @@
+#include <ctype.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,6 +31,33 @@ long int parse_num(const char *s)
 }
 
 
+/**
+ * Parse a number of bytes, optionally followed by K, M or G for a
+ * multiple of 1024, 1024^2 or 1024^3.  Sizes that do not fit a size_t
+ * are rejected.
+ */
+size_t parse_size(const char *s)
+{
+  char *eptr;
+  unsigned long long res;
+  int shift = 0;
+
+  // strtoull() would accept leading whitespace and a sign
+  if (!isdigit((unsigned char) *s)) usage();
+  errno = 0;
+  res = strtoull(s, &eptr, 10);
+  if (errno == ERANGE) usage();
+  switch (*eptr) {
+    case 'G': shift = 30; eptr++; break;
+    case 'M': shift = 20; eptr++; break;
+    case 'K': shift = 10; eptr++; break;
+  }
+  if (*eptr != '\0') usage();
+  if (res > SIZE_MAX >> shift) usage();
+  return (size_t) res << shift;
+}
+
+
 int hash_cmp(const hash_entry_t *h1, const hash_entry_t *h2)
 {
   if (h1->hash < h2->hash) return -1;
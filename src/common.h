@@ -1,11 +1,13 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 // default options for sig
 #define DEFAULT_NTOKEN     5
 #define DEFAULT_WINNOWSIZE 4
+#define DEFAULT_EXTENSIONS "c,h"
 
 // default options for comp
 #define DEFAULT_THRESHOLD 0
@@ -24,17 +26,22 @@
 
 typedef uint64_t hash_t;
 
+/**
+ * A hash of an index.  Its position in the input order determines its
+ * file and line, which are stored apart from the hashes.
+ */
 typedef struct {
   hash_t hash;
-  uint16_t linepos;
-  uint16_t filecnt;
-  uint32_t next;
+  uint32_t seq;   // position in input order
+  uint32_t next;  // position of the input successor in the index
 } hash_entry_t;
 
-void error_exit(const char *msg);
+void error_exit(const char *msg) __attribute__((noreturn));
 
 long int parse_num(const char *s);
 
+size_t parse_size(const char *s);
+
 int hash_cmp(const hash_entry_t *h1, const hash_entry_t *h2);
 
 #endif // _COMMON_H_
@@ -12,17 +12,83 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "idxfile.h"
+#include "isect.h"
+#include "minhash.h"
+#include "sparse.h"
+#include "steal.h"
+#include "storeio.h"
+
+/**
+ * A function of an index, with the number of its hashes.
+ */
+typedef struct {
+  int seg;  // the segment of a store
+  uint32_t file;
+  const char *name;
+  uint32_t first_line, last_line;
+  unsigned count;
+} func_t;
 
 typedef struct {
   char *fname; // filename
   unsigned count; //  number of hashes
-  hash_entry_t *hashes; // pointer to array of hashes
+  // functions, if loaded
+  unsigned nfuncs;
+  func_t *funcs;
+  uint32_t **fnum;  // number in funcs of each function of each segment
+  // whether each hash of each segment is excluded by the basefile, if any
+  uint8_t **excl;
+  struct store_view sv;  // the hashes
 } sig_t;
 
+/**
+ * The hashes of the basefile with the number of times each occurs, kept
+ * by open addressing; slots of count 0 are free.
+ */
+typedef struct {
+  hash_t hash;
+  uint32_t count;
+} basehash_t;
+
+/**
+ * The common hashes of a pair of functions.
+ */
+typedef struct {
+  uint64_t key; // the two functions
+  int nboth, nexcl;
+} funcpair_t;
+
+/**
+ * The pairs of signatures to compare, in the order they are reported: all
+ * pairs, the candidate pairs of -a, or the pairs counted by -s.  They are
+ * cut into chunks, which are compared by the threads.
+ */
+typedef struct {
+  uint64_t count;  // number of pairs
+  const uint64_t *keys;  // the candidate pairs, if not all pairs
+  // the pairs counted, in order, and if they are the pairs to compare
+  const struct sp_pair *counted;
+  size_t ncounted;
+  int only_counted;
+  int csv, incl;
+  uint64_t *chunks;  // first pair of each chunk, followed by count
+  size_t nchunks;
+} pairlist_t;
+
+// Pairs are compared in chunks of about equal cost, this many per thread,
+// so a thread running out of work can steal some from another.
+#define CHUNKS_PER_THREAD 64
+
 const char *program_name = "fpcc-comp";
 
 
 static int thresh = DEFAULT_THRESHOLD;
+static int functions = 0; // compare the functions of the files
+// compare the candidate pairs of sketches of bands of rows only, if set
+static unsigned bands = 0, rows = 0;
+static int sparse = 0; // count the pairs by an inverted index
+static int nthreads = 1;
 
 // the global list of document's fingerprints
 // - a dynamically growing array
@@ -32,7 +98,11 @@ static int sl_cnt=0, sl_cap=0;
 
 sig_t *new_sig(void);
 void load(const char *, sig_t *);
-void count(int *, int *, sig_t *, sig_t *, sig_t *);
+void free_sig(sig_t *);
+basehash_t *base_table(sig_t *, size_t *);
+void mark_base(sig_t *, const basehash_t *, size_t);
+void count(int *, int *, sig_t *, sig_t *);
+size_t count_funcs(funcpair_t **, sig_t *, sig_t *);
 
 /**
  * Print a usage message to stderr and exit with EXIT_FAILURE.
@@ -40,10 +110,11 @@ void count(int *, int *, sig_t *, sig_t *, sig_t *);
 void usage(void)
 {
   (void) fprintf(stderr,
-      "USAGE: %s [-b basefile] [-c|-i] [-t threshold] sigfile1 sigfile2\n",
+      "USAGE: %s [-b basefile] [-c|-i] [-f] [-t threshold] sigfile1 sigfile2\n",
       program_name);
   (void) fprintf(stderr,
-      "       %s [-b basefile] [-c|-i] [-t threshold] -L filelist\n",
+      "       %s [-b basefile] [-c|-i] [-f] [-t threshold] [-a bands,rows|-s] "
+      "[-j threads] [-u] -L filelist\n",
       program_name);
   exit(EXIT_FAILURE);
 }
@@ -83,12 +154,25 @@ inline static int containment(int na, int nboth, int nexcl)
 }
 
 
-void print_if_threshold(const char *join,
+/**
+ * Label of a function of sig: path:line:name, with its path decoded into
+ * path.
+ */
+static void func_label(char *buf, size_t size, const sig_t *sig,
+    const func_t *f, char *path)
+{
+  (void) snprintf(buf, size, "%s:%u:%s",
+      idx_path(&sig->sv.segs[f->seg], f->file, path), f->first_line,
+      f->name);
+}
+
+
+void print_if_threshold(FILE *out, const char *join,
     const char *fname1, const char *fname2,
     int value, int threshold)
 {
   if (value >= threshold) {
-    if (printf("%s %s %s: %d%%\n", fname1, join, fname2, value) < 0) {
+    if (fprintf(out, "%s %s %s: %d%%\n", fname1, join, fname2, value) < 0) {
       (void) fprintf(stderr, "%s: cannot print result: %s\n",
           program_name, strerror(errno));
     }
@@ -96,17 +180,341 @@ void print_if_threshold(const char *join,
 }
 
 
+static int pair_cmp(const void *a, const void *b)
+{
+  uint64_t k1 = ((const funcpair_t *) a)->key;
+  uint64_t k2 = ((const funcpair_t *) b)->key;
+  return k1 < k2 ? -1 : k1 > k2;
+}
+
+
+/**
+ * Compare the functions of s0 and s1, and report the pairs of functions
+ * with common hashes like files are reported.
+ */
+static void compare_funcs(FILE *out, sig_t *s0, sig_t *s1, int csv,
+    int incl)
+{
+  funcpair_t *pairs;
+  size_t npairs = count_funcs(&pairs, s0, s1);
+  qsort(pairs, npairs, sizeof(funcpair_t), pair_cmp);
+  char *path0 = store_path_buf(&s0->sv), *path1 = store_path_buf(&s1->sv);
+
+  for (size_t k = 0; k < npairs; k++) {
+    const func_t *f0 = &s0->funcs[pairs[k].key >> 32];
+    const func_t *f1 = &s1->funcs[pairs[k].key & UINT32_MAX];
+    int nboth = pairs[k].nboth, nexcl = pairs[k].nexcl;
+    char l0[PATH_MAX], l1[PATH_MAX];
+    func_label(l0, sizeof l0, s0, f0, path0);
+    func_label(l1, sizeof l1, s1, f1, path1);
+
+    if (csv) {
+      int rb = resemblance(f0->count, f1->count, nboth, nexcl);
+      int ct1 = containment(f0->count, nboth, nexcl);
+      int ct2 = containment(f1->count, nboth, nexcl);
+      if (rb >= thresh || ct1 >= thresh || ct2 >= thresh) {
+        if (fprintf(out, "%s;%s;%d;%d;%d\n", l0, l1, rb, ct1, ct2) < 0) {
+          error_exit("cannot print result");
+        }
+      }
+    } else if (incl) {
+      print_if_threshold(out, "in", l0, l1,
+          containment(f0->count, nboth, nexcl), thresh);
+      print_if_threshold(out, "in", l1, l0,
+          containment(f1->count, nboth, nexcl), thresh);
+    } else {
+      print_if_threshold(out, "and", l1, l0,
+          resemblance(f0->count, f1->count, nboth, nexcl), thresh);
+    }
+  }
+  free(path0);
+  free(path1);
+  free(pairs);
+}
+
+
+/**
+ * Report the resemblance or containment of s0 and s1, with nboth common
+ * hashes, nexcl of them in the base.
+ */
+static void report(FILE *out, sig_t *s0, sig_t *s1, int nboth, int nexcl,
+    int csv, int incl)
+{
+  if (csv) {
+    // csv-format output all three
+    int rb = resemblance(s0->count, s1->count, nboth, nexcl);
+    int ct1 = containment(s0->count, nboth, nexcl);
+    int ct2 = containment(s1->count, nboth, nexcl);
+    if (rb >= thresh || ct1 >= thresh || ct2 >= thresh) {
+      if (fprintf(out, "%s;%s;%d;%d;%d\n",
+            s0->fname, s1->fname, rb, ct1, ct2) < 0) {
+        error_exit("cannot print result");
+      }
+    }
+  } else if (incl) {
+    // print containment
+    print_if_threshold(out, "in", s0->fname, s1->fname,
+        containment(s0->count, nboth, nexcl), thresh);
+    print_if_threshold(out, "in", s1->fname, s0->fname,
+        containment(s1->count, nboth, nexcl), thresh);
+  } else {
+    // print resemblance
+    print_if_threshold(out, "and", s1->fname, s0->fname,
+        resemblance(s0->count, s1->count, nboth, nexcl), thresh);
+  }
+}
+
+
+/**
+ * Compare the signatures s0 and s1, with the hashes of the basefile
+ * excluded, or those of their functions.
+ */
+static void compare(FILE *out, sig_t *s0, sig_t *s1, int csv, int incl)
+{
+  if (functions) {
+    compare_funcs(out, s0, s1, csv, incl);
+    return;
+  }
+  int nboth, nexcl;
+  count(&nboth, &nexcl, s0, s1);
+  report(out, s0, s1, nboth, nexcl, csv, incl);
+}
+
+
+/**
+ * Sketch the signatures, and find the pairs of signatures likely to be
+ * similar.  Store them in *pairs like mh_candidates() does, and return
+ * their number.
+ */
+static size_t candidates(uint64_t **pairs, sig_t *sb)
+{
+  size_t m = (size_t) bands * rows;
+  uint64_t *sketches = malloc((sl_cnt > 0 ? sl_cnt : 1) * m *
+      sizeof(uint64_t));
+  if (sketches == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (int i = 0; i < sl_cnt; i++) {
+    mh_sketch(sketches + i * m, m, &siglist[i].sv, &sb->sv);
+  }
+  size_t npairs = mh_candidates(pairs, sketches, sl_cnt, bands, rows);
+  free(sketches);
+  DBG("%zu candidate pairs\n", npairs);
+  return npairs;
+}
+
+
+/**
+ * Count the common hashes of the pairs of signatures with an inverted
+ * index.  Store the pairs counted in *pairs like sp_count() does, and
+ * return their number.
+ */
+static size_t count_sparse(struct sp_pair **pairs, sig_t *sb)
+{
+  const struct store_view **svs = malloc((sl_cnt > 0 ? sl_cnt : 1) *
+      sizeof(struct store_view *));
+  if (svs == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (int i = 0; i < sl_cnt; i++) {
+    svs[i] = &siglist[i].sv;
+  }
+  // functions may be similar without their files being similar
+  size_t npairs = sp_count(pairs, svs, sl_cnt,
+      sb->count > 0 ? &sb->sv : NULL, functions ? 0 : thresh);
+  free(svs);
+  DBG("%zu pairs with common hashes\n", npairs);
+  return npairs;
+}
+
+
+/**
+ * The key of the pair of signatures at position p of the pairs to compare.
+ */
+static uint64_t pair_key(const pairlist_t *pl, uint64_t p)
+{
+  if (pl->keys != NULL) return pl->keys[p];
+  if (pl->only_counted) return pl->counted[p].key;
+  // the pairs of signature i start at i * (n - 1) - i * (i - 1) / 2
+  uint64_t n = sl_cnt, lo = 0, hi = n - 1;
+  while (hi - lo > 1) {
+    uint64_t i = lo + (hi - lo) / 2;
+    if (i * (n - 1) - i * (i - 1) / 2 <= p) lo = i; else hi = i;
+  }
+  uint64_t first = lo * (n - 1) - lo * (lo - 1) / 2;
+  return lo << 32 | (lo + 1 + p - first);
+}
+
+
+/**
+ * Compare the pairs of signatures of chunk c of the pairs to compare, and
+ * report them to out.
+ */
+static void compare_chunk(void *arg, size_t c, FILE *out)
+{
+  const pairlist_t *pl = arg;
+  uint64_t p = pl->chunks[c], end = pl->chunks[c + 1];
+  uint64_t key = pair_key(pl, p);
+  // the first pair counted from the chunk on
+  size_t k = p;
+  if (pl->counted != NULL && !pl->only_counted) {
+    size_t lo = 0, hi = pl->ncounted;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (pl->counted[mid].key < key) lo = mid + 1; else hi = mid;
+    }
+    k = lo;
+  }
+  for (;;) {
+    sig_t *s0 = &siglist[key >> 32], *s1 = &siglist[key & UINT32_MAX];
+    if (pl->counted == NULL) {
+      compare(out, s0, s1, pl->csv, pl->incl);
+    } else if (k < pl->ncounted && pl->counted[k].key == key) {
+      const struct sp_pair *sp = &pl->counted[k++];
+      if (sp->recount || functions) {
+        compare(out, s0, s1, pl->csv, pl->incl);
+      } else {
+        report(out, s0, s1, sp->nboth, sp->nexcl, pl->csv, pl->incl);
+      }
+    } else {
+      // no common hashes
+      report(out, s0, s1, 0, 0, pl->csv, pl->incl);
+    }
+    if (++p == end) break;
+    if (pl->keys != NULL || pl->only_counted) {
+      key = pair_key(pl, p);
+    } else if ((key & UINT32_MAX) + 1 < (uint64_t) sl_cnt) {
+      key++;
+    } else {
+      uint64_t i = (key >> 32) + 1;
+      key = i << 32 | (i + 1);
+    }
+  }
+}
+
+
+/**
+ * Add position p as the start of the next chunk of the pairs to compare.
+ */
+static void chunk_add(pairlist_t *pl, size_t *capacity, uint64_t p)
+{
+  if (pl->nchunks + 1 >= *capacity) {
+    *capacity = *capacity > 0 ? 2 * *capacity : 256;
+    uint64_t *chunks = realloc(pl->chunks, *capacity * sizeof(uint64_t));
+    if (chunks == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    pl->chunks = chunks;
+  }
+  pl->chunks[pl->nchunks++] = p;
+}
+
+
+/**
+ * The cost of comparing a pair of signatures, taken as their sizes, which
+ * vary widely.
+ */
+static uint64_t pair_cost(uint64_t key)
+{
+  return siglist[key >> 32].count + siglist[key & UINT32_MAX].count + 2;
+}
+
+
+/**
+ * Cut the pairs to compare into chunks of about the same cost, about
+ * CHUNKS_PER_THREAD for each of nthreads threads.
+ */
+static void cut_chunks(pairlist_t *pl, int nthreads)
+{
+  size_t capacity = 0;
+  pl->chunks = NULL;
+  pl->nchunks = 0;
+  chunk_add(pl, &capacity, 0);
+  if (nthreads > 1 && (pl->keys != NULL || pl->only_counted)) {
+    uint64_t total = 0, cost = 0;
+    for (uint64_t p = 0; p < pl->count; p++) {
+      total += pair_cost(pair_key(pl, p));
+    }
+    uint64_t target = total / ((uint64_t) nthreads * CHUNKS_PER_THREAD) + 1;
+    for (uint64_t p = 0; p + 1 < pl->count; p++) {
+      cost += pair_cost(pair_key(pl, p));
+      if (cost >= target) {
+        chunk_add(pl, &capacity, p + 1);
+        cost = 0;
+      }
+    }
+  } else if (nthreads > 1) {
+    // the cost of the pairs of signature i with j0 to j is
+    // (j - j0 + 1) * (size of i) + sizes[j + 1] - sizes[j0]
+    uint64_t n = sl_cnt, cost = 0;
+    uint64_t *sizes = malloc((n + 1) * sizeof(uint64_t));
+    if (sizes == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    sizes[0] = 0;
+    for (uint64_t i = 0; i < n; i++) {
+      sizes[i + 1] = sizes[i] + siglist[i].count + 1;
+    }
+    uint64_t target = (n - 1) * sizes[n] /
+      ((uint64_t) nthreads * CHUNKS_PER_THREAD) + 1;
+    for (uint64_t i = 0, first = 0; i + 1 < n; first += n - 1 - i, i++) {
+      uint64_t size = siglist[i].count + 1;
+      uint64_t j0 = i + 1;
+      while (cost + (n - j0) * size + sizes[n] - sizes[j0] >= target) {
+        // the first pair reaching the target ends the chunk
+        uint64_t lo = j0, hi = n - 1;
+        while (lo < hi) {
+          uint64_t j = lo + (hi - lo) / 2;
+          if (cost + (j - j0 + 1) * size + sizes[j + 1] - sizes[j0] >= target)
+            hi = j;
+          else
+            lo = j + 1;
+        }
+        if (first + lo + 1 - (i + 1) < pl->count)
+          chunk_add(pl, &capacity, first + lo + 1 - (i + 1));
+        cost = 0;
+        j0 = lo + 1;
+      }
+      cost += (n - j0) * size + sizes[n] - sizes[j0];
+    }
+    free(sizes);
+  }
+  if (pl->count > 0) chunk_add(pl, &capacity, pl->count);
+  pl->nchunks--;
+  DBG("%zu chunks of pairs\n", pl->nchunks);
+}
+
+
+/**
+ * Parse the bands and rows of sketches, as bands,rows.
+ */
+static void parse_bands(char *arg)
+{
+  char *r = strchr(arg, ',');
+  if (r == NULL) usage();
+  *r++ = '\0';
+  long b = parse_num(arg), n = parse_num(r);
+  if (b <= 0 || n <= 0 || b > 1024 || n > 1024) usage();
+  bands = b;
+  rows = n;
+}
+
+
 int main(int argc, char *argv[])
 {
-  int opt_b=0, opt_t=0, opt_L=0, opt_c=0, opt_i=0;
+  int opt_a=0, opt_b=0, opt_t=0, opt_L=0, opt_c=0, opt_i=0, opt_j=0, opt_u=0;
   const char *filelist = NULL;
   char *basefile = NULL;
 
   if (argc > 0) program_name = argv[0];
 
   int c;
-  while ((c = getopt(argc, argv, "b:cit:L:")) != -1) {
+  while ((c = getopt(argc, argv, "a:b:cifj:st:uL:")) != -1) {
     switch (c) {
+      case 'a':
+        if (opt_a++ > 0) usage();
+        parse_bands(optarg);
+        break;
       case 'b':
         if (opt_b++ > 0) usage();
         basefile = optarg;
@@ -114,15 +522,29 @@ int main(int argc, char *argv[])
       case 'c':
         if (opt_c++ > 0) usage();
         break;
+      case 'f':
+        if (functions++ > 0) usage();
+        break;
       case 'i':
         if (opt_i++ > 0) usage();
         break;
+      case 'j':
+        if (opt_j++ > 0) usage();
+        nthreads = parse_num(optarg);
+        if (nthreads <= 0) usage();
+        break;
+      case 's':
+        if (sparse++ > 0) usage();
+        break;
       case 't':
         if (opt_t++ > 0) usage();
         thresh = parse_num(optarg);
         if (thresh < 0 || thresh > 100)
           usage();
         break;
+      case 'u':
+        if (opt_u++ > 0) usage();
+        break;
       case 'L':
         if (opt_L++ > 0) usage();
         filelist = optarg;
@@ -133,11 +555,13 @@ int main(int argc, char *argv[])
     }
   }
   if (opt_c + opt_i > 1) usage();
+  if (opt_a + sparse > 1) usage();
 
   // number of positional arguments
   int npargs = argc - optind;
 
-  sig_t basesig = {.fname=NULL, .count=0, .hashes=NULL};
+  sig_t basesig;
+  memset(&basesig, 0, sizeof basesig);
 
   if (basefile != NULL) {
     load(basefile, &basesig);
@@ -170,57 +594,58 @@ int main(int argc, char *argv[])
     load(argv[optind + 1], new_sig());
   }
 
+  if (basesig.count > 1) {
+    // the basefile is looked up once per hash, rather than per pair
+    size_t capacity;
+    basehash_t *table = base_table(&basesig, &capacity);
+    for (int i = 0; i < sl_cnt; i++) {
+      mark_base(&siglist[i], table, capacity);
+    }
+    free(table);
+  }
+
   // emit a warning
   if (sl_cnt < 2) {
     (void) fprintf(stderr, "%s: nothing to compare\n", program_name);
   }
 
-  for (int i=0; i < sl_cnt; i++) {
-    for (int j=i+1; j < sl_cnt; j++) {
-      int nboth, nexcl;
-      count(&nboth, &nexcl, &siglist[i], &siglist[j], &basesig);
-
-      if (opt_c > 0) {
-        // csv-format output all three
-        int rb = resemblance(siglist[i].count, siglist[j].count, nboth, nexcl);
-        int ct1 = containment(siglist[i].count, nboth, nexcl);
-        int ct2 = containment(siglist[j].count, nboth, nexcl);
-        if (rb >= thresh || ct1 >= thresh || ct2 >= thresh) {
-          if (printf("%s;%s;%d;%d;%d\n",
-                siglist[i].fname, siglist[j].fname, rb, ct1, ct2) < 0) {
-            error_exit("cannot print result");
-          }
-        }
-      } else {
-        // conventional output
-        if (opt_i > 0) {
-          // print containment
-          print_if_threshold("in", siglist[i].fname, siglist[j].fname,
-              containment(siglist[i].count, nboth, nexcl), thresh);
-          print_if_threshold("in", siglist[j].fname, siglist[i].fname,
-              containment(siglist[j].count, nboth, nexcl), thresh);
-        } else {
-          // print resemblance
-          print_if_threshold("and", siglist[j].fname, siglist[i].fname,
-              resemblance(siglist[i].count, siglist[j].count, nboth, nexcl),
-              thresh);
-        } // end if conventional output
-      } // end if csv-format
+  pairlist_t pl;
+  memset(&pl, 0, sizeof pl);
+  pl.csv = opt_c;
+  pl.incl = opt_i;
+  uint64_t *keys = NULL;
+  struct sp_pair *counted = NULL;
+  if (bands > 0) {
+    // only the candidate pairs, in the same order
+    pl.count = candidates(&keys, &basesig);
+    pl.keys = keys;
+  } else {
+    pl.count = sl_cnt > 1 ? (uint64_t) sl_cnt * (sl_cnt - 1) / 2 : 0;
+  }
+  if (sparse) {
+    pl.ncounted = count_sparse(&counted, &basesig);
+    pl.counted = counted;
+    // pairs without common hashes are not reported anyway
+    if (functions || thresh > 0) {
+      pl.only_counted = 1;
+      pl.count = pl.ncounted;
     }
   }
+  cut_chunks(&pl, nthreads);
+  ws_run(pl.nchunks, nthreads, !opt_u, stdout, compare_chunk, &pl);
+  free(pl.chunks);
+  free(counted);
+  free(keys);
 
   // free the hashes of each list item
   for (int i = 0; i < sl_cnt; i++) {
-    sig_t *sig = &siglist[i];
-    free(sig->fname);
-    free(sig->hashes);
+    free_sig(&siglist[i]);
   }
   // free the list itself
   free(siglist);
 
   // free the hashes of the basefile
-  free(basesig.fname);
-  free(basesig.hashes);
+  free_sig(&basesig);
 
   return 0;
 }
@@ -241,74 +666,328 @@ sig_t *new_sig(void)
 }
 
 
-void load(const char *fname, sig_t *sig)
+/**
+ * The function of the hash at position i of segment k of sig, or
+ * UINT32_MAX if none.
+ */
+static uint32_t func_of(const sig_t *sig, int k, uint32_t i)
+{
+  const struct idx_file *ix = &sig->sv.segs[k];
+  if (ix->tags == NULL || ix->tags[i] >= ix->nfuncs) return UINT32_MAX;
+  return sig->fnum[k][ix->tags[i]];
+}
+
+/**
+ * Free what was loaded for sig.
+ */
+void free_sig(sig_t *sig)
+{
+  free(sig->fname);
+  free(sig->funcs);
+  for (int k = 0; k < sig->sv.nsegs; k++) {
+    if (sig->fnum != NULL) free(sig->fnum[k]);
+    if (sig->excl != NULL) free(sig->excl[k]);
+  }
+  free(sig->fnum);
+  free(sig->excl);
+  store_close(&sig->sv);
+}
+
+
+/**
+ * Collect the functions of an index, or of the live files of a store one
+ * segment after the other, with the number of their hashes.
+ */
+static void load_funcs(sig_t *sig)
 {
-  FILE *f;
-  uint32_t hash_count;
-  hash_entry_t *hash_buf;
+  const struct store_view *sv = &sig->sv;
+  int tags = 0;
+  uint64_t nfuncs = 0;
+  for (int k = 0; k < sv->nsegs; k++) {
+    if (sv->segs[k].tags != NULL) tags = 1;
+    nfuncs += sv->segs[k].nfuncs;
+  }
+  if (!tags) {
+    (void) fprintf(stderr, "%s: no functions in %s\n",
+        program_name, sig->fname);
+    return;
+  }
+  sig->funcs = malloc(nfuncs * sizeof(func_t));
+  sig->fnum = malloc(sv->nsegs * sizeof(uint32_t *));
+  if ((nfuncs > 0 && sig->funcs == NULL) || sig->fnum == NULL) {
+    error_exit("can't allocate buffer");
+  }
+  unsigned n = 0;
+  for (int k = 0; k < sv->nsegs; k++) {
+    const struct idx_file *ix = &sv->segs[k];
+    sig->fnum[k] = malloc((ix->nfuncs > 0 ? ix->nfuncs : 1) *
+        sizeof(uint32_t));
+    if (sig->fnum[k] == NULL) {
+      error_exit("can't allocate buffer");
+    }
+    for (uint32_t i = 0; i < ix->nfuncs; i++) {
+      const struct idx_funcrec *fr = &ix->funcs[i];
+      // the functions of dropped files are left out
+      if (sv->drop[k] != NULL && sv->drop[k][fr->file]) {
+        sig->fnum[k][i] = UINT32_MAX;
+        continue;
+      }
+      func_t *f = &sig->funcs[n];
+      f->seg = k;
+      f->file = fr->file;
+      f->name = ix->names + fr->name;
+      f->first_line = fr->first_line;
+      f->last_line = fr->last_line;
+      f->count = 0;
+      sig->fnum[k][i] = n++;
+    }
+  }
+  sig->nfuncs = n;
+
+  // the number of hashes of each function; hashes of no function have
+  // tags out of range
+  for (int k = 0; k < sv->nsegs; k++) {
+    const struct idx_file *ix = &sv->segs[k];
+    for (uint32_t i = 1; i < ix->count; i++) {
+      if (store_dead(sv, k, idx_seq(ix, i))) continue;
+      uint32_t g = func_of(sig, k, i);
+      if (g < sig->nfuncs) sig->funcs[g].count++;
+    }
+  }
+}
+
 
-  f = fopen(fname, "r");
-  if (f == NULL) {
+void load(const char *fname, sig_t *sig)
+{
+  memset(sig, 0, sizeof *sig);
+  DBG("Reading '%s'\n", fname);
+  int res = store_open(&sig->sv, fname);
+  if (res == -1) {
     // if we cannot open a file, we simply return without reading it
     (void) fprintf(stderr, "%s: cannot open %s: %s - skipping\n",
         program_name, fname, strerror(errno));
     return;
   }
-  DBG("Reading '%s'\n", fname);
-  if (fread(&hash_count, sizeof hash_count, 1, f) != 1) {
-    goto fail;
+  if (res != 0) {
+    char msg[PATH_MAX];
+    (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
+    error_exit(msg);
   }
-  hash_buf = malloc(hash_count * sizeof(hash_entry_t));
-  if (hash_buf == NULL) {
-    error_exit("can't allocate buffer");
+  sig->fname = strdup(fname);
+  sig->count = sig->sv.count;
+  if (functions) load_funcs(sig);
+}
+
+/**
+ * Find the slot of hash h in a table of the basefile: the slot holding
+ * it, or the free slot it would be stored in.
+ */
+static size_t base_slot(const basehash_t *table, size_t capacity, hash_t h)
+{
+  uint64_t k = h * 0x9e3779b97f4a7c15ULL;
+  size_t slot = (k ^ k >> 32) & (capacity - 1);
+  while (table[slot].count != 0 && table[slot].hash != h)
+    slot = (slot + 1) & (capacity - 1);
+  return slot;
+}
+
+/**
+ * Collect the hashes of the basefile sb into a table, to be freed by the
+ * caller, and store its capacity in *capacity.
+ */
+basehash_t *base_table(sig_t *sb, size_t *capacity)
+{
+  size_t cap = 1024;
+  while (cap < 2 * (size_t) sb->count) cap *= 2;
+  basehash_t *table = calloc(cap, sizeof(basehash_t));
+  if (table == NULL) {
+    error_exit("cannot allocate memory");
   }
-  if (fread(hash_buf, sizeof(hash_entry_t),
-        hash_count, f) != hash_count) {
-    goto fail;
+  struct store_iter it;
+  store_iter_init(&it, &sb->sv);
+  while (store_iter_next(&it)) {
+    basehash_t *b = &table[base_slot(table, cap, it.hash)];
+    b->hash = it.hash;
+    b->count++;
   }
-  (void) fclose(f);
+  store_iter_free(&it);
+  *capacity = cap;
+  return table;
+}
 
-  sig->fname = strdup(fname);
-  sig->count = hash_count;
-  sig->hashes = hash_buf;
-  return;
-
-fail: ;
-  char msg[PATH_MAX];
-  (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
-  error_exit(msg);
+/**
+ * Mark the hashes of sig excluded by the basefile, given by a table of
+ * its hashes.  Of a run of a hash, as many are marked from the first one
+ * on as the basefile holds: two runs are matched one by one, so each
+ * match consumes a hash of the basefile, and the k-th match is marked in
+ * both signatures alike.  The hashes of a store are marked in each of its
+ * segments, in the order they are merged in.
+ */
+void mark_base(sig_t *sig, const basehash_t *table, size_t capacity)
+{
+  if (sig->count <= 1) return;
+  const struct store_view *sv = &sig->sv;
+  sig->excl = malloc(sv->nsegs * sizeof(uint8_t *));
+  if (sig->excl == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (int k = 0; k < sv->nsegs; k++) {
+    sig->excl[k] = calloc(sv->segs[k].count, 1);
+    if (sig->excl[k] == NULL) {
+      error_exit("cannot allocate memory");
+    }
+  }
+  hash_t prev = 0;
+  uint32_t run = 0, nbase = 0;
+  struct store_iter it;
+  store_iter_init(&it, sv);
+  for (uint32_t i = 1; store_iter_next(&it); i++) {
+    hash_t h = it.hash;
+    if (i == 1 || h != prev) {
+      nbase = table[base_slot(table, capacity, h)].count;
+      run = 0;
+      prev = h;
+    }
+    sig->excl[it.seg][it.i] = run++ < nbase;
+  }
+  store_iter_free(&it);
+}
+
+/**
+ * The index of sig if it is a single segment without dropped hashes, or
+ * NULL.
+ */
+static const struct idx_file *sig_index(const sig_t *sig)
+{
+  if (sig->sv.nsegs != 1 || sig->sv.dead[0] != NULL) return NULL;
+  return &sig->sv.segs[0];
 }
 
 /**
  * Given two fingerprints s0 and s1, count the number of common
  * fingerprints (nboth) and the number of common fingerprints that need to be
- * excluded because they appear in sb (nexcl).
+ * excluded because they appear in the basefile (nexcl), as marked by
+ * mark_base().  Hashes of indices in place are intersected by
+ * isect_count(); otherwise, runs of hashes of one that are less than the
+ * next hash of the other are skipped with store_iter_seek().
  */
-void count(int *nboth, int *nexcl, sig_t *s0, sig_t *s1, sig_t *sb)
+void count(int *nboth, int *nexcl, sig_t *s0, sig_t *s1)
 {
-  int i0=1, i1=1, ib=1, lboth=0, lexcl=0;
-  while (i0 < s0->count || i1 < s1->count) {
-    int cmp = 0;
-    if (!(i0 < s0->count)) {
-      cmp = 1;
-    } else if (!(i1 < s1->count)) {
-      cmp = -1;
+  const struct idx_file *ix0 = sig_index(s0), *ix1 = sig_index(s1);
+  if (ix0 != NULL && ix1 != NULL && ix0->hashes != NULL &&
+      ix1->hashes != NULL && s0->count > 1 && s1->count > 1) {
+    uint32_t lexcl;
+    *nboth = isect_count(ix0->hashes + 1, s0->count - 1,
+        s0->excl != NULL ? s0->excl[0] + 1 : NULL,
+        ix1->hashes + 1, s1->count - 1,
+        s1->excl != NULL ? s1->excl[0] + 1 : NULL, &lexcl);
+    *nexcl = lexcl;
+    return;
+  }
+  struct store_iter it0, it1;
+  store_iter_init(&it0, &s0->sv);
+  store_iter_init(&it1, &s1->sv);
+  int lboth=0, lexcl=0;
+  int more = store_iter_next(&it0) && store_iter_next(&it1);
+  while (more) {
+    if (it0.hash < it1.hash) {
+      more = store_iter_seek(&it0, it1.hash);
+    } else if (it0.hash > it1.hash) {
+      more = store_iter_seek(&it1, it0.hash);
     } else {
-      cmp = hash_cmp(&s0->hashes[i0], &s1->hashes[i1]);
-    }
-    if (cmp == 0) {
       lboth++;
-      // check against the base file
-      while (ib < sb->count &&
-          hash_cmp(&sb->hashes[ib], &s0->hashes[i0]) < 0) ib++;
-      if (ib < sb->count && hash_cmp(&sb->hashes[ib], &s0->hashes[i0]) == 0) {
-        lexcl++;
-        ib++;
-      }
+      if (s0->excl != NULL) lexcl += s0->excl[it0.seg][it0.i];
+      more = store_iter_next(&it0) && store_iter_next(&it1);
     }
-    if (cmp <= 0) i0++;
-    if (cmp >= 0) i1++;
   }
+  store_iter_free(&it0);
+  store_iter_free(&it1);
   *nboth = lboth;
   *nexcl = lexcl;
 }
+
+/**
+ * Find the slot of key in a table of pairs: the slot holding it, or the
+ * free slot it would be stored in.
+ */
+static size_t pair_slot(const funcpair_t *table, size_t capacity,
+    uint64_t key)
+{
+  uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+  size_t slot = (h ^ h >> 32) & (capacity - 1);
+  while (table[slot].key != UINT64_MAX && table[slot].key != key)
+    slot = (slot + 1) & (capacity - 1);
+  return slot;
+}
+
+/**
+ * Given two fingerprints s0 and s1 with functions, count the common
+ * fingerprints of each pair of functions, like count() does for the
+ * files.  Store the pairs with common fingerprints in *pairs, to be freed
+ * by the caller, and return their number.
+ */
+size_t count_funcs(funcpair_t **pairs, sig_t *s0, sig_t *s1)
+{
+  // open addressing, keys of all ones mark free slots
+  size_t capacity = 1024, npairs = 0;
+  funcpair_t *table = malloc(capacity * sizeof(funcpair_t));
+  if (table == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  memset(table, 0xff, capacity * sizeof(funcpair_t));
+
+  struct store_iter it0, it1;
+  store_iter_init(&it0, &s0->sv);
+  store_iter_init(&it1, &s1->sv);
+  int more = store_iter_next(&it0) && store_iter_next(&it1);
+  while (more) {
+    if (it0.hash < it1.hash) {
+      more = store_iter_seek(&it0, it1.hash);
+      continue;
+    }
+    if (it0.hash > it1.hash) {
+      more = store_iter_seek(&it1, it0.hash);
+      continue;
+    }
+    int excl = s0->excl != NULL ? s0->excl[it0.seg][it0.i] : 0;
+    uint32_t f0 = s0->nfuncs > 0 ? func_of(s0, it0.seg, it0.i) : UINT32_MAX;
+    uint32_t f1 = s1->nfuncs > 0 ? func_of(s1, it1.seg, it1.i) : UINT32_MAX;
+    if (f0 < s0->nfuncs && f1 < s1->nfuncs) {
+      if (2 * (npairs + 1) > capacity) {
+        // rehash into a table of twice the size
+        funcpair_t *old = table;
+        capacity *= 2;
+        table = malloc(capacity * sizeof(funcpair_t));
+        if (table == NULL) {
+          error_exit("cannot allocate memory");
+        }
+        memset(table, 0xff, capacity * sizeof(funcpair_t));
+        for (size_t k = 0; k < capacity / 2; k++) {
+          if (old[k].key == UINT64_MAX) continue;
+          table[pair_slot(table, capacity, old[k].key)] = old[k];
+        }
+        free(old);
+      }
+      uint64_t key = (uint64_t) f0 << 32 | f1;
+      size_t slot = pair_slot(table, capacity, key);
+      if (table[slot].key == UINT64_MAX) {
+        table[slot].key = key;
+        table[slot].nboth = table[slot].nexcl = 0;
+        npairs++;
+      }
+      table[slot].nboth++;
+      table[slot].nexcl += excl;
+    }
+    more = store_iter_next(&it0) && store_iter_next(&it1);
+  }
+  store_iter_free(&it0);
+  store_iter_free(&it1);
+
+  // compact the pairs
+  size_t n = 0;
+  for (size_t k = 0; k < capacity; k++) {
+    if (table[k].key != UINT64_MAX) table[n++] = table[k];
+  }
+  *pairs = table;
+  return n;
+}
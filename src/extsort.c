@@ -0,0 +1,385 @@
+/**
+ * Sorting of hash entries, in memory and external.
+ *
+ * In memory, the entries are sorted by a radix sort, which is stable, so
+ * equal hashes stay in input order: a first pass distributes them by their
+ * most significant byte, then each of these buckets is sorted by the
+ * remaining bytes, least significant first.  Both steps run in parallel on
+ * large inputs.
+ *
+ * The external sort writes sorted runs of entries to temporary files, in
+ * host byte order, and merges them with a heap.  Equal hashes are taken
+ * from the earlier run first, which keeps them in input order.  If there
+ * are too many runs to be merged at once, the runs so far are merged into
+ * a single one first.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "extsort.h"
+
+// inputs smaller than this are sorted by a single thread
+#define SORT_PARALLEL_MIN (1 << 20)
+// buckets smaller than this are sorted by insertion
+#define SORT_INSERTION_MAX 32
+
+// the byte of a hash at shift
+#define DIGIT(h, shift) ((unsigned) ((h) >> (shift)) & 0xff)
+
+
+
+/**
+ * Sort the n entries at a by insertion, stably.
+ */
+static void insertion_sort(hash_entry_t *a, size_t n)
+{
+  for (size_t i = 1; i < n; i++) {
+    hash_entry_t e = a[i];
+    size_t j = i;
+    for (; j > 0 && a[j - 1].hash > e.hash; j--) a[j] = a[j - 1];
+    a[j] = e;
+  }
+}
+
+
+/**
+ * Sort the n entries at src stably by the 7 low bytes of their hashes,
+ * into dst.  Both are used as buffers.
+ */
+static void radix_sort(hash_entry_t *src, hash_entry_t *dst, size_t n)
+{
+  if (n <= SORT_INSERTION_MAX) {
+    memcpy(dst, src, n * sizeof(hash_entry_t));
+    insertion_sort(dst, n);
+    return;
+  }
+
+  hash_entry_t *out = dst;
+
+  // the counts of all digits in a single pass
+  size_t count[7][256] = {{0}};
+  for (size_t i = 0; i < n; i++) {
+    for (int d = 0; d < 7; d++) count[d][DIGIT(src[i].hash, 8 * d)]++;
+  }
+  for (int d = 0; d < 7; d++) {
+    // skip the digits all hashes agree on
+    if (count[d][DIGIT(src[0].hash, 8 * d)] == n) continue;
+    size_t offset[256], sum = 0;
+    for (int b = 0; b < 256; b++) {
+      offset[b] = sum;
+      sum += count[d][b];
+    }
+    for (size_t i = 0; i < n; i++) {
+      dst[offset[DIGIT(src[i].hash, 8 * d)]++] = src[i];
+    }
+    hash_entry_t *t = src;
+    src = dst;
+    dst = t;
+  }
+  // the result is in src after the last pass
+  if (src != out) memcpy(out, src, n * sizeof(hash_entry_t));
+}
+
+
+/**
+ * A sort shared by several threads: the entries in a are distributed to
+ * tmp by their most significant byte in chunks, then the buckets are
+ * sorted back into a.
+ */
+struct sort {
+  hash_entry_t *a, *tmp;
+  size_t n;
+  int nthreads;
+  size_t (*count)[256]; // of each chunk, then its offsets in tmp
+  size_t bucket[257];   // start of each bucket in tmp
+  unsigned next_bucket; // next bucket to be sorted
+  pthread_mutex_t lock;
+  pthread_barrier_t barrier;
+};
+
+struct sort_thread {
+  struct sort *sort;
+  int id;
+  pthread_t thread;
+};
+
+
+static void *sort_run(void *arg)
+{
+  struct sort_thread *st = arg;
+  struct sort *s = st->sort;
+  size_t begin = s->n * st->id / s->nthreads;
+  size_t end = s->n * (st->id + 1) / s->nthreads;
+  size_t *count = s->count[st->id];
+
+  // count the most significant bytes of the chunk
+  for (size_t i = begin; i < end; i++) count[DIGIT(s->a[i].hash, 56)]++;
+  (void) pthread_barrier_wait(&s->barrier);
+
+  // the offsets of the chunks in each bucket, in order to be stable
+  if (st->id == 0) {
+    size_t sum = 0;
+    for (int b = 0; b < 256; b++) {
+      s->bucket[b] = sum;
+      for (int t = 0; t < s->nthreads; t++) {
+        size_t c = s->count[t][b];
+        s->count[t][b] = sum;
+        sum += c;
+      }
+    }
+    s->bucket[256] = sum;
+  }
+  (void) pthread_barrier_wait(&s->barrier);
+
+  for (size_t i = begin; i < end; i++) {
+    s->tmp[count[DIGIT(s->a[i].hash, 56)]++] = s->a[i];
+  }
+  (void) pthread_barrier_wait(&s->barrier);
+
+  // sort the buckets, the largest ones are not known in advance
+  for (;;) {
+    (void) pthread_mutex_lock(&s->lock);
+    unsigned b = s->next_bucket++;
+    (void) pthread_mutex_unlock(&s->lock);
+    if (b >= 256) break;
+    size_t first = s->bucket[b], n = s->bucket[b + 1] - first;
+    radix_sort(&s->tmp[first], &s->a[first], n);
+  }
+  return NULL;
+}
+
+
+void hashes_sort(hash_entry_t *a, size_t n, int nthreads)
+{
+  struct sort s;
+  if (n < SORT_PARALLEL_MIN) nthreads = 1;
+  s.a = a;
+  s.n = n;
+  s.nthreads = nthreads;
+  s.next_bucket = 0;
+  s.tmp = malloc(n * sizeof(hash_entry_t));
+  s.count = calloc(nthreads, sizeof *s.count);
+  struct sort_thread *threads = malloc(nthreads * sizeof *threads);
+  if ((n > 0 && s.tmp == NULL) || s.count == NULL || threads == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  (void) pthread_mutex_init(&s.lock, NULL);
+  (void) pthread_barrier_init(&s.barrier, NULL, nthreads);
+  for (int i = 0; i < nthreads; i++) {
+    threads[i].sort = &s;
+    threads[i].id = i;
+    if (i == 0) continue;
+    errno = pthread_create(&threads[i].thread, NULL, sort_run, &threads[i]);
+    if (errno != 0) {
+      error_exit("cannot create thread");
+    }
+  }
+  // the calling thread takes part
+  (void) sort_run(&threads[0]);
+  for (int i = 1; i < nthreads; i++) {
+    (void) pthread_join(threads[i].thread, NULL);
+  }
+  (void) pthread_barrier_destroy(&s.barrier);
+  (void) pthread_mutex_destroy(&s.lock);
+  free(threads);
+  free(s.count);
+  free(s.tmp);
+}
+
+
+// most runs merged at once
+#define MERGE_MAX 64
+// fewest entries sorted in memory at once
+#define XS_CAPACITY_MIN 1024
+
+
+FILE *temp_file(void)
+{
+  const char *dir = getenv("TMPDIR");
+  if (dir == NULL || *dir == '\0') dir = "/tmp";
+  size_t len = strlen(dir) + sizeof "/fpcc-XXXXXX";
+  char *name = malloc(len);
+  if (name == NULL)
+    error_exit("cannot allocate memory");
+  (void) snprintf(name, len, "%s/fpcc-XXXXXX", dir);
+  int fd = mkstemp(name);
+  if (fd == -1)
+    error_exit("cannot create temporary file");
+  (void) unlink(name);
+  free(name);
+  FILE *f = fdopen(fd, "w+");
+  if (f == NULL)
+    error_exit("cannot create temporary file");
+  return f;
+}
+
+
+void xs_init(struct extsort *xs, size_t memory, int threads)
+{
+  memset(xs, 0, sizeof *xs);
+  // the radix sort takes as much memory again
+  xs->capacity = memory / (2 * sizeof(hash_entry_t));
+  if (xs->capacity < XS_CAPACITY_MIN) xs->capacity = XS_CAPACITY_MIN;
+  xs->threads = threads;
+}
+
+
+/**
+ * Check whether the head of run a comes before the one of run b.
+ */
+static int run_before(const struct extsort *xs, size_t a, size_t b)
+{
+  if (xs->heads[a].hash != xs->heads[b].hash)
+    return xs->heads[a].hash < xs->heads[b].hash;
+  return a < b;
+}
+
+
+static void heap_down(struct extsort *xs, size_t i)
+{
+  size_t run = xs->heap[i];
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= xs->nheap) break;
+    if (c + 1 < xs->nheap && run_before(xs, xs->heap[c + 1], xs->heap[c]))
+      c++;
+    if (!run_before(xs, xs->heap[c], run)) break;
+    xs->heap[i] = xs->heap[c];
+    i = c;
+  }
+  xs->heap[i] = run;
+}
+
+
+static int run_read(struct extsort *xs, size_t run)
+{
+  if (fread(&xs->heads[run], sizeof(hash_entry_t), 1, xs->runs[run]) == 1)
+    return 1;
+  if (ferror(xs->runs[run]))
+    error_exit("cannot read temporary file");
+  return 0;
+}
+
+
+/**
+ * Start merging the runs.
+ */
+static void merge_start(struct extsort *xs)
+{
+  free(xs->heap);
+  free(xs->heads);
+  xs->heap = malloc(xs->nruns * sizeof(size_t));
+  xs->heads = malloc(xs->nruns * sizeof(hash_entry_t));
+  if (xs->heap == NULL || xs->heads == NULL)
+    error_exit("cannot allocate memory");
+  xs->nheap = 0;
+  for (size_t r = 0; r < xs->nruns; r++) {
+    rewind(xs->runs[r]);
+    if (run_read(xs, r)) xs->heap[xs->nheap++] = r;
+  }
+  for (size_t i = xs->nheap / 2; i-- > 0; ) heap_down(xs, i);
+}
+
+
+static int merge_next(struct extsort *xs, hash_entry_t *e)
+{
+  if (xs->nheap == 0) return 0;
+  size_t run = xs->heap[0];
+  *e = xs->heads[run];
+  if (!run_read(xs, run)) xs->heap[0] = xs->heap[--xs->nheap];
+  if (xs->nheap > 0) heap_down(xs, 0);
+  return 1;
+}
+
+
+/**
+ * Merge all runs into a single one.
+ */
+static void merge_runs(struct extsort *xs)
+{
+  FILE *out = temp_file();
+  hash_entry_t e;
+  merge_start(xs);
+  while (merge_next(xs, &e)) {
+    if (fwrite(&e, sizeof e, 1, out) != 1)
+      error_exit("cannot write temporary file");
+  }
+  for (size_t r = 0; r < xs->nruns; r++) (void) fclose(xs->runs[r]);
+  xs->runs[0] = out;
+  xs->nruns = 1;
+}
+
+
+/**
+ * Sort the buffer and write it as a run.
+ */
+static void spill(struct extsort *xs)
+{
+  if (xs->nruns == MERGE_MAX) merge_runs(xs);
+  if (xs->nruns % MERGE_MAX == 0) {
+    FILE **new_runs = realloc(xs->runs, (xs->nruns + MERGE_MAX) *
+        sizeof(FILE *));
+    if (new_runs == NULL)
+      error_exit("cannot allocate memory");
+    xs->runs = new_runs;
+  }
+  hashes_sort(xs->buf, xs->count, xs->threads);
+  FILE *f = temp_file();
+  if (fwrite(xs->buf, sizeof(hash_entry_t), xs->count, f) != xs->count)
+    error_exit("cannot write temporary file");
+  xs->runs[xs->nruns++] = f;
+  xs->count = 0;
+}
+
+
+void xs_add(struct extsort *xs, const hash_entry_t *e)
+{
+  if (xs->buf == NULL) {
+    xs->buf = malloc(xs->capacity * sizeof(hash_entry_t));
+    if (xs->buf == NULL)
+      error_exit("cannot allocate memory");
+  }
+  if (xs->count == xs->capacity) spill(xs);
+  xs->buf[xs->count++] = *e;
+}
+
+
+void xs_finish(struct extsort *xs)
+{
+  if (xs->nruns == 0) {
+    // everything fits into memory
+    hashes_sort(xs->buf, xs->count, xs->threads);
+    xs->next = 0;
+    return;
+  }
+  if (xs->count > 0) spill(xs);
+  free(xs->buf);
+  xs->buf = NULL;
+  merge_start(xs);
+}
+
+
+int xs_next(struct extsort *xs, hash_entry_t *e)
+{
+  if (xs->nruns > 0) return merge_next(xs, e);
+  if (xs->next == xs->count) return 0;
+  *e = xs->buf[xs->next++];
+  return 1;
+}
+
+
+void xs_free(struct extsort *xs)
+{
+  for (size_t r = 0; r < xs->nruns; r++) (void) fclose(xs->runs[r]);
+  free(xs->runs);
+  free(xs->heap);
+  free(xs->heads);
+  free(xs->buf);
+  memset(xs, 0, sizeof *xs);
+}
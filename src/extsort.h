@@ -0,0 +1,64 @@
+#ifndef _EXTSORT_H_
+#define _EXTSORT_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+ * Sorting of hash entries by their hashes, in memory or, for more entries
+ * than fit into a bounded amount of memory, in temporary files.
+ */
+
+/**
+ * Sort the n entries at a stably by their hashes, with up to nthreads
+ * threads.
+ */
+void hashes_sort(hash_entry_t *a, size_t n, int nthreads);
+
+/**
+ * An external sort: the entries added are collected in a buffer, and each
+ * time it is full, it is sorted and written to a temporary file as a run.
+ * The runs are merged while the entries are read back.  Entries with equal
+ * hashes are read back in the order they were added.
+ */
+struct extsort {
+  hash_entry_t *buf;
+  size_t count, capacity;
+  int threads;
+  FILE **runs;
+  size_t nruns;
+  size_t *heap;  // runs by their next entry, while merging
+  hash_entry_t *heads;
+  size_t nheap;
+  size_t next;   // next entry of buf, without runs
+};
+
+/**
+ * Initialize an empty sort using about memory bytes, sorting with up to
+ * threads threads.
+ */
+void xs_init(struct extsort *xs, size_t memory, int threads);
+
+void xs_add(struct extsort *xs, const hash_entry_t *e);
+
+/**
+ * Finish adding entries, and start reading them back.
+ */
+void xs_finish(struct extsort *xs);
+
+/**
+ * Read the next entry in sorted order.  Return 1 on success, 0 at the end.
+ */
+int xs_next(struct extsort *xs, hash_entry_t *e);
+
+void xs_free(struct extsort *xs);
+
+/**
+ * Create a temporary file in $TMPDIR, or /tmp, which is removed when
+ * closed.  Exit on error.
+ */
+FILE *temp_file(void);
+
+#endif // _EXTSORT_H_
@@ -0,0 +1,488 @@
+/**
+ * Finding the function definitions in the tokens of a C file.
+ *
+ * The tokens are fed to the parser generated from ccode.y, which reports
+ * each function definition with the range of its tokens.  As the source is
+ * not preprocessed, the parser sees code of all conditional branches,
+ * macro invocations and compiler extensions, and does not know the typedef
+ * names declared in headers.  Therefore the lexer of the parser skips the
+ * common GNU extensions and guesses which identifiers are typedef names,
+ * and parts that cannot be parsed are skipped by error recovery.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "fparse.h"
+
+extern int ccparse(struct fparser *fp);
+
+/**
+ * The state of parsing a token stream.
+ */
+struct fparser {
+  const struct tokstream *ts;
+  size_t pos;     // next token
+  int depth;      // brace depth at pos
+  int in_typedef; // a typedef declaration is being parsed
+  int restart;    // parse again from pos, the input ends for now
+  // names declared by typedef, open addressing of offsets in ts->names
+  int *typedefs;
+  size_t ntypedefs, typedefs_capacity;
+  struct fpfunc *funcs; // the functions found
+  size_t nfuncs, funcs_capacity;
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Token stream
+///////////////////////////////////////////////////////////////////////////////
+
+void ts_add(struct tokstream *ts, int tok, int line,
+    const char *text, size_t len)
+{
+  if (ts->count == ts->capacity) {
+    ts->capacity = ts->capacity > 0 ? 2 * ts->capacity : 4096;
+    ts->tok = realloc(ts->tok, ts->capacity * sizeof(int));
+    ts->line = realloc(ts->line, ts->capacity * sizeof(int));
+    ts->name = realloc(ts->name, ts->capacity * sizeof(int));
+    if (ts->tok == NULL || ts->line == NULL || ts->name == NULL)
+      error_exit("cannot allocate memory");
+  }
+  ts->tok[ts->count] = tok;
+  ts->line[ts->count] = line;
+  ts->name[ts->count] = -1;
+  if (tok == IDENTIFIER && text != NULL) {
+    if (ts->namescap - ts->nameslen < len + 1) {
+      while (ts->namescap - ts->nameslen < len + 1)
+        ts->namescap = ts->namescap > 0 ? 2 * ts->namescap : 16 * 1024;
+      ts->names = realloc(ts->names, ts->namescap);
+      if (ts->names == NULL)
+        error_exit("cannot allocate memory");
+    }
+    memcpy(ts->names + ts->nameslen, text, len);
+    ts->names[ts->nameslen + len] = '\0';
+    ts->name[ts->count] = ts->nameslen;
+    ts->nameslen += len + 1;
+  }
+  ts->count++;
+}
+
+
+void ts_clear(struct tokstream *ts)
+{
+  ts->count = 0;
+  ts->nameslen = 0;
+}
+
+
+void ts_free(struct tokstream *ts)
+{
+  free(ts->tok);
+  free(ts->line);
+  free(ts->name);
+  free(ts->names);
+  memset(ts, 0, sizeof *ts);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Typedef names
+///////////////////////////////////////////////////////////////////////////////
+
+static size_t name_hash(const char *s)
+{
+  size_t h = 2166136261u;
+  while (*s != '\0') h = (h ^ (unsigned char) *s++) * 16777619u;
+  return h;
+}
+
+
+/**
+ * Find the slot of name in the typedef table: the slot holding it, or the
+ * empty slot it would be stored in.
+ */
+static size_t typedef_slot(const struct fparser *fp, const char *name)
+{
+  size_t mask = fp->typedefs_capacity - 1;
+  size_t i = name_hash(name) & mask;
+  while (fp->typedefs[i] != -1 &&
+      strcmp(fp->ts->names + fp->typedefs[i], name) != 0)
+    i = (i + 1) & mask;
+  return i;
+}
+
+
+static int is_typedef(const struct fparser *fp, const char *name)
+{
+  return fp->ntypedefs > 0 &&
+    fp->typedefs[typedef_slot(fp, name)] != -1;
+}
+
+
+static void typedef_add(struct fparser *fp, int name)
+{
+  if (2 * (fp->ntypedefs + 1) > fp->typedefs_capacity) {
+    int *old = fp->typedefs;
+    size_t old_capacity = fp->typedefs_capacity;
+    fp->typedefs_capacity = old_capacity > 0 ? 2 * old_capacity : 64;
+    fp->typedefs = malloc(fp->typedefs_capacity * sizeof(int));
+    if (fp->typedefs == NULL)
+      error_exit("cannot allocate memory");
+    for (size_t i = 0; i < fp->typedefs_capacity; i++)
+      fp->typedefs[i] = -1;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i] != -1)
+        fp->typedefs[typedef_slot(fp, fp->ts->names + old[i])] = old[i];
+    }
+    free(old);
+  }
+  size_t i = typedef_slot(fp, fp->ts->names + name);
+  if (fp->typedefs[i] == -1) {
+    fp->typedefs[i] = name;
+    fp->ntypedefs++;
+  }
+}
+
+
+/*
+ * Type names of the standard library commonly used without the header
+ * declaring them being seen; names ending in _t are taken as types, too.
+ */
+static const char *const builtin_types[] = {
+  "FILE", "DIR", "va_list", "__builtin_va_list", "jmp_buf", "sigjmp_buf",
+  "fd_set", "bool", "__int128",
+};
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Lexer
+///////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Identifiers of GNU extensions: skipped, skipped with the parenthesized
+ * list following them, or taken as a keyword.
+ */
+#define EXT_SKIP   -1
+#define EXT_PARENS -2
+#define EXT_TYPEOF -3
+
+static const struct extension {
+  const char *name;
+  int tok;
+} extensions[] = {
+  {"__attribute__", EXT_PARENS}, {"__attribute", EXT_PARENS},
+  {"__declspec", EXT_PARENS}, {"__asm__", EXT_PARENS},
+  {"__asm", EXT_PARENS}, {"asm", EXT_PARENS},
+  {"__extension__", EXT_SKIP},
+  {"__typeof__", EXT_TYPEOF}, {"__typeof", EXT_TYPEOF},
+  {"typeof", EXT_TYPEOF},
+  {"__inline__", INLINE}, {"__inline", INLINE},
+  {"__restrict__", RESTRICT}, {"__restrict", RESTRICT},
+  {"__const__", CONST}, {"__const", CONST},
+  {"__volatile__", VOLATILE}, {"__volatile", VOLATILE},
+  {"__signed__", SIGNED}, {"__signed", SIGNED},
+};
+
+
+static int extension(const char *name)
+{
+  if (name[0] != '_' && name[0] != 'a' && name[0] != 't') return 0;
+  for (size_t i = 0; i < sizeof extensions / sizeof extensions[0]; i++) {
+    if (strcmp(extensions[i].name, name) == 0) return extensions[i].tok;
+  }
+  return 0;
+}
+
+
+static inline int tok_at(const struct fparser *fp, size_t i)
+{
+  return i < fp->ts->count ? fp->ts->tok[i] : 0;
+}
+
+static inline const char *name_at(const struct fparser *fp, size_t i)
+{
+  return fp->ts->names + fp->ts->name[i];
+}
+
+
+/**
+ * Check whether a token can only continue a declaration: a keyword of
+ * a type, storage class or qualifier.
+ */
+static int is_specifier(int tok)
+{
+  switch (tok) {
+    case VOID: case CHAR: case SHORT: case INT: case LONG: case FLOAT:
+    case DOUBLE: case SIGNED: case UNSIGNED: case BOOL: case STRUCT:
+    case UNION: case ENUM: case CONST: case VOLATILE: case STATIC:
+    case EXTERN: case INLINE:
+      return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Return the index of the parenthesis closing the one at token i.
+ */
+static size_t match_paren(const struct fparser *fp, size_t i)
+{
+  int level = 0;
+  for (; i < fp->ts->count; i++) {
+    if (fp->ts->tok[i] == '(') level++;
+    else if (fp->ts->tok[i] == ')' && --level == 0) break;
+  }
+  return i;
+}
+
+
+/**
+ * Skip the parenthesized list starting at the next token, if any,
+ * along with asm qualifiers before it.
+ */
+static void skip_parens(struct fparser *fp)
+{
+  const struct tokstream *ts = fp->ts;
+  while (tok_at(fp, fp->pos) == VOLATILE || tok_at(fp, fp->pos) == INLINE ||
+      tok_at(fp, fp->pos) == GOTO)
+    fp->pos++;
+  if (tok_at(fp, fp->pos) != '(') return;
+  fp->pos = match_paren(fp, fp->pos) + 1;
+  if (fp->pos > ts->count) fp->pos = ts->count;
+}
+
+
+/**
+ * Check whether the identifier at token i is a macro invocation standing
+ * for (a part of) the type of a declaration at file scope, e.g.
+ * NORETURN(void) f(...).  Such macros take a single argument, unlike the
+ * K&R definitions they are confused with.  Return the index of the closing
+ * parenthesis, or 0 if not.
+ */
+static size_t type_macro(const struct fparser *fp, size_t i)
+{
+  if (fp->depth > 0 || tok_at(fp, i + 1) != '(') return 0;
+  switch (i > 0 ? fp->ts->tok[i - 1] : ';') {
+    case ';': case '}': case STATIC: case EXTERN: case INLINE: case CONST:
+      break;
+    default:
+      return 0;
+  }
+  size_t j = match_paren(fp, i + 1);
+  for (size_t k = i + 2; k < j; k++)
+    if (fp->ts->tok[k] == ',') return 0;
+  int after = tok_at(fp, j + 1);
+  if (after == '*' || is_specifier(after) ||
+      (after == IDENTIFIER && extension(name_at(fp, j + 1)) != EXT_PARENS))
+    return j;
+  return 0;
+}
+
+
+/**
+ * Guess whether the identifier at token i is a typedef name.
+ *
+ * Besides the names declared by typedef, an identifier is taken as a type
+ * where a declaration would be valid and an expression would not, or is
+ * unlikely: followed by another identifier, in a cast, or starting a
+ * declaration of a pointer.
+ */
+static int is_type(const struct fparser *fp, size_t i)
+{
+  const char *name = name_at(fp, i);
+  int prev = i > 0 ? fp->ts->tok[i - 1] : ';';
+  int next = tok_at(fp, i + 1);
+
+  // tags, members, labels and declarators
+  switch (prev) {
+    case STRUCT: case UNION: case ENUM: case '.': case PTR_OP: case GOTO:
+    case '*':
+      return 0;
+  }
+  switch (next) {
+    case ';': case '=': case '[':
+      return 0;
+    case ',': case ')':
+      // an argument of a call, maybe of a macro taking a type
+      if (fp->depth > 0 && (prev == ',' ||
+            (prev == '(' && i > 1 && fp->ts->tok[i - 2] == IDENTIFIER)))
+        return 0;
+  }
+  if (is_typedef(fp, name)) return 1;
+  for (size_t k = 0; k < sizeof builtin_types / sizeof builtin_types[0]; k++)
+    if (strcmp(builtin_types[k], name) == 0) return 1;
+  size_t len = strlen(name);
+  if (len > 2 && strcmp(name + len - 2, "_t") == 0) return 1;
+
+  if (next == IDENTIFIER) {
+    int ext = extension(name_at(fp, i + 1));
+    return ext != EXT_PARENS;
+  }
+
+  // T const, T int ... where T is a macro or a type
+  if (is_specifier(next)) return 1;
+
+  if (next == '*') {
+    // (T *) or (T **)
+    size_t j = i + 1;
+    while (tok_at(fp, j) == '*') j++;
+    if (prev == '(' && tok_at(fp, j) == ')') return 1;
+    // T *x; at the start of a declaration
+    switch (prev) {
+      case ';': case '{': case '}': case CONST: case VOLATILE:
+      case RESTRICT: case STATIC: case EXTERN: case REGISTER: case INLINE:
+      case AUTO: case THREAD_LOCAL: case IDENTIFIER:
+        return 1;
+      case '(': case ',':
+        return fp->depth == 0; // parameter declarations
+    }
+    return 0;
+  }
+
+  if (prev == '(' && next == ')') {
+    // (T) x, unless the parentheses belong to a call or a statement
+    switch (tok_at(fp, i + 2)) {
+      case IDENTIFIER: case I_CONSTANT: case F_CONSTANT: case STRING_LITERAL:
+        break;
+      default:
+        return 0;
+    }
+    switch (i > 1 ? fp->ts->tok[i - 2] : 0) {
+      case IF: case WHILE: case SWITCH: case FOR: case SIZEOF:
+      case IDENTIFIER: case ')': case ']':
+        return 0;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+
+int cclex(CCSTYPE *lval, CCLTYPE *lloc, struct fparser *fp)
+{
+  const struct tokstream *ts = fp->ts;
+  for (;;) {
+    if (fp->pos >= ts->count || fp->restart) return CCEOF;
+    size_t i = fp->pos++, j;
+    int tok = ts->tok[i];
+
+    if (tok == IDENTIFIER) {
+      int ext = extension(name_at(fp, i));
+      if (ext == EXT_SKIP) continue;
+      if (ext == EXT_PARENS) {
+        skip_parens(fp);
+        continue;
+      }
+      if (ext == EXT_TYPEOF) {
+        skip_parens(fp);
+        tok = TYPEDEF_NAME;
+      } else if (ext > 0) {
+        tok = ext;
+      } else if ((j = type_macro(fp, i)) > 0) {
+        fp->pos = j + 1;
+        tok = TYPEDEF_NAME;
+      } else if (is_type(fp, i)) {
+        tok = TYPEDEF_NAME;
+      }
+    } else if (tok == '{') {
+      fp->depth++;
+    } else if (tok == '}' && fp->depth > 0) {
+      fp->depth--;
+    }
+
+    *lval = ts->name[i];
+    lloc->first_line = lloc->last_line = ts->line[i];
+    lloc->first_column = lloc->last_column = i;
+    return tok;
+  }
+}
+
+
+void ccerror(CCLTYPE *lloc, struct fparser *fp, const char *msg)
+{
+  // errors are expected, the parser recovers
+  DBG("line %d: %s at token %d\n", lloc->first_line, msg,
+      lloc->first_column);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Parser actions
+///////////////////////////////////////////////////////////////////////////////
+
+void fp_typedef(struct fparser *fp)
+{
+  fp->in_typedef = 1;
+}
+
+
+void fp_declare(struct fparser *fp, int name)
+{
+  if (fp->in_typedef && name >= 0) typedef_add(fp, name);
+}
+
+
+void fp_end_decl(struct fparser *fp)
+{
+  fp->in_typedef = 0;
+}
+
+
+void fp_function(struct fparser *fp, int name, const CCLTYPE *loc,
+    const CCLTYPE *decl)
+{
+  const struct tokstream *ts = fp->ts;
+  size_t first = loc->first_column, last = decl->last_column;
+
+  // The body ends with the brace matching the one it starts with.  Error
+  // recovery in the body may have taken another closing brace for the end
+  // of the function, then parsing restarts after the body.
+  while (ts->tok[last] != '{') last++;
+  int level = 0;
+  for (; last < ts->count; last++) {
+    if (ts->tok[last] == '{') level++;
+    else if (ts->tok[last] == '}' && --level == 0) break;
+  }
+  if (last == ts->count) last--;
+  if (last != (size_t) loc->last_column) {
+    fp->pos = last + 1;
+    fp->restart = 1;
+  }
+
+  if (fp->nfuncs == fp->funcs_capacity) {
+    fp->funcs_capacity = fp->funcs_capacity > 0 ? 2 * fp->funcs_capacity : 16;
+    struct fpfunc *new_funcs = realloc(fp->funcs,
+        fp->funcs_capacity * sizeof(struct fpfunc));
+    if (new_funcs == NULL)
+      error_exit("cannot allocate memory");
+    fp->funcs = new_funcs;
+  }
+  struct fpfunc *f = &fp->funcs[fp->nfuncs++];
+  f->name = strdup(name >= 0 ? ts->names + name : "?");
+  if (f->name == NULL)
+    error_exit("cannot allocate memory");
+  f->first = first;
+  f->last = last;
+  f->first_line = ts->line[first];
+  f->last_line = ts->line[last];
+}
+
+
+size_t fparse(const struct tokstream *ts, struct fpfunc **funcs)
+{
+  struct fparser fp;
+  memset(&fp, 0, sizeof fp);
+  fp.ts = ts;
+  do {
+    fp.restart = 0;
+    fp.depth = 0;
+    fp.in_typedef = 0;
+    (void) ccparse(&fp);
+  } while (fp.restart);
+  free(fp.typedefs);
+  *funcs = fp.funcs;
+  return fp.nfuncs;
+}
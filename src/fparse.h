@@ -0,0 +1,62 @@
+#ifndef _FPARSE_H_
+#define _FPARSE_H_
+
+#include <stddef.h>
+
+#include "fprint.h"
+#include "ccode.tab.h"
+
+/*
+ * Finding the function definitions in the tokens of a file, with the
+ * parser generated from the grammar in ccode.y.
+ */
+
+/**
+ * The tokens of a file, with their line numbers and the names of
+ * identifiers.
+ */
+struct tokstream {
+  size_t count, capacity;
+  int *tok;
+  int *line;
+  int *name;         // offset of an identifier's name in names, or -1
+  char *names;
+  size_t nameslen, namescap;
+};
+
+/**
+ * Append a token.  text of length len is the name of an identifier,
+ * and ignored for other tokens or if NULL.
+ */
+void ts_add(struct tokstream *ts, int tok, int line,
+    const char *text, size_t len);
+
+/**
+ * Remove all tokens, keeping the memory for reuse.
+ */
+void ts_clear(struct tokstream *ts);
+
+void ts_free(struct tokstream *ts);
+
+/**
+ * Parse the tokens and store the function definitions found, in order,
+ * in *funcs, to be freed by the caller.  Return their number.
+ *
+ * Parsing is best effort: the preprocessor directives are not seen, and
+ * typedef names declared in headers are guessed.  Parts that cannot be
+ * parsed are skipped.
+ */
+size_t fparse(const struct tokstream *ts, struct fpfunc **funcs);
+
+
+// interface to the parser
+struct fparser;
+int cclex(CCSTYPE *lval, CCLTYPE *lloc, struct fparser *fp);
+void ccerror(CCLTYPE *lloc, struct fparser *fp, const char *msg);
+void fp_typedef(struct fparser *fp);
+void fp_declare(struct fparser *fp, int name);
+void fp_end_decl(struct fparser *fp);
+void fp_function(struct fparser *fp, int name, const CCLTYPE *loc,
+    const CCLTYPE *decl);
+
+#endif // _FPARSE_H_
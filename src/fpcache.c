@@ -0,0 +1,441 @@
+/**
+ * Persistent cache of fingerprints.
+ *
+ * The cache is loaded into a hash table by name before fingerprinting
+ * starts.  The name is the absolute path of the file as it was given,
+ * made absolute with the working directory, which is determined once;
+ * the canonicalized path, which is reported, is stored with the entry.
+ * Workers look up and store fingerprints concurrently under a lock, which
+ * is cheap compared to the stat of the file.  At the end, if fingerprints
+ * were stored, all entries are written to a temporary file, which replaces
+ * the cache; the entries of files not seen in the run are kept.
+ *
+ * Format of the cache file, in host byte order:
+ *   header:  magic "fpccache", uint32 version, ntoken, winnowsize, rolling
+ *   entries: uint32 name length, name, uint32 path length, path,
+ *            uint64 size, int64 mtime seconds, int64 mtime nanoseconds,
+ *            uint8 hasdigest, 16 bytes digest, uint32 count,
+ *            uint64 hash[count], int32 linepos[count]
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include "fpcache.h"
+
+extern const char *program_name;
+
+#define CACHE_MAGIC "fpccache"
+#define CACHE_VERSION 3
+
+/**
+ * A cached fingerprint.
+ */
+struct centry {
+  char *name;      // absolute path as given
+  char *path;      // canonicalized absolute path
+  uint64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  uint8_t hasdigest;
+  unsigned char digest[16];
+  uint32_t count;
+  struct fprec *recs;
+};
+
+// hash table by name, open addressing with linear probing
+static struct centry **table;
+static size_t table_size, table_count;
+static int modified;   // entries were stored in this run
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the working directory, relative names are made absolute with
+static char cwd[PATH_MAX];
+
+
+static size_t name_hash(const char *s)
+{
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *s != '\0'; s++) {
+    h ^= (unsigned char) *s;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+
+/**
+ * Return the slot of name in the table: its entry, or the empty slot
+ * it would go to.
+ */
+static struct centry **table_slot(const char *name)
+{
+  size_t i = name_hash(name) & (table_size - 1);
+  while (table[i] != NULL && strcmp(table[i]->name, name) != 0)
+    i = (i + 1) & (table_size - 1);
+  return &table[i];
+}
+
+
+static void entry_free(struct centry *e)
+{
+  free(e->name);
+  free(e->path);
+  free(e->recs);
+  free(e);
+}
+
+
+/**
+ * Free the table.
+ */
+static void table_free(void)
+{
+  for (size_t i = 0; i < table_size; i++) {
+    if (table[i] != NULL) entry_free(table[i]);
+  }
+  free(table);
+  table = NULL;
+  table_size = table_count = 0;
+  modified = 0;
+}
+
+
+/**
+ * Insert an entry, replacing and freeing the one of the same name.
+ */
+static void table_insert(struct centry *e)
+{
+  if (2 * (table_count + 1) > table_size) {
+    struct centry **old = table;
+    size_t old_size = table_size;
+    table_size = table_size > 0 ? 2 * table_size : 1024;
+    table = calloc(table_size, sizeof(struct centry *));
+    if (table == NULL)
+      error_exit("cannot allocate memory");
+    for (size_t i = 0; i < old_size; i++) {
+      if (old[i] != NULL) *table_slot(old[i]->name) = old[i];
+    }
+    free(old);
+  }
+  struct centry **slot = table_slot(e->name);
+  if (*slot != NULL)
+    entry_free(*slot);
+  else
+    table_count++;
+  *slot = e;
+}
+
+
+/**
+ * The number of bytes of f after its position, if it ends at end.
+ */
+static uint64_t bytes_left(FILE *f, uint64_t end)
+{
+  off_t pos = ftello(f);
+  return pos >= 0 && (uint64_t) pos <= end ? end - pos : 0;
+}
+
+
+static int read_str(FILE *f, uint64_t end, char **s)
+{
+  uint32_t len;
+  if (fread(&len, sizeof len, 1, f) != 1 || len > bytes_left(f, end))
+    return -1;
+  *s = malloc(len + 1);
+  if (*s == NULL)
+    error_exit("cannot allocate memory");
+  if (len > 0 && fread(*s, len, 1, f) != 1) return -1;
+  (*s)[len] = '\0';
+  return 0;
+}
+
+
+/**
+ * Read the next entry of f, which ends at end, using buf for the columns
+ * of the records.  Return 1 on success, 0 at the end of the file, and -1
+ * if the file is corrupt.  Lengths and counts beyond the end of the file
+ * are corrupt, so they are never allocated.
+ */
+static int read_entry(FILE *f, uint64_t end, struct centry **ep, void **buf,
+    size_t *bufsize)
+{
+  int c = getc(f);
+  if (c == EOF) return 0;
+  (void) ungetc(c, f);
+
+  struct centry *e = calloc(1, sizeof(struct centry));
+  if (e == NULL)
+    error_exit("cannot allocate memory");
+  *ep = e;
+  if (read_str(f, end, &e->name) != 0 ||
+      read_str(f, end, &e->path) != 0 ||
+      fread(&e->size, sizeof e->size, 1, f) != 1 ||
+      fread(&e->mtime_sec, sizeof e->mtime_sec, 1, f) != 1 ||
+      fread(&e->mtime_nsec, sizeof e->mtime_nsec, 1, f) != 1 ||
+      fread(&e->hasdigest, sizeof e->hasdigest, 1, f) != 1 ||
+      fread(e->digest, sizeof e->digest, 1, f) != 1 ||
+      fread(&e->count, sizeof e->count, 1, f) != 1)
+    return -1;
+  uint64_t size = (uint64_t) e->count * (sizeof(uint64_t) + sizeof(int32_t));
+  if (size > bytes_left(f, end))
+    return -1;
+  e->recs = malloc(e->count * sizeof(struct fprec));
+  if (e->count > 0 && e->recs == NULL)
+    error_exit("cannot allocate memory");
+  if (size > *bufsize) {
+    free(*buf);
+    *bufsize = 2 * size;
+    *buf = malloc(*bufsize);
+    if (*buf == NULL)
+      error_exit("cannot allocate memory");
+  }
+  uint64_t *hashes = *buf;
+  int32_t *linepos = (int32_t *) (hashes + e->count);
+  if (fread(hashes, sizeof *hashes, e->count, f) != e->count ||
+      fread(linepos, sizeof *linepos, e->count, f) != e->count)
+    return -1;
+  for (uint32_t i = 0; i < e->count; i++) {
+    e->recs[i].hash = hashes[i];
+    e->recs[i].linepos = linepos[i];
+    e->recs[i].func = -1;
+  }
+  return 1;
+}
+
+
+void cache_load(const char *cachefile)
+{
+  if (getcwd(cwd, sizeof cwd) == NULL)
+    error_exit("cannot get working directory");
+
+  FILE *f = fopen(cachefile, "r");
+  if (f == NULL) {
+    if (errno != ENOENT)
+      error_exit("cannot open cache file");
+    return;
+  }
+
+  char magic[sizeof CACHE_MAGIC - 1];
+  uint32_t param[4];
+  if (fread(magic, sizeof magic, 1, f) != 1 ||
+      memcmp(magic, CACHE_MAGIC, sizeof magic) != 0 ||
+      fread(param, sizeof param, 1, f) != 1) {
+    (void) fprintf(stderr, "%s: ignoring invalid cache file %s\n",
+        program_name, cachefile);
+    (void) fclose(f);
+    return;
+  }
+  if (param[0] != CACHE_VERSION || param[1] != (uint32_t) Ntoken ||
+      param[2] != (uint32_t) Winnowsize || param[3] != (uint32_t) Rolling) {
+    // created with other parameters, start over
+    DBG("cache parameters differ, ignoring %s\n", cachefile);
+    (void) fclose(f);
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fileno(f), &st) == -1)
+    error_exit("cannot stat cache file");
+  struct centry *e;
+  void *buf = NULL;
+  size_t bufsize = 0;
+  int r;
+  while ((r = read_entry(f, st.st_size, &e, &buf, &bufsize)) == 1) {
+    table_insert(e);
+  }
+  free(buf);
+  if (r == -1) {
+    // all files are scanned again, and the cache is rebuilt
+    entry_free(e);
+    table_free();
+    (void) fprintf(stderr, "%s: ignoring corrupt cache file %s\n",
+        program_name, cachefile);
+  }
+  (void) fclose(f);
+  DBG("loaded %zu cached fingerprints\n", table_count);
+}
+
+
+/**
+ * Compute the MD5 digest of a file's contents.
+ */
+static int file_digest(const char *fname, unsigned char digest[16])
+{
+  char buf[65536];
+  ssize_t n;
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1) return -1;
+  EVP_MD_CTX *md5 = EVP_MD_CTX_new();
+  if (md5 == NULL || !EVP_DigestInit_ex(md5, EVP_md5(), NULL))
+    error_exit("cannot initialize MD5");
+  while ((n = read(fd, buf, sizeof buf)) > 0) {
+    if (!EVP_DigestUpdate(md5, buf, n))
+      error_exit("cannot compute MD5");
+  }
+  int err = errno;
+  (void) close(fd);
+  if (n == -1) {
+    EVP_MD_CTX_free(md5);
+    errno = err;
+    return -1;
+  }
+  if (!EVP_DigestFinal_ex(md5, digest, NULL))
+    error_exit("cannot compute MD5");
+  EVP_MD_CTX_free(md5);
+  return 0;
+}
+
+
+int cache_key(struct cache_key *key, const char *fname, int check)
+{
+  struct stat st;
+  int len = fname[0] == '/' ?
+    snprintf(key->name, sizeof key->name, "%s", fname) :
+    snprintf(key->name, sizeof key->name, "%s/%s", cwd, fname);
+  if (len < 0 || (size_t) len >= sizeof key->name) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (stat(key->name, &st) == -1)
+    return -1;
+  key->size = st.st_size;
+  key->mtime_sec = st.st_mtim.tv_sec;
+  key->mtime_nsec = st.st_mtim.tv_nsec;
+  key->hasdigest = check;
+  if (check && file_digest(key->name, key->digest) == -1) return -1;
+  return 0;
+}
+
+
+int cache_lookup(const struct cache_key *key, struct fpresult *res)
+{
+  int hit = 0;
+  (void) pthread_mutex_lock(&cache_lock);
+  struct centry *e = table_size > 0 ? *table_slot(key->name) : NULL;
+  if (e != NULL && e->size == key->size) {
+    if (key->hasdigest)
+      hit = e->hasdigest && memcmp(e->digest, key->digest, 16) == 0;
+    else
+      hit = e->mtime_sec == key->mtime_sec &&
+        e->mtime_nsec == key->mtime_nsec;
+  }
+  if (hit) {
+    res->path = strdup(e->path);
+    res->recs = malloc(e->count * sizeof(struct fprec));
+    if (res->path == NULL || (e->count > 0 && res->recs == NULL))
+      error_exit("cannot allocate memory");
+    memcpy(res->recs, e->recs, e->count * sizeof(struct fprec));
+    res->count = res->capacity = e->count;
+  }
+  (void) pthread_mutex_unlock(&cache_lock);
+  return hit;
+}
+
+
+void cache_store(const struct cache_key *key, const struct fpresult *res)
+{
+  struct centry *e = calloc(1, sizeof(struct centry));
+  if (e == NULL || (e->name = strdup(key->name)) == NULL ||
+      (e->path = strdup(res->path)) == NULL)
+    error_exit("cannot allocate memory");
+  e->size = key->size;
+  e->mtime_sec = key->mtime_sec;
+  e->mtime_nsec = key->mtime_nsec;
+  e->hasdigest = key->hasdigest;
+  memcpy(e->digest, key->digest, 16);
+  e->count = res->count;
+  e->recs = malloc(res->count * sizeof(struct fprec));
+  if (res->count > 0 && e->recs == NULL)
+    error_exit("cannot allocate memory");
+  memcpy(e->recs, res->recs, res->count * sizeof(struct fprec));
+
+  (void) pthread_mutex_lock(&cache_lock);
+  table_insert(e);
+  modified = 1;
+  (void) pthread_mutex_unlock(&cache_lock);
+}
+
+
+static int write_str(FILE *f, const char *s)
+{
+  uint32_t len = strlen(s);
+  return fwrite(&len, sizeof len, 1, f) == 1 &&
+    (len == 0 || fwrite(s, len, 1, f) == 1);
+}
+
+
+static int write_entry(FILE *f, const struct centry *e, void **buf,
+    size_t *bufsize)
+{
+  if (!write_str(f, e->name) || !write_str(f, e->path) ||
+      fwrite(&e->size, sizeof e->size, 1, f) != 1 ||
+      fwrite(&e->mtime_sec, sizeof e->mtime_sec, 1, f) != 1 ||
+      fwrite(&e->mtime_nsec, sizeof e->mtime_nsec, 1, f) != 1 ||
+      fwrite(&e->hasdigest, sizeof e->hasdigest, 1, f) != 1 ||
+      fwrite(e->digest, sizeof e->digest, 1, f) != 1 ||
+      fwrite(&e->count, sizeof e->count, 1, f) != 1)
+    return 0;
+  size_t size = e->count * (sizeof(uint64_t) + sizeof(int32_t));
+  if (size > *bufsize) {
+    free(*buf);
+    *bufsize = 2 * size;
+    *buf = malloc(*bufsize);
+    if (*buf == NULL)
+      error_exit("cannot allocate memory");
+  }
+  uint64_t *hashes = *buf;
+  int32_t *linepos = (int32_t *) (hashes + e->count);
+  for (uint32_t i = 0; i < e->count; i++) {
+    hashes[i] = e->recs[i].hash;
+    linepos[i] = e->recs[i].linepos;
+  }
+  return fwrite(*buf, size, 1, f) == 1 || size == 0;
+}
+
+
+void cache_save(const char *cachefile)
+{
+  // nothing to do if all files were found in the cache
+  if (!modified) {
+    table_free();
+    return;
+  }
+
+  char *tmpfile = malloc(strlen(cachefile) + 5);
+  if (tmpfile == NULL)
+    error_exit("cannot allocate memory");
+  strcpy(tmpfile, cachefile);
+  strcat(tmpfile, ".tmp");
+
+  FILE *f = fopen(tmpfile, "w");
+  if (f == NULL)
+    error_exit("cannot create cache file");
+  uint32_t param[4] = { CACHE_VERSION, Ntoken, Winnowsize, Rolling };
+  if (fwrite(CACHE_MAGIC, sizeof CACHE_MAGIC - 1, 1, f) != 1 ||
+      fwrite(param, sizeof param, 1, f) != 1)
+    error_exit("cannot write cache file");
+  void *buf = NULL;
+  size_t bufsize = 0;
+  for (size_t i = 0; i < table_size; i++) {
+    struct centry *e = table[i];
+    if (e != NULL && !write_entry(f, e, &buf, &bufsize))
+      error_exit("cannot write cache file");
+  }
+  free(buf);
+  if (fclose(f) != 0)
+    error_exit("cannot write cache file");
+  if (rename(tmpfile, cachefile) == -1)
+    error_exit("cannot replace cache file");
+
+  free(tmpfile);
+  table_free();
+}
@@ -0,0 +1,63 @@
+#ifndef _FPCACHE_H_
+#define _FPCACHE_H_
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "fprint.h"
+
+/*
+ * A persistent cache of fingerprints, so files that did not change since
+ * the last run are not scanned again.
+ *
+ * The cache file holds the fingerprint of each file by its absolute path,
+ * with its size and modification time, and optionally an MD5 digest of
+ * its contents.  It is only valid for the parameters it was
+ * created with (chainlength, winnow size and hash function); a cache for
+ * other parameters is ignored and replaced.
+ */
+
+/**
+ * The key a fingerprint is cached by.
+ */
+struct cache_key {
+  char name[PATH_MAX];  // absolute path as given
+  uint64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  int hasdigest;
+  unsigned char digest[16];
+};
+
+/**
+ * Load the cache file, if it exists and matches the parameters.  A
+ * corrupt cache file is ignored, and replaced by cache_save().
+ */
+void cache_load(const char *cachefile);
+
+/**
+ * Determine the key of a file: make its name absolute and stat it, and if
+ * check is set, compute the digest of its contents.
+ * Return 0 on success, -1 on error with errno set.
+ */
+int cache_key(struct cache_key *key, const char *fname, int check);
+
+/**
+ * Look up the fingerprint of a file.  On a hit, copy it to res and
+ * return 1, otherwise return 0.  With a digest in the key, the file is
+ * unchanged if its size and contents are, otherwise if its size and
+ * modification time are.
+ */
+int cache_lookup(const struct cache_key *key, struct fpresult *res);
+
+/**
+ * Store the fingerprint of a file, with the canonicalized path in res.
+ */
+void cache_store(const struct cache_key *key, const struct fpresult *res);
+
+/**
+ * If fingerprints were stored since the cache was loaded, write the cache
+ * file, replacing it.  It keeps the fingerprints of files not seen since.
+ */
+void cache_save(const char *cachefile);
+
+#endif // _FPCACHE_H_
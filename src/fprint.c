@@ -0,0 +1,1071 @@
+/**
+ * Fingerprinting of C source files, using a C lexer and winnowing.
+ *
+ * Files can be fingerprinted in parallel by a number of worker threads.
+ * Each worker owns its scanner and its n-gram and winnowing state, and
+ * records into the result of its current job.  The results are passed on
+ * in the order of the files, so the output does not depend on the number
+ * of workers.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/md5.h>
+#include "fprint.h"
+#include "fpcache.h"
+#include "fparse.h"
+#include "tokenize.h"
+#include "tokfile.h"
+#include "walk.h"
+// the interface of our generated, reentrant scanner
+#include "lex.yy.h"
+
+extern const char *program_name;
+
+// in ccode.lex
+extern void lex_reset(yyscan_t scanner);
+
+int Ntoken     = DEFAULT_NTOKEN;
+int Winnowsize = DEFAULT_WINNOWSIZE;
+int Rolling    = 0;
+int Nthreads   = 1;
+int Mmap       = 0;
+int Fastlex    = 0;
+int Recursive  = 0;
+const char *Extensions = DEFAULT_EXTENSIONS;
+int Nullsep    = 0;
+const char *Cachefile = NULL;
+int Cachecheck = 0;
+int Functions  = 0;
+const char *Tokensave = NULL;
+const char *Tokenload = NULL;
+struct fpparam *Params = NULL;
+int Nparams    = 0;
+
+extern void usage(void);
+
+// the parameters fingerprinted with: Params, or Ntoken and Winnowsize
+static struct fpparam *params;
+static int nparams;
+static struct fpparam default_param;
+
+// tokens are hashed from the worker's token stream instead of the scanner
+static int replay;
+// the token file read if Tokenload is set
+static struct tokfile tokin;
+
+/*
+ * Rolling hash state: a Karp-Rabin polynomial over the last chain tokens,
+ * computed modulo 2^64, i.e.
+ *   roll = t[0]*B^(N-1) + t[1]*B^(N-2) + ... + t[N-1]
+ * Shifting the window by one token takes a multiplication and a subtraction.
+ */
+#define ROLL_BASE 0x9e3779b97f4a7c15ULL // an arbitrary odd multiplier
+static hash_t *roll_outs; // B^(N-1) for each of the parameters
+
+/**
+ * A hash in the winnowing window, and the rightmost minimal hash from
+ * there to the end of its block.
+ */
+struct winrec {
+  hash_t hash;
+  hash_t min;
+  unsigned long minpos;
+};
+
+/**
+ * The state for fingerprinting one file at a time.
+ */
+struct worker {
+  yyscan_t scanner;
+  struct tokenizer tok; // hand-written tokenizer, if Fastlex
+  char *text;      // file contents read for the tokenizer
+  size_t textsize; // allocated size of text
+  int ntoken;      // number of tokens read for current file
+  int chain;       // number of tokens forming an n-gram
+  int *tokenbuf;   // buffer for tokens
+  hash_t roll;     // rolling hash of the current n-gram
+  hash_t roll_out; // B^(chain-1), weight of the oldest token
+  struct winrec *window; // winnowing window
+  unsigned winmask;      // size of window minus one, a power of two
+  struct fpresult *results; // results for each of the parameters
+  struct fpresult *res;     // result the hashes are recorded to
+  struct tokstream ts;  // tokens of the file, if replay
+  size_t tspos;         // next token in ts
+  size_t func;          // first function a hash can still belong to
+  unsigned char *enc;   // tokens encoded for the token file
+  size_t encsize;
+  pthread_t thread;
+};
+
+/**
+ * A file to fingerprint or a directory to walk, with its result.
+ *
+ * The jobs form a tree in the order of the output: the files given, with
+ * each directory replaced by its entries, sorted by name.  A directory is
+ * walked by a worker like a file is fingerprinted, so the walk overlaps
+ * with fingerprinting, and its entries become jobs on their own.
+ */
+struct job {
+  char *fname;
+  struct job *parent; // directory the file was found in, NULL if given
+  unsigned depth;     // number of parents
+  size_t index;       // position among the files given or in the directory
+  int isdir;          // a directory to walk
+  struct tokrec rec;  // tokens to fingerprint, if Tokenload
+  struct fpresult *res; // results for each of the parameters
+  int valid; // file could be opened
+  int done;
+  struct job **children; // entries of a directory, once done
+  size_t nchildren;
+  struct job *next;      // next file given
+};
+
+// the files given, not yet taken by the output
+static struct job *given_head, *given_tail;
+static size_t ngiven;
+static int given_done; // no more files are given
+// jobs to be taken by a worker, a heap ordered like the output
+static struct job **pending;
+static size_t npending, pending_capacity;
+static size_t held;        // jobs taken by a worker, not yet released
+static size_t busy;        // jobs being worked on
+static struct job *target; // job the output waits for
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+// Workers do not run ahead of the output by more than this many jobs
+// per thread, which bounds the memory held by unemitted results.
+#define JOBS_AHEAD 4
+// Number of files given that are read ahead of the output.
+#define GIVEN_AHEAD 1024
+
+
+static int fingerprint(struct worker *wk, const char *fname);
+static int fingerprint_tokens(struct worker *wk, const struct tokrec *rec);
+static void scan(struct worker *wk);
+static void winnow_all(struct worker *wk);
+static void winnow(struct worker *wk, int w);
+
+
+static void worker_init(struct worker *wk)
+{
+  if (yylex_init(&wk->scanner) != 0)
+    error_exit("cannot create scanner");
+  wk->text = NULL;
+  wk->textsize = 0;
+  memset(&wk->ts, 0, sizeof wk->ts);
+  wk->enc = NULL;
+  wk->encsize = 0;
+  // allocate k-gram buffer for the longest chain
+  int maxchain = 1, maxwinnow = 1;
+  for (int i = 0; i < nparams; i++) {
+    if (params[i].ntoken > maxchain) maxchain = params[i].ntoken;
+    if (params[i].winnowsize > maxwinnow) maxwinnow = params[i].winnowsize;
+  }
+  wk->tokenbuf = malloc(maxchain * sizeof(int));
+  // the window holds at most maxwinnow hashes, round up for masking
+  wk->winmask = 1;
+  while (wk->winmask < (unsigned) maxwinnow) wk->winmask <<= 1;
+  wk->window = malloc(wk->winmask * sizeof(struct winrec));
+  wk->winmask--;
+  if (wk->tokenbuf == NULL || wk->window == NULL)
+    error_exit("cannot allocate buffer");
+}
+
+
+static void worker_cleanup(struct worker *wk)
+{
+  (void) yylex_destroy(wk->scanner);
+  (void) free(wk->tokenbuf);
+  (void) free(wk->window);
+  (void) free(wk->text);
+  ts_free(&wk->ts);
+  (void) free(wk->enc);
+}
+
+
+/**
+ * Free the results of a file for each of the parameters.  The path and
+ * functions are shared, and owned by the first.
+ */
+static void result_free(struct fpresult *res)
+{
+  free(res->path);
+  for (size_t i = 0; i < res->nfuncs; i++)
+    free(res->funcs[i].name);
+  free(res->funcs);
+  free(res->tokens);
+  res->tokens = NULL;
+  res->ntokens = res->tokenslen = 0;
+  for (int i = 0; i < nparams; i++) {
+    free(res[i].recs);
+    res[i].path = NULL;
+    res[i].recs = NULL;
+    res[i].count = res[i].capacity = 0;
+    res[i].funcs = NULL;
+    res[i].nfuncs = 0;
+  }
+}
+
+
+static struct fpresult *result_new(void)
+{
+  struct fpresult *res = calloc(nparams, sizeof(struct fpresult));
+  if (res == NULL)
+    error_exit("cannot allocate memory");
+  for (int i = 0; i < nparams; i++) res[i].param = i;
+  return res;
+}
+
+
+/**
+ * Pass the results of a file for each of the parameters to emit.
+ */
+static void result_emit(const struct fpresult *res, fp_emit_t emit)
+{
+  for (int i = 0; i < nparams; i++) emit(&res[i]);
+}
+
+
+static struct job *job_new(const char *fname, struct job *parent,
+    size_t index, int isdir)
+{
+  struct job *job = calloc(1, sizeof(struct job));
+  if (job == NULL || (job->fname = strdup(fname)) == NULL)
+    error_exit("cannot allocate memory");
+  if (!isdir) job->res = result_new();
+  job->parent = parent;
+  job->depth = parent != NULL ? parent->depth + 1 : 0;
+  job->index = index;
+  job->isdir = isdir;
+  return job;
+}
+
+
+/**
+ * Check whether job a comes before job b in the output.
+ */
+static int job_before(const struct job *a, const struct job *b)
+{
+  // a directory comes before its entries
+  while (a->depth > b->depth) {
+    a = a->parent;
+    if (a == b) return 0;
+  }
+  while (b->depth > a->depth) {
+    b = b->parent;
+    if (a == b) return 1;
+  }
+  while (a->parent != b->parent) {
+    a = a->parent;
+    b = b->parent;
+  }
+  return a->index < b->index;
+}
+
+
+static void pending_push(struct job *job)
+{
+  if (npending == pending_capacity) {
+    pending_capacity = pending_capacity > 0 ? 2 * pending_capacity : 256;
+    struct job **new_pending = realloc(pending,
+        pending_capacity * sizeof(struct job *));
+    if (new_pending == NULL)
+      error_exit("cannot allocate memory");
+    pending = new_pending;
+  }
+  size_t i = npending++;
+  while (i > 0 && job_before(job, pending[(i - 1) / 2])) {
+    pending[i] = pending[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  pending[i] = job;
+}
+
+
+static struct job *pending_pop(void)
+{
+  struct job *top = pending[0];
+  struct job *last = pending[--npending];
+  size_t i = 0;
+  for (;;) {
+    size_t c = 2 * i + 1;
+    if (c >= npending) break;
+    if (c + 1 < npending && job_before(pending[c + 1], pending[c])) c++;
+    if (!job_before(pending[c], last)) break;
+    pending[i] = pending[c];
+    i = c;
+  }
+  if (npending > 0) pending[i] = last;
+  return top;
+}
+
+
+/**
+ * Walk a directory: create the jobs for its entries.
+ */
+static void walk(struct job *job)
+{
+  struct entry *entries;
+  size_t count = walk_dir(job->fname, Extensions, &entries);
+  job->children = malloc(count * sizeof(struct job *));
+  if (count > 0 && job->children == NULL)
+    error_exit("cannot allocate memory");
+  for (size_t i = 0; i < count; i++) {
+    job->children[i] = job_new(entries[i].path, job, i, entries[i].isdir);
+    free(entries[i].path);
+  }
+  job->nchildren = count;
+  free(entries);
+}
+
+
+/**
+ * Worker thread: take the first pending job in the order of the output,
+ * fingerprint the file into the job's result or walk the directory, and
+ * signal the completion.
+ */
+static void *worker_run(void *arg)
+{
+  struct worker *wk = arg;
+
+  (void) pthread_mutex_lock(&job_lock);
+  for (;;) {
+    // the job the output waits for is always taken
+    while (!(npending > 0 &&
+          (held < JOBS_AHEAD * (size_t) Nthreads || pending[0] == target)) &&
+        !(npending == 0 && given_done && busy == 0))
+      (void) pthread_cond_wait(&job_cond, &job_lock);
+    if (npending == 0) break;
+    struct job *job = pending_pop();
+    held++;
+    busy++;
+    (void) pthread_mutex_unlock(&job_lock);
+
+    wk->results = wk->res = job->res;
+    if (job->isdir) {
+      walk(job);
+    } else if (Tokenload != NULL) {
+      job->valid = fingerprint_tokens(wk, &job->rec);
+    } else {
+      job->valid = fingerprint(wk, job->fname);
+    }
+
+    (void) pthread_mutex_lock(&job_lock);
+    if (job->isdir) {
+      for (size_t i = 0; i < job->nchildren; i++)
+        pending_push(job->children[i]);
+      held--;
+    }
+    job->done = 1;
+    busy--;
+    (void) pthread_cond_broadcast(&job_cond);
+  }
+  (void) pthread_mutex_unlock(&job_lock);
+  return NULL;
+}
+
+
+/**
+ * Feeder thread: create a job for each file given, or each record of the
+ * token file.
+ */
+static void *feed_run(void *arg)
+{
+  struct names *names = arg;
+  struct tokrec rec;
+  const char *fname;
+
+  for (size_t i = 0; ; i++) {
+    struct job *job;
+    if (Tokenload != NULL) {
+      if (!tokfile_next(&tokin, &rec)) break;
+      job = job_new(rec.path, NULL, i, 0);
+      job->rec = rec;
+    } else {
+      if ((fname = names_next(names)) == NULL) break;
+      job = job_new(fname, NULL, i, Recursive && walk_isdir(fname));
+    }
+    (void) pthread_mutex_lock(&job_lock);
+    while (ngiven >= GIVEN_AHEAD)
+      (void) pthread_cond_wait(&job_cond, &job_lock);
+    if (given_tail != NULL)
+      given_tail->next = job;
+    else
+      given_head = job;
+    given_tail = job;
+    ngiven++;
+    pending_push(job);
+    (void) pthread_cond_broadcast(&job_cond);
+    (void) pthread_mutex_unlock(&job_lock);
+  }
+
+  (void) pthread_mutex_lock(&job_lock);
+  given_done = 1;
+  (void) pthread_cond_broadcast(&job_cond);
+  (void) pthread_mutex_unlock(&job_lock);
+  return NULL;
+}
+
+
+/**
+ * Wait for a job, emit its result or those of the directory entries,
+ * and release it.
+ */
+static void emit_job(struct job *job, fp_emit_t emit)
+{
+  (void) pthread_mutex_lock(&job_lock);
+  target = job;
+  (void) pthread_cond_broadcast(&job_cond);
+  while (!job->done)
+    (void) pthread_cond_wait(&job_cond, &job_lock);
+  (void) pthread_mutex_unlock(&job_lock);
+
+  if (job->isdir) {
+    for (size_t i = 0; i < job->nchildren; i++)
+      emit_job(job->children[i], emit);
+    free(job->children);
+  } else {
+    if (job->valid) result_emit(job->res, emit);
+    result_free(job->res);
+    free(job->res);
+    (void) pthread_mutex_lock(&job_lock);
+    held--;
+    (void) pthread_cond_broadcast(&job_cond);
+    (void) pthread_mutex_unlock(&job_lock);
+  }
+  free(job->fname);
+  free(job);
+}
+
+
+/**
+ * Fingerprint the files on Nthreads workers, and emit their results
+ * in order as soon as they are available.
+ */
+static void run_parallel(struct names *names, fp_emit_t emit)
+{
+  pthread_t feeder;
+  struct worker *workers = malloc(Nthreads * sizeof(struct worker));
+  if (workers == NULL)
+    error_exit("cannot allocate memory");
+  errno = pthread_create(&feeder, NULL, feed_run, names);
+  if (errno != 0)
+    error_exit("cannot create thread");
+  for (int i = 0; i < Nthreads; i++) {
+    worker_init(&workers[i]);
+    errno = pthread_create(&workers[i].thread, NULL, worker_run,
+        &workers[i]);
+    if (errno != 0)
+      error_exit("cannot create thread");
+  }
+
+  for (;;) {
+    (void) pthread_mutex_lock(&job_lock);
+    while (given_head == NULL && !given_done)
+      (void) pthread_cond_wait(&job_cond, &job_lock);
+    struct job *job = given_head;
+    if (job != NULL) {
+      given_head = job->next;
+      if (given_head == NULL) given_tail = NULL;
+      ngiven--;
+      (void) pthread_cond_broadcast(&job_cond);
+    }
+    (void) pthread_mutex_unlock(&job_lock);
+    if (job == NULL) break;
+    emit_job(job, emit);
+  }
+
+  (void) pthread_join(feeder, NULL);
+  for (int i = 0; i < Nthreads; i++) {
+    (void) pthread_join(workers[i].thread, NULL);
+    worker_cleanup(&workers[i]);
+  }
+  free(workers);
+  free(pending);
+}
+
+
+/**
+ * Fingerprint a file, or the files in a directory tree, in order.
+ */
+static void run_sequential(struct worker *wk, const char *fname, int isdir,
+    fp_emit_t emit)
+{
+  if (isdir) {
+    struct entry *entries;
+    size_t count = walk_dir(fname, Extensions, &entries);
+    for (size_t i = 0; i < count; i++) {
+      run_sequential(wk, entries[i].path, entries[i].isdir, emit);
+      free(entries[i].path);
+    }
+    free(entries);
+  } else {
+    wk->res = wk->results;
+    if (fingerprint(wk, fname)) result_emit(wk->results, emit);
+    result_free(wk->results);
+  }
+}
+
+
+// with Tokensave, the results are passed on after saving their tokens
+static fp_emit_t emit_saved;
+static FILE *tokout;
+
+static void emit_save(const struct fpresult *res)
+{
+  if (res->param == 0)
+    tokfile_write(tokout, res->path, res->ntokens, res->tokens,
+        res->tokenslen);
+  emit_saved(res);
+}
+
+
+void fp_run(char *const files[], int nfiles, fp_emit_t emit)
+{
+  struct names names;
+
+  if (Params != NULL) {
+    params = Params;
+    nparams = Nparams;
+  } else {
+    default_param.ntoken = Ntoken;
+    default_param.winnowsize = Winnowsize;
+    params = &default_param;
+    nparams = 1;
+  }
+  // weight of the token leaving the rolling window
+  roll_outs = malloc(nparams * sizeof(hash_t));
+  if (roll_outs == NULL)
+    error_exit("cannot allocate memory");
+  for (int p = 0; p < nparams; p++) {
+    roll_outs[p] = 1;
+    for (int i = 1; i < params[p].ntoken; i++) roll_outs[p] *= ROLL_BASE;
+  }
+
+  // with several parameters, the tokens are scanned once and replayed
+  replay = Functions || Tokensave != NULL || Tokenload != NULL ||
+    nparams > 1;
+  if (Tokensave != NULL) {
+    tokout = tokfile_create(Tokensave);
+    emit_saved = emit;
+    emit = emit_save;
+  }
+  if (Tokenload != NULL) tokfile_open(&tokin, Tokenload);
+  if (Cachefile != NULL) cache_load(Cachefile);
+  names_init(&names, files, nfiles, Nullsep ? '\0' : '\n');
+  if (Nthreads == 1) {
+    // for each file specified, call winnowing routine
+    struct worker wk;
+    const char *fname;
+    worker_init(&wk);
+    wk.results = result_new();
+    struct tokrec rec;
+    while (Tokenload != NULL && tokfile_next(&tokin, &rec)) {
+      wk.res = wk.results;
+      if (fingerprint_tokens(&wk, &rec)) result_emit(wk.results, emit);
+      result_free(wk.results);
+    }
+    while (Tokenload == NULL && (fname = names_next(&names)) != NULL) {
+      run_sequential(&wk, fname, Recursive && walk_isdir(fname), emit);
+    }
+    worker_cleanup(&wk);
+    free(wk.results);
+  } else {
+    run_parallel(&names, emit);
+  }
+  names_free(&names);
+  if (Cachefile != NULL) cache_save(Cachefile);
+  if (Tokenload != NULL) tokfile_close(&tokin);
+  if (Tokensave != NULL) tokfile_finish(tokout);
+  free(roll_outs);
+}
+
+
+char *fp_parse_param(char *arg)
+{
+  char *w = strchr(arg, ',');
+  char *file = w != NULL ? strchr(w + 1, ',') : NULL;
+  if (file == NULL || file[1] == '\0') usage();
+  *w++ = '\0';
+  *file++ = '\0';
+
+  struct fpparam *new_params = realloc(Params,
+      (Nparams + 1) * sizeof(struct fpparam));
+  if (new_params == NULL)
+    error_exit("cannot allocate memory");
+  Params = new_params;
+  Params[Nparams].ntoken = parse_num(arg);
+  Params[Nparams].winnowsize = parse_num(w);
+  if (Params[Nparams].ntoken <= 0 || Params[Nparams].winnowsize <= 0)
+    usage();
+  Nparams++;
+  return file;
+}
+
+
+/**
+ * A source file being scanned, either through stdio, read into memory or
+ * memory mapped.
+ */
+struct input {
+  FILE *f;
+  char *map;      // start of the mapping
+  size_t maplen;  // length of the mapping
+  YY_BUFFER_STATE buf;
+};
+
+
+/**
+ * Map the file at fd into memory, followed by at least TOK_PAD NUL bytes:
+ * flex requires two at the end of a buffer to be scanned in place, the
+ * tokenizer TOK_PAD.
+ *
+ * First, an anonymous (zero-filled) region large enough for the file and
+ * the NULs is reserved, then the file is mapped over its beginning.  The
+ * bytes after the end of file are zero, whether they fall in the last page
+ * of the file or in the reserved page behind it.  The mapping is private
+ * and writable because the scanner temporarily terminates each token in
+ * the buffer.
+ */
+static int input_map(struct input *in, int fd, size_t size)
+{
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  in->maplen = (size + TOK_PAD + pagesize - 1) / pagesize * pagesize;
+  in->map = mmap(NULL, in->maplen, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (in->map == MAP_FAILED) return -1;
+  if (size > 0) {
+    if (mmap(in->map, size, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      (void) munmap(in->map, in->maplen);
+      return -1;
+    }
+    (void) madvise(in->map, size, MADV_SEQUENTIAL);
+  }
+  return 0;
+}
+
+
+/**
+ * Read the whole file f into the worker's text buffer, followed by
+ * TOK_PAD NUL bytes.  Return the size of the file, or -1 on error.
+ */
+static ssize_t input_read(struct worker *wk, FILE *f)
+{
+  size_t len = 0;
+  for (;;) {
+    if (wk->textsize - len < BUFSIZ + TOK_PAD) {
+      wk->textsize = wk->textsize > 0 ? 2 * wk->textsize : 64 * 1024;
+      char *new_text = realloc(wk->text, wk->textsize);
+      if (new_text == NULL)
+        error_exit("cannot allocate memory");
+      wk->text = new_text;
+    }
+    size_t n = fread(wk->text + len, 1, wk->textsize - len - TOK_PAD, f);
+    len += n;
+    if (n == 0) break;
+  }
+  if (ferror(f)) return -1;
+  memset(wk->text + len, 0, TOK_PAD);
+  return len;
+}
+
+
+/**
+ * Open a source file and make it the input of the worker's scanner,
+ * or its tokenizer if Fastlex is set.
+ * Return 0 on success, -1 on error with errno set.
+ */
+static int input_open(struct input *in, const char *fname, struct worker *wk)
+{
+  memset(in, 0, sizeof *in);
+  if (!Mmap) {
+    in->f = fopen(fname, "r");
+    if (in->f == NULL) return -1;
+    if (!Fastlex) {
+      yyrestart(in->f, wk->scanner);
+      return 0;
+    }
+    ssize_t len = input_read(wk, in->f);
+    if (len == -1) {
+      int err = errno;
+      (void) fclose(in->f);
+      errno = err;
+      return -1;
+    }
+    tok_init(&wk->tok, wk->text, len);
+    return 0;
+  }
+
+  struct stat st;
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1) return -1;
+  if (fstat(fd, &st) == -1 || input_map(in, fd, st.st_size) == -1) {
+    int err = errno;
+    (void) close(fd);
+    errno = err;
+    return -1;
+  }
+  (void) close(fd);
+  if (Fastlex) {
+    tok_init(&wk->tok, in->map, st.st_size);
+    return 0;
+  }
+  in->buf = yy_scan_buffer(in->map, st.st_size + 2, wk->scanner);
+  if (in->buf == NULL)
+    error_exit("cannot scan buffer");
+  return 0;
+}
+
+
+static void input_close(struct input *in, yyscan_t scanner)
+{
+  if (in->f != NULL) {
+    (void) fclose(in->f);
+  } else {
+    if (in->buf != NULL) yy_delete_buffer(in->buf, scanner);
+    (void) munmap(in->map, in->maplen);
+  }
+}
+
+
+/**
+ * Fingerprint a single file, recording to the worker's result.
+ * Return 0 if the file cannot be opened, 1 otherwise.
+ */
+static int fingerprint(struct worker *wk, const char *fname)
+{
+  struct input in;
+  struct cache_key key;
+  if (Cachefile != NULL) {
+    // unchanged files are not scanned again
+    if (cache_key(&key, fname, Cachecheck) != 0) {
+      (void) fprintf(stderr,
+          "%s: cannot open %s: %s\n", program_name, fname, strerror(errno));
+      return 0;
+    }
+    if (cache_lookup(&key, wk->res)) return 1;
+  }
+  if (input_open(&in, fname, wk) != 0) {
+    (void) fprintf(stderr,
+        "%s: cannot open %s: %s\n", program_name, fname, strerror(errno));
+    return 0;
+  }
+  // canonicalized absolute filename
+  wk->res->path = realpath(fname, NULL);
+  if (wk->res->path == NULL) {
+    error_exit("cannot canonicalize pathname");
+  }
+  yyset_lineno(1, wk->scanner);
+  lex_reset(wk->scanner);
+  if (replay) scan(wk);
+  winnow_all(wk);
+  input_close(&in, wk->scanner);
+  if (Cachefile != NULL) cache_store(&key, wk->res);
+  return 1;
+}
+
+
+/**
+ * Fingerprint the tokens of a file from the token file.
+ */
+static int fingerprint_tokens(struct worker *wk, const struct tokrec *rec)
+{
+  wk->res->path = strdup(rec->path);
+  if (wk->res->path == NULL)
+    error_exit("cannot allocate memory");
+  ts_clear(&wk->ts);
+  tok_decode(rec, &wk->ts);
+  winnow_all(wk);
+  return 1;
+}
+
+
+/**
+ * Hash and winnow the tokens of the file with each of the parameters,
+ * recording to the worker's results.  With several parameters, the tokens
+ * are replayed for each.
+ */
+static void winnow_all(struct worker *wk)
+{
+  struct fpresult *first = wk->results;
+  for (int i = 0; i < nparams; i++) {
+    wk->res = &wk->results[i];
+    wk->res->path = first->path;
+    wk->res->funcs = first->funcs;
+    wk->res->nfuncs = first->nfuncs;
+    wk->chain = params[i].ntoken;
+    wk->roll_out = roll_outs[i];
+    wk->ntoken = 0;
+    wk->roll = 0;
+    wk->tspos = 0;
+    wk->func = 0;
+    winnow(wk, params[i].winnowsize); // main winnowing routine
+  }
+  wk->res = first;
+}
+
+
+/**
+ * Get the next token from the scanner or the tokenizer.
+ */
+static inline int scan_token(struct worker *wk)
+{
+  return Fastlex ? tok_next(&wk->tok) : yylex(wk->scanner);
+}
+
+/**
+ * Line number of the most recent token scanned.
+ */
+static inline int scan_lineno(struct worker *wk)
+{
+  return Fastlex ? wk->tok.lineno : yyget_lineno(wk->scanner);
+}
+
+/**
+ * Get the next token to hash: scanned, or replayed from the tokens
+ * scanned before.
+ */
+static inline int next_token(struct worker *wk)
+{
+  if (!replay) return scan_token(wk);
+  return wk->tspos < wk->ts.count ? wk->ts.tok[wk->tspos++] : 0;
+}
+
+/**
+ * Line number of the most recent token.
+ */
+static inline int lineno(struct worker *wk)
+{
+  if (!replay) return scan_lineno(wk);
+  return wk->tspos > 0 ? wk->ts.line[wk->tspos - 1] : 1;
+}
+
+
+/**
+ * Scan all tokens of the file, find the function definitions in them if
+ * Functions is set, and encode them for the token file if Tokensave is.
+ * The tokens are then replayed for hashing.
+ */
+static void scan(struct worker *wk)
+{
+  int tok;
+  ts_clear(&wk->ts);
+  while ((tok = scan_token(wk)) != 0) {
+    if (Fastlex) {
+      ts_add(&wk->ts, tok, wk->tok.lineno, wk->tok.text,
+          wk->tok.p - wk->tok.text);
+    } else {
+      ts_add(&wk->ts, tok, yyget_lineno(wk->scanner),
+          yyget_text(wk->scanner), yyget_leng(wk->scanner));
+    }
+  }
+  if (Functions) wk->res->nfuncs = fparse(&wk->ts, &wk->res->funcs);
+  if (Tokensave != NULL) {
+    struct fpresult *res = wk->res;
+    res->ntokens = wk->ts.count;
+    res->tokenslen = tok_encode(&wk->ts, &wk->enc, &wk->encsize);
+    res->tokens = malloc(res->tokenslen);
+    if (res->tokenslen > 0 && res->tokens == NULL)
+      error_exit("cannot allocate memory");
+    memcpy(res->tokens, wk->enc, res->tokenslen);
+  }
+}
+
+
+static hash_t hash(struct worker *wk)
+{
+  MD5_CTX md5;
+  union {
+    unsigned char digest[16];
+    hash_t h;
+  } result;
+
+  MD5_Init(&md5);
+  for (int i=0, j=wk->ntoken; i < wk->chain; i++) {
+    // for hashing, we start at the most recent value and work backwards
+    MD5_Update(&md5, &wk->tokenbuf[--j % wk->chain], sizeof wk->tokenbuf[0]);
+  }
+  MD5_Final(result.digest, &md5);
+  return result.h;
+}
+
+/**
+ * Add a token to the rolling hash, removing the token that falls out of
+ * the n-gram.  Must be called before tok is stored in tokenbuf, as the
+ * oldest token still occupies its slot.
+ */
+static void roll_update(struct worker *wk, int tok)
+{
+  if (wk->ntoken >= wk->chain) {
+    wk->roll -= (hash_t) wk->tokenbuf[wk->ntoken % wk->chain] * wk->roll_out;
+  }
+  wk->roll = wk->roll * ROLL_BASE + (hash_t) tok;
+}
+
+/**
+ * Hash of the current n-gram from the rolling state.
+ *
+ * The polynomial itself is poorly mixed in its high bits for small token
+ * IDs, which would bias the minimum selection of winnowing. Therefore it is
+ * passed through the 64-bit finalizer of MurmurHash3. The finalizer is a
+ * bijection, so it adds no collisions: two n-grams collide iff their
+ * polynomials are equal modulo 2^64.  For distinct n-grams of small tokens
+ * this is about as likely as for a random 64-bit hash, but arithmetic
+ * modulo 2^64 admits constructed collisions (Thue-Morse sequences) for
+ * n-grams longer than about 2000 tokens.
+ */
+static hash_t roll_hash(struct worker *wk)
+{
+  hash_t h = wk->roll;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/**
+ * Get the next hash.
+ *
+ * Continuously reads tokens from lexer, forms n-grams,
+ * and returns their hashes.
+ * Return the hash for the next n-gram or 0 if no tokens are left.
+ */
+static hash_t next_hash(struct worker *wk)
+{
+  int tok;
+  while ((tok = next_token(wk)) != 0) {
+    if (Rolling) roll_update(wk, tok);
+    wk->tokenbuf[wk->ntoken % wk->chain] = tok;
+    // fill the first chain
+    if (++wk->ntoken < wk->chain) continue;
+    return Rolling ? roll_hash(wk) : hash(wk);
+  }
+  return 0;
+}
+
+
+/**
+ * Record a given hash with line number, and the function containing the
+ * n-gram starting at token pos.  Hashes are recorded in the order of
+ * their positions.
+ */
+static void record(struct worker *wk, hash_t h, unsigned long pos)
+{
+  struct fpresult *res = wk->res;
+  if (res->count == res->capacity) {
+    res->capacity += 1024;
+    struct fprec *new_recs = realloc(res->recs,
+        res->capacity * sizeof(struct fprec));
+    if (new_recs == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    res->recs = new_recs;
+  }
+  res->recs[res->count].hash = h;
+  res->recs[res->count].linepos = lineno(wk);
+  res->recs[res->count].func = -1;
+  if (Functions) {
+    size_t end = pos + wk->chain - 1;
+    while (wk->func < res->nfuncs && res->funcs[wk->func].last < end)
+      wk->func++;
+    if (wk->func < res->nfuncs && res->funcs[wk->func].first <= pos)
+      res->recs[res->count].func = wk->func;
+  }
+  res->count++;
+}
+
+
+/**
+ * Select the hashes of a file by robust winnowing: in each window of w
+ * consecutive hashes, the rightmost minimal hash is selected, and recorded
+ * the first time it is selected.
+ *
+ * As long as the selected hash stays in the window, a new hash only has to
+ * be compared against it.  When it leaves the window, the new minimum is
+ * found without scanning the window (van Herk/Gil-Werman): the hashes are
+ * split into blocks of w, so the window spans the tail of the previous
+ * block and the head of the current one.  The minimum of the head is kept
+ * while the hashes come in, the minima of all tails of the previous block
+ * are computed backwards once, when they are first needed.  This takes
+ * amortized constant work per hash, independent of w.
+ */
+static void winnow(struct worker *wk, int w) {
+  struct winrec *window = wk->window; // the last w hashes, by position
+  unsigned mask = wk->winmask;
+  unsigned long pos = 0;      // position of the current hash
+  unsigned long minpos = 0;   // position of the selected hash
+  hash_t minhash = 0;
+  unsigned long start = 0;    // start of the current block
+  int tails = 0;              // tails of the previous block computed
+  unsigned long headpos = 0;  // rightmost minimum of the current block
+  hash_t headmin = 0;
+  hash_t h;
+
+  for (; (h = next_hash(wk)) != 0; pos++) {
+    struct winrec *e = &window[pos & mask];
+    e->hash = h;
+    if (pos - start == (unsigned long) w) {
+      start = pos; // begin a new block
+      tails = 0;
+    }
+    if (pos == start || h <= headmin) {
+      headmin = h;
+      headpos = pos;
+    }
+
+    if (pos == 0 || h <= minhash) { // '<' for robust winnowing
+      minhash = h;
+      minpos = pos;
+    } else if (minpos + w == pos) {
+      // The selected hash left the window.  The rightmost minimum is the
+      // one of the head, unless the tail of the previous block in the
+      // window has a smaller hash.
+      minhash = headmin;
+      minpos = headpos;
+      unsigned long first = pos + 1 - w; // first position in the window
+      if (first < start) {
+        if (!tails) {
+          // rightmost minima of the tails start-1, start-2, ..., first
+          struct winrec *prev = &window[(start - 1) & mask];
+          prev->min = prev->hash;
+          prev->minpos = start - 1;
+          for (unsigned long p = start - 1; p-- > first; ) {
+            struct winrec *t = &window[p & mask];
+            if (t->hash < prev->min) {
+              t->min = t->hash;
+              t->minpos = p;
+            } else {
+              t->min = prev->min;
+              t->minpos = prev->minpos;
+            }
+            prev = t;
+          }
+          tails = 1;
+        }
+        struct winrec *t = &window[first & mask];
+        if (t->min < minhash) {
+          minhash = t->min;
+          minpos = t->minpos;
+        }
+      }
+    } else {
+      continue;
+    }
+    record(wk, minhash, minpos);
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef _FPRINT_H_
+#define _FPRINT_H_
+
+#include "common.h"
+
+/*
+ * Fingerprinting of C source files: the lexer, n-gram hashing and
+ * winnowing, shared by fpcc-sig and fpcc-build.
+ */
+
+// options, set before calling fp_run()
+extern int Ntoken;     // number of tokens forming an n-gram
+extern int Winnowsize; // window size of the winnowing algorithm
+extern int Rolling;    // use the rolling hash instead of MD5
+extern int Nthreads;   // number of worker threads
+extern int Mmap;       // scan memory mapped files in place
+extern int Fastlex;    // use the hand-written tokenizer instead of flex
+extern int Recursive;  // walk the directories given
+extern const char *Extensions; // comma-separated extensions of the files
+                               // found in directories, empty for all
+extern int Nullsep;    // file lists on stdin are separated by NUL
+extern const char *Cachefile; // cache of fingerprints, or NULL
+extern int Cachecheck; // compare contents instead of mtime with the cache
+extern int Functions;  // find the function definitions and tag the hashes
+extern const char *Tokensave; // save the token streams to this file, or NULL
+extern const char *Tokenload; // fingerprint the token streams of this file
+                              // instead of scanning files, or NULL
+
+/**
+ * The chainlength and winnow size of a fingerprint.
+ */
+struct fpparam {
+  int ntoken;
+  int winnowsize;
+};
+
+extern struct fpparam *Params; // fingerprint with each of these parameters
+                               // in one pass, or NULL for Ntoken and
+                               // Winnowsize only
+extern int Nparams;
+
+/**
+ * A hash selected by winnowing, with the line number of its origin.
+ */
+struct fprec {
+  hash_t hash;
+  int linepos;
+  int func; // index of the function containing its n-gram, or -1
+};
+
+/**
+ * A function definition, with the range of its lines and tokens.
+ */
+struct fpfunc {
+  char *name;
+  int first_line, last_line;
+  size_t first, last;
+};
+
+/**
+ * The fingerprint of a single file.
+ */
+struct fpresult {
+  char *path; // canonicalized absolute path
+  size_t count, capacity;
+  struct fprec *recs;
+  size_t nfuncs;         // number of functions, if Functions is set
+  struct fpfunc *funcs;
+  size_t ntokens;        // number of tokens, if Tokensave is set
+  unsigned char *tokens; // the encoded tokens
+  size_t tokenslen;
+  int param;             // index of the parameters in Params, or 0
+};
+
+/**
+ * Called for the fingerprint of each file, in the order of the files, and
+ * for each of the Params in their order.  The result is only valid during
+ * the call.
+ */
+typedef void (*fp_emit_t)(const struct fpresult *);
+
+/**
+ * Fingerprint the given files and pass each result to emit.
+ * A file named "-" stands for a list of files read from stdin, separated
+ * by newlines, or NUL if Nullsep is set.  If Recursive is set, directories
+ * are replaced by the files found in them, in the order of their names.
+ * Files that cannot be opened are reported and skipped.
+ * If Tokenload is set, the files are ignored, and the token streams of
+ * the token file are fingerprinted instead, in the order they were saved.
+ */
+void fp_run(char *const files[], int nfiles, fp_emit_t emit);
+
+/**
+ * Parse the parameters "chainlength,winnow,file" given with -p and append
+ * them to Params.  Return the file, a part of arg, or call usage() if arg
+ * is malformed.
+ */
+char *fp_parse_param(char *arg);
+
+#endif // _FPRINT_H_
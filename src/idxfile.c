@@ -0,0 +1,575 @@
+/**
+ * Reading fingerprint indices.
+ *
+ * An index is mapped into memory and used in place, as far as its layout
+ * matches the one of the host; the sections are checked when the index is
+ * opened, so the readers need not check the paths and functions again.
+ *
+ * Indices written before the format was versioned store the line and file
+ * number of a hash in its entry instead of its input position, as 16-bit
+ * integers, and the paths in full.  Their
+ * hashes are numbered in input order while they are read, and their lines
+ * and the first hash of each file are collected.  The file numbers are
+ * taken modulo 65536, so indices of more files are read correctly, as
+ * long as at most 65535 files without hashes follow each other.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "idxfile.h"
+
+// the size of a hash entry of the unversioned format
+#define OLD_ENTRY_SIZE 16
+
+
+static uint16_t get_u16(const unsigned char *p)
+{
+  uint16_t v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+
+/**
+ * Read a 32-bit integer in little endian, or in host order if le is 0.
+ */
+static uint32_t get_u32(const unsigned char *p, int le)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof v);
+  return le ? idx_le32(v) : v;
+}
+
+
+static uint64_t get_u64(const unsigned char *p, int le)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof v);
+  return le ? idx_le64(v) : v;
+}
+
+
+static void *copy_alloc(struct idx_file *ix, int what, size_t size)
+{
+  ix->copy[what] = malloc(size > 0 ? size : 1);
+  if (ix->copy[what] == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  return ix->copy[what];
+}
+
+
+/**
+ * The n 32-bit integers at p, in place or copied to host order.
+ */
+static uint32_t *read_u32s(struct idx_file *ix, int what,
+    const unsigned char *p, uint64_t n)
+{
+  if (idx_host_le()) return (uint32_t *) p;
+  uint32_t *v = copy_alloc(ix, what, n * sizeof(uint32_t));
+  for (uint64_t i = 0; i < n; i++) {
+    v[i] = get_u32(p + 4 * i, 1);
+  }
+  return v;
+}
+
+
+/**
+ * The n 64-bit integers at p, in place or copied to host order.
+ */
+static const uint64_t *read_u64s(struct idx_file *ix, int what,
+    const unsigned char *p, uint64_t n)
+{
+  if (idx_host_le()) return (const uint64_t *) p;
+  uint64_t *v = copy_alloc(ix, what, n * sizeof(uint64_t));
+  for (uint64_t i = 0; i < n; i++) {
+    v[i] = get_u64(p + 8 * i, 1);
+  }
+  return v;
+}
+
+
+static int read_hashes(struct idx_file *ix, const unsigned char *p,
+    uint64_t size)
+{
+  if (size % 16 != 0 || size / 16 == 0 || size / 16 > UINT32_MAX) return -1;
+  ix->count = size / 16;
+  if (idx_hashes_native()) {
+    ix->hashes = (const hash_entry_t *) p;
+    return 0;
+  }
+  hash_entry_t *hashes =
+    copy_alloc(ix, COPY_HASHES, ix->count * sizeof(hash_entry_t));
+  for (uint32_t i = 0; i < ix->count; i++, p += 16) {
+    hashes[i].hash = get_u64(p, 1);
+    hashes[i].seq = get_u32(p + 8, 1);
+    hashes[i].next = get_u32(p + 12, 1);
+  }
+  ix->hashes = hashes;
+  return 0;
+}
+
+
+/**
+ * Read the compressed hash entries.  The words of the hashes and links
+ * are used in place, and converted as they are read.
+ */
+static int read_packed(struct idx_file *ix, const unsigned char *p,
+    uint64_t size)
+{
+  struct idx_packed *pk = &ix->packed;
+  if (size < 32) return -1;
+  uint32_t count = get_u32(p, 1);
+  pk->block = get_u32(p + 4, 1);
+  pk->width = get_u32(p + 8, 1);
+  pk->nblocks = get_u32(p + 12, 1);
+  uint64_t nbits = get_u64(p + 16, 1), nlinks = get_u64(p + 24, 1);
+  if (count == 0 || pk->block == 0 || pk->width == 0 || pk->width > 32 ||
+      pk->nblocks != (count - 1) / pk->block + 1) return -1;
+  if ((size - 32) / 8 < 2 * (uint64_t) pk->nblocks ||
+      (size - 32) / 8 - 2 * (uint64_t) pk->nblocks < nbits ||
+      (size - 32) / 8 - 2 * (uint64_t) pk->nblocks - nbits < nlinks)
+    return -1;
+  ix->count = count;
+  p += 32;
+  pk->first = read_u64s(ix, COPY_BLOCKS, p, pk->nblocks);
+  p += 8 * (uint64_t) pk->nblocks;
+  pk->start = read_u64s(ix, COPY_STARTS_OF_BLOCKS, p, pk->nblocks);
+  p += 8 * (uint64_t) pk->nblocks;
+  pk->bits = (const uint64_t *) p;
+  pk->links = (const uint64_t *) (p + 8 * nbits);
+
+  // the fields of each block, and the links, must be in the words
+  for (uint32_t b = 0; b < pk->nblocks; b++) {
+    uint64_t n = b + 1 < pk->nblocks ? pk->block : count - b * pk->block;
+    uint64_t start = pk->start[b] >> 8, width = pk->start[b] & 0xff;
+    if (width > 64 || start > nbits * 64 || n * width > nbits * 64 - start)
+      return -1;
+  }
+  if (2 * (uint64_t) count * pk->width > nlinks * 64) return -1;
+  return 0;
+}
+
+
+/**
+ * Read the count hash entries of the unversioned format at p, in host
+ * order, with the paths read already.
+ */
+static int read_old_hashes(struct idx_file *ix, const unsigned char *p,
+    uint32_t count)
+{
+  if (count == 0) return -1;
+  ix->count = count;
+  hash_entry_t *hashes =
+    copy_alloc(ix, COPY_HASHES, count * sizeof(hash_entry_t));
+  uint32_t *lines = copy_alloc(ix, COPY_LINES, count * sizeof(uint32_t));
+  uint32_t *first = copy_alloc(ix, COPY_FIRST,
+      ix->path_cnt * sizeof(uint32_t));
+  ix->hashes = hashes;
+  ix->lines = lines;
+  ix->first = first;
+
+  // walk the hashes in input order; the file number of the dummy entry
+  // is not used
+  uint32_t file = 0, nfirst = 0, k = 0;
+  uint16_t prev_file = 0;
+  for (uint32_t seq = 0; seq < count; seq++) {
+    const unsigned char *e = p + (size_t) k * OLD_ENTRY_SIZE;
+    uint16_t cur_file = get_u16(e + 10);
+    hashes[k].hash = get_u64(e, 0);
+    hashes[k].seq = seq;
+    hashes[k].next = get_u32(e + 12, 0);
+    lines[seq] = seq > 0 ? get_u16(e + 8) : 0;
+    if (seq > 0) {
+      file += (uint16_t) (cur_file - prev_file);
+      prev_file = cur_file;
+      if (file >= ix->path_cnt) return -1;
+      while (nfirst <= file) first[nfirst++] = seq;
+    }
+    // the last hash in input order, and only that, has no successor
+    k = hashes[k].next;
+    if (k >= count || (k == 0) != (seq == count - 1)) return -1;
+  }
+  while (nfirst < ix->path_cnt) first[nfirst++] = count;
+  return 0;
+}
+
+
+/**
+ * Check that the n offsets into strings of length len point to
+ * NUL-terminated strings.
+ */
+static int check_strings(const char *strings, uint64_t len, uint32_t n,
+    uint64_t (*offset)(const void *, uint32_t), const void *arg)
+{
+  if (n > 0 && (len == 0 || strings[len - 1] != '\0')) return -1;
+  for (uint32_t i = 0; i < n; i++) {
+    if (offset(arg, i) >= len) return -1;
+  }
+  return 0;
+}
+
+
+static uint64_t name_offset(const void *ix, uint32_t i)
+{
+  return ((const struct idx_file *) ix)->funcs[i].name;
+}
+
+
+/**
+ * The length of the longest path, of paths stored in full.
+ */
+static uint32_t path_max(const struct idx_file *ix)
+{
+  size_t max = 0;
+  for (uint32_t i = 0; i < ix->path_cnt; i++) {
+    size_t len = strlen(ix->paths + ix->path_off[i]);
+    if (len > max) max = len;
+  }
+  return max;
+}
+
+
+/**
+ * Read a variable length integer at *p, before end, and advance *p.
+ */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+    uint64_t *v)
+{
+  *v = 0;
+  for (unsigned shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char b = *(*p)++;
+    *v |= (uint64_t) (b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return 0;
+  }
+  return -1;
+}
+
+
+/**
+ * Read the prefix-coded paths.  The blocks are walked once, to check that
+ * each path is within its block and not longer than the longest one, but
+ * the paths are only decoded by idx_path().
+ */
+static int read_prefixed(struct idx_file *ix, const unsigned char *p,
+    uint64_t size)
+{
+  if (size < 16) return -1;
+  uint32_t n = get_u32(p, 1), npaths = get_u32(p + 4, 1);
+  uint32_t block = get_u32(p + 8, 1), max = get_u32(p + 12, 1);
+  if (block == 0 || npaths > n || (npaths == 0) != (n == 0) ||
+      max == UINT32_MAX) return -1;
+  uint32_t nblocks = npaths / block + (npaths % block != 0);
+  if ((size - 16) / 8 < nblocks ||
+      (size - 16 - 8 * (uint64_t) nblocks) / 4 < n) return -1;
+  const unsigned char *ids = p + 16 + 8 * (uint64_t) nblocks;
+  const unsigned char *start = ids + 4 * (uint64_t) n, *end = p + size;
+  ix->path_cnt = n;
+  ix->path_max = max;
+  ix->path_block = block;
+  ix->path_off = read_u64s(ix, COPY_PATHS, p + 16, nblocks);
+  ix->path_ids = read_u32s(ix, COPY_PATH_IDS, ids, n);
+  ix->paths = (const char *) start;
+  for (uint32_t i = 0; i < n; i++) {
+    if (ix->path_ids[i] >= npaths) return -1;
+  }
+
+  // each block starts where the previous one ends
+  const unsigned char *q = start;
+  for (uint32_t b = 0; b < nblocks; b++) {
+    if (ix->path_off[b] != (uint64_t) (q - start)) return -1;
+    uint64_t len = 0;
+    for (uint32_t k = 0; k < block && b * block + k < npaths; k++) {
+      uint64_t shared = 0;
+      if (k > 0 && (get_varint(&q, end, &shared) != 0 || shared > len))
+        return -1;
+      const unsigned char *nul = memchr(q, '\0', end - q);
+      if (nul == NULL) return -1;
+      len = shared + (nul - q);
+      if (len > max) return -1;
+      q = nul + 1;
+    }
+  }
+  return q == end ? 0 : -1;
+}
+
+
+const char *idx_path(const struct idx_file *ix, uint32_t i, char *buf)
+{
+  if (ix->path_ids == NULL) return ix->paths + ix->path_off[i];
+  uint32_t id = ix->path_ids[i];
+  const unsigned char *p = (const unsigned char *) ix->paths +
+    ix->path_off[id / ix->path_block];
+  // decode the paths of the block up to the one of the file
+  size_t shared = 0;
+  for (uint32_t k = 0; ; k++) {
+    if (k > 0) {
+      shared = 0;
+      for (unsigned shift = 0; ; shift += 7) {
+        shared |= (size_t) (*p & 0x7f) << shift;
+        if ((*p++ & 0x80) == 0) break;
+      }
+    }
+    size_t len = strlen((const char *) p);
+    memcpy(buf + shared, p, len + 1);
+    if (k == id % ix->path_block) return buf;
+    p += len + 1;
+  }
+}
+
+
+char *idx_path_buf(const struct idx_file *ix)
+{
+  char *buf = malloc((size_t) ix->path_max + 1);
+  if (buf == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  return buf;
+}
+
+
+static int read_funcs(struct idx_file *ix, const unsigned char *p,
+    uint64_t size)
+{
+  if (size < 8) return -1;
+  uint32_t n = get_u32(p, 1);
+  if ((size - 8) / 16 < n) return -1;
+  ix->nfuncs = n;
+  ix->names = (const char *) p + 8 + 16 * (uint64_t) n;
+  if (idx_host_le()) {
+    ix->funcs = (const struct idx_funcrec *) (p + 8);
+  } else {
+    struct idx_funcrec *funcs =
+      copy_alloc(ix, COPY_FUNCS, n * sizeof(struct idx_funcrec));
+    for (uint32_t i = 0; i < n; i++) {
+      const unsigned char *rec = p + 8 + 16 * (uint64_t) i;
+      funcs[i].file = get_u32(rec, 1);
+      funcs[i].first_line = get_u32(rec + 4, 1);
+      funcs[i].last_line = get_u32(rec + 8, 1);
+      funcs[i].name = get_u32(rec + 12, 1);
+    }
+    ix->funcs = funcs;
+  }
+  return check_strings(ix->names, size - 8 - 16 * (uint64_t) n, n,
+      name_offset, ix);
+}
+
+
+/**
+ * Read an index of the current version from the mapping.
+ */
+static int read_sections(struct idx_file *ix)
+{
+  const unsigned char *map = ix->map;
+  const size_t hdr = sizeof IDX_MAGIC - 1 + 2 * sizeof(uint32_t);
+  if (ix->len < hdr) return -1;
+  uint32_t version = get_u32(map + 8, 1);
+  uint32_t nsections = get_u32(map + 12, 1);
+  if (version != IDX_VERSION) return -1;
+  if ((ix->len - hdr) / sizeof(struct idx_section) < nsections) return -1;
+
+  enum { HASH, PACK, PREF, FILES, LINE, FUNC, TAGS, NSECTIONS };
+  const char *ids[NSECTIONS] = {
+    IDX_HASH, IDX_PACK, IDX_PREF, IDX_FILE, IDX_LINE, IDX_FUNC, IDX_TAGS
+  };
+  const unsigned char *data[NSECTIONS] = { NULL };
+  uint64_t size[NSECTIONS] = { 0 };
+  for (uint32_t i = 0; i < nsections; i++) {
+    const unsigned char *sec = map + hdr + i * sizeof(struct idx_section);
+    uint64_t offset = get_u64(sec + 8, 1), sz = get_u64(sec + 16, 1);
+    if (offset % IDX_ALIGN != 0 || offset > ix->len ||
+        sz > ix->len - offset) return -1;
+    int k = 0;
+    while (k < NSECTIONS && memcmp(sec, ids[k], 4) != 0) k++;
+    if (k == NSECTIONS) continue;
+    if (data[k] != NULL) return -1;
+    data[k] = map + offset;
+    size[k] = sz;
+  }
+  if ((data[HASH] == NULL) == (data[PACK] == NULL) || data[PREF] == NULL ||
+      read_prefixed(ix, data[PREF], size[PREF]) != 0) return -1;
+
+  // the hashes, their files and lines
+  if ((data[HASH] != NULL ? read_hashes(ix, data[HASH], size[HASH]) :
+        read_packed(ix, data[PACK], size[PACK])) != 0 ||
+      data[FILES] == NULL || size[FILES] != 4 * (uint64_t) ix->path_cnt ||
+      data[LINE] == NULL || size[LINE] != 4 * (uint64_t) ix->count)
+    return -1;
+  ix->first = read_u32s(ix, COPY_FIRST, data[FILES], ix->path_cnt);
+  ix->lines = read_u32s(ix, COPY_LINES, data[LINE], ix->count);
+  for (uint32_t i = 0; i < ix->path_cnt; i++) {
+    if (ix->first[i] == 0 || ix->first[i] > ix->count ||
+        (i > 0 && ix->first[i] < ix->first[i - 1])) return -1;
+  }
+
+  // the functions come with the function of each hash
+  if ((data[FUNC] == NULL) != (data[TAGS] == NULL)) return -1;
+  if (data[FUNC] != NULL) {
+    if (read_funcs(ix, data[FUNC], size[FUNC]) != 0 ||
+        size[TAGS] != 4 * (uint64_t) ix->count) return -1;
+    for (uint32_t i = 0; i < ix->nfuncs; i++) {
+      if (ix->funcs[i].file >= ix->path_cnt) return -1;
+    }
+    ix->tags = read_u32s(ix, COPY_TAGS, data[TAGS], ix->count);
+  }
+  return 0;
+}
+
+
+/**
+ * Read an index written before the format was versioned: the hashes as
+ * stored in memory and the paths, in host byte order, unaligned.
+ */
+static int read_legacy(struct idx_file *ix)
+{
+  const char *map = ix->map;
+  size_t len = ix->len, pos = sizeof(uint32_t);
+  uint32_t count, n;
+
+  // the hashes, read after the paths
+  if (len < pos) return -1;
+  memcpy(&count, map, sizeof count);
+  if ((len - pos) / OLD_ENTRY_SIZE < count) return -1;
+  const unsigned char *hashes = (const unsigned char *) map + pos;
+  pos += (size_t) count * OLD_ENTRY_SIZE;
+
+  // the paths
+  if (len - pos < sizeof n) return -1;
+  memcpy(&n, map + pos, sizeof n);
+  pos += sizeof n;
+  if (len - pos < n) return -1;
+  uint64_t *off = copy_alloc(ix, COPY_PATHS, n * sizeof(uint64_t));
+  ix->path_off = off;
+  ix->paths = map + pos;
+  for (uint32_t i = 0; i < n; i++) {
+    const char *end = memchr(map + pos, '\0', len - pos);
+    if (end == NULL) return -1;
+    off[i] = map + pos - ix->paths;
+    pos = end - map + 1;
+  }
+  ix->path_cnt = n;
+  ix->path_max = path_max(ix);
+  return read_old_hashes(ix, hashes, count);
+}
+
+
+/**
+ * Mark the input positions at which a file starts.
+ */
+static void find_starts(struct idx_file *ix)
+{
+  size_t n = (ix->count + 63) / 64;
+  ix->starts = copy_alloc(ix, COPY_STARTS, n * sizeof(uint64_t));
+  memset(ix->starts, 0, n * sizeof(uint64_t));
+  for (uint32_t i = 0; i < ix->path_cnt; i++) {
+    uint32_t seq = ix->first[i];
+    if (seq < ix->count) ix->starts[seq / 64] |= (uint64_t) 1 << seq % 64;
+  }
+}
+
+
+int idx_open(struct idx_file *ix, const char *fname)
+{
+  memset(ix, 0, sizeof *ix);
+  int fd = open(fname, O_RDONLY);
+  if (fd == -1) return -1;
+  int res = idx_fdopen(ix, fd);
+  int err = errno;
+  (void) close(fd);
+  errno = err;
+  return res;
+}
+
+
+int idx_fdopen(struct idx_file *ix, int fd)
+{
+  struct stat st;
+  memset(ix, 0, sizeof *ix);
+  if (fstat(fd, &st) == -1) return -1;
+  if (st.st_size == 0) return -2;
+  ix->len = st.st_size;
+  ix->map = mmap(NULL, ix->len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (ix->map == MAP_FAILED) {
+    ix->map = NULL;
+    return -1;
+  }
+
+  int res;
+  if (ix->len >= sizeof IDX_MAGIC - 1 &&
+      memcmp(ix->map, IDX_MAGIC, sizeof IDX_MAGIC - 1) == 0) {
+    res = read_sections(ix);
+  } else {
+    res = read_legacy(ix);
+  }
+  if (res != 0) {
+    idx_close(ix);
+    return -2;
+  }
+  find_starts(ix);
+  return 0;
+}
+
+
+void idx_close(struct idx_file *ix)
+{
+  if (ix->map != NULL) (void) munmap(ix->map, ix->len);
+  for (int i = 0; i < COPY_COUNT; i++) {
+    free(ix->copy[i]);
+  }
+  memset(ix, 0, sizeof *ix);
+}
+
+
+uint32_t idx_file(const struct idx_file *ix, uint32_t seq)
+{
+  // the last file starting at or before seq
+  uint32_t lo = 0, hi = ix->path_cnt;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (ix->first[mid] <= seq) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? lo - 1 : UINT32_MAX;
+}
+
+
+uint32_t idx_seek(const struct idx_file *ix, uint32_t i, hash_t h)
+{
+  if (i >= ix->count) return i;
+  uint32_t block = ix->hashes != NULL ? IDX_BLOCK : ix->packed.block;
+  uint32_t lo = i / block + 1, hi = (ix->count - 1) / block + 1;
+  if (lo < hi && idx_hash(ix, lo * block) < h) {
+    // gallop over the blocks from lo on, by steps of 1, 2, 4 and so on,
+    // to one not starting with a hash less than h, if there is one
+    for (uint32_t step = 1; hi - lo > step; step *= 2) {
+      if (idx_hash(ix, (lo + step) * block) >= h) {
+        hi = lo + step;
+        break;
+      }
+      lo += step;
+    }
+    // the last block starting with a hash less than h
+    lo++;
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (idx_hash(ix, mid * block) < h) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    i = (lo - 1) * block;
+  }
+  while (i < ix->count && idx_hash(ix, i) < h) i++;
+  return i;
+}
@@ -0,0 +1,285 @@
+#ifndef _IDXFILE_H_
+#define _IDXFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * The fingerprint index file format, and reading indices by mapping them
+ * into memory, shared by fpcc-comp, fpcc-map and fpcc-paths.
+ *
+ * An index starts with a header: the magic IDX_MAGIC, the version and the
+ * number of sections, as 32-bit integers, followed by the section table.
+ * Each section has a 4-character ID, and its offset and size in the file
+ * as 64-bit integers.  Sections start at multiples of 8 bytes, and all
+ * integers are little endian.  Readers skip sections they do not know.
+ *
+ *   HASH  the sorted hash entries, 16 bytes each: the hash as 64-bit,
+ *         its position in input order and the link as 32-bit integers
+ *   PACK  the sorted hash entries compressed, instead of HASH: the number
+ *         of entries, the number per block, the width of the positions
+ *         and links, and the number of blocks as 32-bit, the number of
+ *         words of the hashes and of the links as 64-bit integers, then
+ *         as 64-bit integers, the first hash of each block, the bit
+ *         position of each block in the hashes shifted left by 8 plus
+ *         their width, the hashes, the positions and links
+ *   PREF  the paths prefix-coded: the number of files, of distinct
+ *         paths, of paths per block and the length of the longest path
+ *         as 32-bit, the offset of each block in the coded paths as
+ *         64-bit, the distinct path of each file as 32-bit integers, and
+ *         the coded paths
+ *   FILE  the input position of the first hash of each file, as 32-bit
+ *         integers; a hash belongs to the last file starting before it
+ *   LINE  the line of each hash in input order, as 32-bit integers
+ *   FUNC  the number of functions and 0 as 32-bit, for each function its
+ *         file, first and last line, and the offset of its name in the
+ *         strings, as 32-bit integers, the NUL-terminated names
+ *   TAGS  the function of each hash in sorted order, as 32-bit integers
+ *
+ * The distinct paths of the PREF section are sorted, and coded in blocks:
+ * the first path of a block is stored as it is, each following one as
+ * the length of the prefix it shares with its predecessor, as a variable
+ * length integer of 7 bits per byte, least significant first, and the
+ * rest of the path.  All paths are NUL-terminated.  A path is decoded
+ * from the start of its block, so the paths need not be decoded when the
+ * index is opened.
+ *
+ * In the PACK section, the hashes of a block are stored as their
+ * difference to the first hash of the block, in as many bits as the
+ * difference of the last one needs, and the position and link of each
+ * entry in as many bits as the number of entries needs.  Bits are packed
+ * into words from the least significant bit on, and fields may span two
+ * words.  As the hashes are sorted, the differences in a block are small;
+ * the first hashes serve as a skip table to find the block of a hash.
+ *
+ * Indices written before the format was versioned, which stored 16-bit
+ * line and file numbers in the hash entries and the paths in full, are
+ * still read, but copied from the file.  Indices of other versions are
+ * not read.
+ */
+
+#define IDX_MAGIC   "fpccidx\0"
+#define IDX_VERSION 5
+
+#define IDX_ALIGN 8
+
+// section IDs
+#define IDX_HASH "HASH"
+#define IDX_PACK "PACK"
+#define IDX_PREF "PREF"
+#define IDX_FILE "FILE"
+#define IDX_LINE "LINE"
+#define IDX_FUNC "FUNC"
+#define IDX_TAGS "TAGS"
+
+/**
+ * An entry of the section table.
+ */
+struct idx_section {
+  char id[4];
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t size;
+};
+
+/**
+ * A function definition as stored in the FUNC section.
+ */
+struct idx_funcrec {
+  uint32_t file;
+  uint32_t first_line, last_line;
+  uint32_t name;  // offset in the names
+};
+
+// the entries per block of a compressed index
+#define IDX_BLOCK 128
+
+// the paths per block of the PREF section
+#define IDX_PATH_BLOCK 16
+
+/**
+ * The hash entries of a compressed index.
+ */
+struct idx_packed {
+  uint32_t block;               // entries per block
+  uint32_t width;               // of the positions and links
+  uint32_t nblocks;
+  const uint64_t *first;        // first hash of each block
+  const uint64_t *start;        // bit position and width of each block
+  const uint64_t *bits;         // the hashes
+  const uint64_t *links;        // the positions and links
+};
+
+// what may be copied from the file
+enum {
+  COPY_HASHES, COPY_BLOCKS, COPY_STARTS_OF_BLOCKS, COPY_PATHS,
+  COPY_PATH_IDS, COPY_FIRST, COPY_LINES, COPY_STARTS, COPY_FUNCS, COPY_TAGS,
+  COPY_COUNT
+};
+
+/**
+ * An index read from a file.  On little-endian hosts, the hashes, path
+ * offsets, files, lines, functions and tags point into the mapping of the
+ * file.  The hash entries are accessed with idx_hash(), idx_seq() and
+ * idx_next(), as they may be compressed, and the paths with idx_path().
+ */
+struct idx_file {
+  void *map;
+  size_t len;
+  uint32_t count;               // number of hashes, with the dummy entry
+  const hash_entry_t *hashes;   // or NULL if compressed
+  struct idx_packed packed;
+  uint32_t path_cnt;
+  uint32_t path_max;            // length of the longest path
+  const uint64_t *path_off;     // offset of each path in paths, or of
+                                // each block if prefix-coded
+  const char *paths;
+  const uint32_t *path_ids;     // distinct path of each file if
+                                // prefix-coded, or NULL
+  uint32_t path_block;          // paths per block if prefix-coded
+  const uint32_t *first;        // input position of the first hash of
+                                // each file
+  const uint32_t *lines;        // line of each hash in input order
+  uint64_t *starts;             // whether a file starts at each position
+  uint32_t nfuncs;              // functions, if the index has them
+  const struct idx_funcrec *funcs;
+  const char *names;
+  const uint32_t *tags;         // function of each hash, or NULL
+  void *copy[COPY_COUNT];       // what is not used in place, freed on close
+};
+
+/**
+ * Map the index in file fname.  Return 0 on success, -1 if the file
+ * cannot be opened or mapped, with errno set, and -2 if it is not an
+ * index.
+ */
+int idx_open(struct idx_file *ix, const char *fname);
+
+/**
+ * Map the index in the file open on fd, like idx_open().  The file may be
+ * closed afterwards.
+ */
+int idx_fdopen(struct idx_file *ix, int fd);
+
+void idx_close(struct idx_file *ix);
+
+/**
+ * The path of file i of the index.  A prefix-coded path is decoded into
+ * buf, which must hold path_max + 1 characters; otherwise the path in the
+ * index is returned.
+ */
+const char *idx_path(const struct idx_file *ix, uint32_t i, char *buf);
+
+/**
+ * A buffer for the paths of the index, to be freed by the caller.
+ */
+char *idx_path_buf(const struct idx_file *ix);
+
+/**
+ * The file of the hash at input position seq, or UINT32_MAX for the
+ * dummy entry.
+ */
+uint32_t idx_file(const struct idx_file *ix, uint32_t seq);
+
+/**
+ * Whether the hash at input position seq is the first of its file, i.e.
+ * its input predecessor belongs to another file.
+ */
+static inline int idx_starts_file(const struct idx_file *ix, uint32_t seq)
+{
+  return ix->starts[seq / 64] >> seq % 64 & 1;
+}
+
+static inline uint32_t idx_line(const struct idx_file *ix, uint32_t seq)
+{
+  return ix->lines[seq];
+}
+
+/**
+ * The position of the first hash at or after position i that is not less
+ * than h, or the number of hashes if there is none.  Whole blocks of
+ * hashes less than h are skipped by galloping from the block of i on, in
+ * time logarithmic in their number.
+ */
+uint32_t idx_seek(const struct idx_file *ix, uint32_t i, hash_t h);
+
+
+// conversion between host and file byte order
+
+static inline int idx_host_le(void)
+{
+  const uint16_t one = 1;
+  return *(const unsigned char *) &one == 1;
+}
+
+static inline uint32_t idx_le32(uint32_t v)
+{
+  if (idx_host_le()) return v;
+  return v >> 24 | (v >> 8 & 0xff00) | (v << 8 & 0xff0000) | v << 24;
+}
+
+static inline uint64_t idx_le64(uint64_t v)
+{
+  if (idx_host_le()) return v;
+  return (uint64_t) idx_le32(v) << 32 | idx_le32(v >> 32);
+}
+
+/**
+ * The field of the given width at bit position pos of the words w.
+ */
+static inline uint64_t idx_unpack(const uint64_t *w, uint64_t pos,
+    unsigned width)
+{
+  unsigned shift = pos % 64;
+  uint64_t v = idx_le64(w[pos / 64]) >> shift;
+  if (shift + width > 64) v |= idx_le64(w[pos / 64 + 1]) << (64 - shift);
+  return width < 64 ? v & (((uint64_t) 1 << width) - 1) : v;
+}
+
+static inline hash_t idx_hash(const struct idx_file *ix, uint32_t i)
+{
+  if (ix->hashes != NULL) return ix->hashes[i].hash;
+  const struct idx_packed *p = &ix->packed;
+  uint32_t b = i / p->block;
+  uint64_t start = p->start[b];
+  unsigned width = start & 0xff;
+  if (width == 0) return p->first[b];
+  return p->first[b] +
+    idx_unpack(p->bits, (start >> 8) + (uint64_t) (i % p->block) * width,
+        width);
+}
+
+/**
+ * The position in input order of the hash at position i.
+ */
+static inline uint32_t idx_seq(const struct idx_file *ix, uint32_t i)
+{
+  if (ix->hashes != NULL) return ix->hashes[i].seq;
+  return idx_unpack(ix->packed.links, 2 * (uint64_t) i * ix->packed.width,
+      ix->packed.width);
+}
+
+/**
+ * The position of the input successor of the hash at position i, or 0
+ * for the last one.
+ */
+static inline uint32_t idx_next(const struct idx_file *ix, uint32_t i)
+{
+  if (ix->hashes != NULL) return ix->hashes[i].next;
+  return idx_unpack(ix->packed.links,
+      (2 * (uint64_t) i + 1) * ix->packed.width, ix->packed.width);
+}
+
+/**
+ * Whether hash entries are laid out in memory like in the file.
+ */
+static inline int idx_hashes_native(void)
+{
+  return idx_host_le() && sizeof(hash_entry_t) == 16 &&
+    offsetof(hash_entry_t, seq) == 8 &&
+    offsetof(hash_entry_t, next) == 12;
+}
+
+#endif // _IDXFILE_H_
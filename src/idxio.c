@@ -0,0 +1,1152 @@
+/**
+ * Construction of fingerprint indices.
+ *
+ * The hashes are collected in input order, then sorted while keeping
+ * their input position and building successor links, such that the
+ * original sequence of hashes can be restored.  The input position gives
+ * the file of a hash, by the first position of each file, and its line,
+ * which are kept in input order.
+ *
+ * The sort is stable, so equal hashes stay in input order.
+ *
+ * With a bound on the memory, the hashes are sorted externally.  Merging
+ * the sorted runs yields the sorted position of each input position, in
+ * sorted order.  Sorting these pairs by input position gives the sorted
+ * positions in input order, i.e. each hash's successor, and sorting the
+ * pairs of a hash and its successor by the hash's sorted position gives
+ * the links in sorted order.  The functions of the hashes are sorted the
+ * same way.
+ *
+ * Compressed, the hashes are sorted before the header is written, as the
+ * size of the PACK section depends on them; sorted externally, they are
+ * kept in a temporary file meanwhile.  They are read three times: for the
+ * width of each block, for the hashes and for the positions and links.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "extsort.h"
+#include "idxfile.h"
+#include "idxio.h"
+
+
+static void temp_write(uint32_t v, FILE *f)
+{
+  if (fwrite(&v, sizeof v, 1, f) != 1) {
+    error_exit("cannot write temporary file");
+  }
+}
+
+
+/**
+ * Add a hash sorted externally, with its line and function written to
+ * temporary files.
+ */
+static void hash_add_external(struct idx_builder *ib, hash_t h,
+    uint32_t line, uint32_t tag)
+{
+  if (ib->xs == NULL) {
+    ib->xs = malloc(sizeof *ib->xs);
+    if (ib->xs == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    xs_init(ib->xs, ib->memory, ib->threads);
+    // the line of the dummy entry
+    ib->linefile = temp_file();
+    temp_write(ib->lines[0], ib->linefile);
+  }
+  hash_entry_t e = { h, ib->hashes.count++, 0 };
+  xs_add(ib->xs, &e);
+  temp_write(line, ib->linefile);
+  if (ib->tagfile != NULL) temp_write(tag, ib->tagfile);
+}
+
+
+static void hash_add(struct idx_builder *ib,
+    hash_t h, uint32_t line, uint32_t tag)
+{
+  // all but the dummy entry
+  if (ib->memory > 0 && ib->hashes.count > 0) {
+    hash_add_external(ib, h, line, tag);
+    return;
+  }
+  if (ib->hashes.count == ib->hashes.capacity) {
+    ib->hashes.capacity += 1024;
+    hash_entry_t *new_buf = realloc(ib->hashes.buf,
+        ib->hashes.capacity * sizeof(hash_entry_t));
+    uint32_t *new_lines = realloc(ib->lines,
+        ib->hashes.capacity * sizeof(uint32_t));
+    if (new_buf == NULL || new_lines == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    ib->hashes.buf = new_buf;
+    ib->lines = new_lines;
+    if (ib->tags != NULL) {
+      uint32_t *new_tags = realloc(ib->tags,
+          ib->hashes.capacity * sizeof(uint32_t));
+      if (new_tags == NULL) {
+        error_exit("cannot allocate memory");
+      }
+      ib->tags = new_tags;
+    }
+  }
+  if (ib->tags != NULL) ib->tags[ib->hashes.count] = tag;
+  ib->lines[ib->hashes.count] = line;
+  hash_entry_t *hashp = &ib->hashes.buf[ib->hashes.count];
+  hashp->hash = h;
+  hashp->seq = ib->hashes.count++;
+  hashp->next = 0;
+}
+
+
+void idx_init(struct idx_builder *ib)
+{
+  memset(ib, 0, sizeof *ib);
+  ib->threads = 1;
+  // add dummy entry
+  hash_add(ib, 0, 0, IDX_NOFUNC);
+}
+
+
+void idx_add_path(struct idx_builder *ib, const char *s)
+{
+  if (ib->paths.count == ib->paths.capacity) {
+    ib->paths.capacity += 256;
+    char **new_buf = realloc(ib->paths.buf,
+        ib->paths.capacity * sizeof(char *));
+    uint32_t *new_first = realloc(ib->paths.first,
+        ib->paths.capacity * sizeof(uint32_t));
+    if (new_buf == NULL || new_first == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    ib->paths.buf = new_buf;
+    ib->paths.first = new_first;
+  }
+  ib->paths.first[ib->paths.count] = ib->hashes.count;
+  ib->paths.buf[ib->paths.count++] = strdup(s);
+  ib->funcbase = ib->funcs.count;
+}
+
+
+void idx_add_func(struct idx_builder *ib, const char *name,
+    int first_line, int last_line)
+{
+  if (ib->memory > 0 && ib->tagfile == NULL) {
+    // the hashes so far are not in a function
+    ib->tagfile = temp_file();
+    for (uint32_t i = 0; i < ib->hashes.count; i++) {
+      temp_write(IDX_NOFUNC, ib->tagfile);
+    }
+  } else if (ib->memory == 0 && ib->tags == NULL) {
+    // the hashes so far are not in a function
+    ib->tags = malloc(ib->hashes.capacity * sizeof(uint32_t));
+    if (ib->tags == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    for (uint32_t i = 0; i < ib->hashes.count; i++) {
+      ib->tags[i] = IDX_NOFUNC;
+    }
+  }
+  if (ib->funcs.count == ib->funcs.capacity) {
+    ib->funcs.capacity += 256;
+    struct idx_func *new_buf = realloc(ib->funcs.buf,
+        ib->funcs.capacity * sizeof(struct idx_func));
+    if (new_buf == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    ib->funcs.buf = new_buf;
+  }
+  struct idx_func *f = &ib->funcs.buf[ib->funcs.count++];
+  f->file = ib->paths.count - 1;
+  f->first_line = first_line;
+  f->last_line = last_line;
+  f->name = strdup(name);
+}
+
+
+void idx_add_hash(struct idx_builder *ib, hash_t h, uint32_t line,
+    int func)
+{
+  uint32_t tag = IDX_NOFUNC;
+  if (func >= 0 && ib->funcbase + func < ib->funcs.count) {
+    tag = ib->funcbase + func;
+  }
+  // the hash belongs to the most recently added file
+  hash_add(ib, h, line, tag);
+}
+
+
+static void u32_write(uint32_t v, FILE *outfile)
+{
+  v = idx_le32(v);
+  (void) fwrite(&v, sizeof v, 1, outfile);
+}
+
+
+static void u64_write(uint64_t v, FILE *outfile)
+{
+  v = idx_le64(v);
+  (void) fwrite(&v, sizeof v, 1, outfile);
+}
+
+
+static void u32s_write(const uint32_t *v, size_t n, FILE *outfile)
+{
+  if (idx_host_le()) {
+    (void) fwrite(v, sizeof *v, n, outfile);
+    return;
+  }
+  for (size_t i = 0; i < n; i++) {
+    u32_write(v[i], outfile);
+  }
+}
+
+
+/**
+ * Pad a section of the given size to the alignment of the next one.
+ */
+static void pad_write(uint64_t size, FILE *outfile)
+{
+  static const char zeros[IDX_ALIGN];
+  (void) fwrite(zeros, 1, (IDX_ALIGN - size % IDX_ALIGN) % IDX_ALIGN, outfile);
+}
+
+
+static void hash_idx_write(const hash_entry_t *entries, uint32_t n,
+    FILE *outfile)
+{
+#ifdef DEBUG
+  for (uint32_t i = 0; i < n; i++) {
+    DBG("%016lx s%u n%u\n", entries[i].hash, entries[i].seq,
+        entries[i].next);
+  }
+#endif
+  if (idx_hashes_native()) {
+    (void) fwrite(entries, sizeof(hash_entry_t), n, outfile);
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    u64_write(entries[i].hash, outfile);
+    u32_write(entries[i].seq, outfile);
+    u32_write(entries[i].next, outfile);
+  }
+}
+
+/**
+ * Sort the hashes in memory, and build their links.
+ */
+static void table_sort(struct idx_builder *ib)
+{
+  hash_entry_t *hashes = ib->hashes.buf;
+  uint32_t count = ib->hashes.count;
+
+  // sort the inputs, but spare the first; their input position is kept
+  // for the successor links
+  hashes_sort(&hashes[1], count - 1, ib->threads);
+
+  // the sorted position of each input position
+  uint32_t *pos = malloc(count * sizeof(uint32_t));
+  if (pos == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    pos[hashes[i].seq] = i;
+  }
+  // the function of each hash, in sorted order
+  if (ib->tags != NULL) {
+    uint32_t *tags = malloc(count * sizeof(uint32_t));
+    if (tags == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      tags[i] = ib->tags[hashes[i].seq];
+    }
+    free(ib->tags);
+    ib->tags = tags;
+  }
+  // link each hash to the sorted position of its input successor
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t succ = hashes[i].seq + 1;
+    hashes[i].next = succ < count ? pos[succ] : 0;
+  }
+  free(pos);
+
+#ifndef NDEBUG
+  // how to reconstruct order
+  uint32_t k = hashes[0].next;
+  for (uint32_t i = 1; k > 0; i++) {
+    assert(i < count);
+    assert(k < count);
+    k = hashes[k].next;
+  }
+  for (uint32_t i = 2; i < count; i++) {
+    assert(hashes[i - 1].hash <= hashes[i].hash);
+  }
+#endif
+}
+
+
+/**
+ * Build the links of the hashes from the sorted position of each input
+ * position in pos, by their sorted position, into links.  With tagfile,
+ * the functions of the hashes in input order are sorted into tags.
+ */
+static void links_sort(struct extsort *pos, struct extsort *links,
+    uint32_t count, FILE *tagfile, struct extsort *tags, size_t memory,
+    int threads)
+{
+  hash_entry_t e, l;
+
+  xs_finish(pos);
+  xs_init(links, memory / 4, threads);
+  if (tagfile != NULL) {
+    xs_init(tags, memory / 4, threads);
+    rewind(tagfile);
+  }
+  uint32_t prev = 0; // sorted position of the previous input
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t cur = 0;
+    if (i > 0) {
+      if (!xs_next(pos, &e)) {
+        error_exit("lost a hash while sorting");
+      }
+      cur = e.next;
+      l = (hash_entry_t) { prev, 0, cur };
+      xs_add(links, &l);
+    }
+    if (tagfile != NULL) {
+      uint32_t tag;
+      if (fread(&tag, sizeof tag, 1, tagfile) != 1) {
+        error_exit("cannot read temporary file");
+      }
+      l = (hash_entry_t) { cur, 0, tag };
+      xs_add(tags, &l);
+    }
+    prev = cur;
+  }
+  // the last input has no successor
+  l = (hash_entry_t) { prev, 0, 0 };
+  xs_add(links, &l);
+  xs_free(pos);
+  if (tagfile != NULL) xs_finish(tags);
+  xs_finish(links);
+}
+
+
+/**
+ * Write the table of the sorted hashes in the temporary file sorted, but
+ * the dummy entry, with their links, and free the links.
+ */
+static void links_write(hash_entry_t dummy, FILE *sorted,
+    struct extsort *links, uint32_t count, FILE *outfile)
+{
+  hash_entry_t e = dummy, l;
+  rewind(sorted);
+  for (uint32_t i = 0; i < count; i++) {
+    if (i > 0 && fread(&e, sizeof e, 1, sorted) != 1) {
+      error_exit("cannot read temporary file");
+    }
+    if (!xs_next(links, &l) || l.hash != i) {
+      error_exit("lost a hash while sorting");
+    }
+    e.next = l.next;
+    hash_idx_write(&e, 1, outfile);
+  }
+  xs_free(links);
+}
+
+
+/**
+ * Sort the hashes externally and write the table.  With functions, their
+ * tags are sorted into tags.
+ */
+static void table_write_external(struct idx_builder *ib, FILE *outfile,
+    struct extsort *tags)
+{
+  uint32_t count = ib->hashes.count;
+  struct extsort pos, links;
+  FILE *sorted = temp_file();
+  hash_entry_t e;
+
+  // the hashes in sorted order, and the sorted position of each input
+  // position; the dummy entry stays first
+  xs_finish(ib->xs);
+  xs_init(&pos, ib->memory / 2, ib->threads);
+  for (uint32_t i = 1; xs_next(ib->xs, &e); i++) {
+    if (fwrite(&e, sizeof e, 1, sorted) != 1) {
+      error_exit("cannot write temporary file");
+    }
+    hash_entry_t p = { e.seq, 0, i };
+    xs_add(&pos, &p);
+  }
+  xs_free(ib->xs);
+  free(ib->xs);
+  ib->xs = NULL;
+
+  // the successor and function of each hash, by its sorted position
+  links_sort(&pos, &links, count, ib->tagfile, tags, ib->memory,
+      ib->threads);
+  if (ib->tagfile != NULL) {
+    (void) fclose(ib->tagfile);
+    ib->tagfile = NULL;
+  }
+
+  // output the table, with the links
+  links_write(ib->hashes.buf[0], sorted, &links, count, outfile);
+  (void) fclose(sorted);
+}
+
+
+/**
+ * Read the next of the sorted entries, entry i of buf or, if sorted is
+ * not NULL, as written to the temporary file sorted.
+ */
+static void sorted_next(const hash_entry_t *buf, FILE *sorted, uint32_t i,
+    hash_entry_t *e)
+{
+  if (sorted == NULL) {
+    *e = buf[i];
+    return;
+  }
+  unsigned char rec[16];
+  if (fread(rec, sizeof rec, 1, sorted) != 1) {
+    error_exit("cannot read temporary file");
+  }
+  memcpy(&e->hash, rec, 8);
+  memcpy(&e->seq, rec + 8, 4);
+  memcpy(&e->next, rec + 12, 4);
+  e->hash = idx_le64(e->hash);
+  e->seq = idx_le32(e->seq);
+  e->next = idx_le32(e->next);
+}
+
+
+/**
+ * The number of bits needed for v.
+ */
+static unsigned bit_width(uint64_t v)
+{
+  unsigned w = 0;
+  while (w < 64 && v >> w != 0) w++;
+  return w;
+}
+
+
+/**
+ * Writes fields of bits into little-endian words, from the least
+ * significant bit on.
+ */
+struct bit_writer {
+  uint64_t word;
+  unsigned used;
+  FILE *outfile;
+};
+
+static void bits_put(struct bit_writer *bw, uint64_t v, unsigned width)
+{
+  if (width == 0) return;
+  bw->word |= v << bw->used;
+  if (bw->used + width < 64) {
+    bw->used += width;
+    return;
+  }
+  u64_write(bw->word, bw->outfile);
+  unsigned taken = 64 - bw->used;
+  bw->word = taken < 64 ? v >> taken : 0;
+  bw->used = bw->used + width - 64;
+}
+
+static void bits_flush(struct bit_writer *bw)
+{
+  if (bw->used > 0) u64_write(bw->word, bw->outfile);
+  bw->word = 0;
+  bw->used = 0;
+}
+
+
+/**
+ * The layout of the PACK section: the first hash of each block, and the
+ * bit position and width of its hashes.
+ */
+struct pack_layout {
+  uint32_t nblocks, width;
+  uint64_t *first, *start;
+  uint64_t nbits, nlinks;  // words
+};
+
+static uint64_t pack_size(const struct pack_layout *pl)
+{
+  return 32 + 16 * (uint64_t) pl->nblocks + 8 * (pl->nbits + pl->nlinks);
+}
+
+/**
+ * Lay out the sorted hashes in blocks of IDX_BLOCK, each hash stored as
+ * its difference to the first one of its block.
+ */
+static void pack_plan(struct pack_layout *pl, const hash_entry_t *buf,
+    FILE *sorted, uint32_t count)
+{
+  pl->nblocks = (count - 1) / IDX_BLOCK + 1;
+  pl->width = bit_width(count - 1);
+  if (pl->width == 0) pl->width = 1;
+  pl->first = malloc(pl->nblocks * sizeof(uint64_t));
+  pl->start = malloc(pl->nblocks * sizeof(uint64_t));
+  if (pl->first == NULL || pl->start == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  if (sorted != NULL) rewind(sorted);
+  uint64_t bits = 0;
+  hash_entry_t e = { 0 };
+  for (uint32_t b = 0, i = 0; b < pl->nblocks; b++) {
+    uint32_t n = b + 1 < pl->nblocks ? IDX_BLOCK : count - i;
+    for (uint32_t k = 0; k < n; k++, i++) {
+      sorted_next(buf, sorted, i, &e);
+      if (k == 0) pl->first[b] = e.hash;
+    }
+    unsigned width = bit_width(e.hash - pl->first[b]);
+    pl->start[b] = bits << 8 | width;
+    bits += (uint64_t) n * width;
+  }
+  pl->nbits = (bits + 63) / 64;
+  pl->nlinks = (2 * (uint64_t) count * pl->width + 63) / 64;
+}
+
+/**
+ * Write the PACK section as laid out, and free the layout.
+ */
+static void pack_write(struct pack_layout *pl, const hash_entry_t *buf,
+    FILE *sorted, uint32_t count, FILE *outfile)
+{
+  struct bit_writer bw = { 0, 0, outfile };
+  hash_entry_t e;
+
+  u32_write(count, outfile);
+  u32_write(IDX_BLOCK, outfile);
+  u32_write(pl->width, outfile);
+  u32_write(pl->nblocks, outfile);
+  u64_write(pl->nbits, outfile);
+  u64_write(pl->nlinks, outfile);
+  for (uint32_t b = 0; b < pl->nblocks; b++) {
+    u64_write(pl->first[b], outfile);
+  }
+  for (uint32_t b = 0; b < pl->nblocks; b++) {
+    u64_write(pl->start[b], outfile);
+  }
+
+  // the hashes, then the positions and links
+  if (sorted != NULL) rewind(sorted);
+  for (uint32_t i = 0; i < count; i++) {
+    sorted_next(buf, sorted, i, &e);
+    uint32_t b = i / IDX_BLOCK;
+    bits_put(&bw, e.hash - pl->first[b], pl->start[b] & 0xff);
+  }
+  bits_flush(&bw);
+  if (sorted != NULL) rewind(sorted);
+  for (uint32_t i = 0; i < count; i++) {
+    sorted_next(buf, sorted, i, &e);
+    bits_put(&bw, e.seq, pl->width);
+    bits_put(&bw, e.next, pl->width);
+  }
+  bits_flush(&bw);
+  free(pl->first);
+  free(pl->start);
+}
+
+
+/**
+ * The layout of the PREF section: the distinct paths in sorted order,
+ * coded in blocks of IDX_PATH_BLOCK, and the distinct path of each file.
+ */
+struct path_layout {
+  uint32_t count, npaths, nblocks, max;
+  char *const **sorted;   // the first file of each distinct path
+  uint32_t *ids;          // of each file
+  uint64_t *off;          // of each block
+  uint64_t len;           // of the coded paths
+};
+
+static int path_cmp(const void *a, const void *b)
+{
+  char *const *pa = *(char *const *const *) a;
+  char *const *pb = *(char *const *const *) b;
+  int res = strcmp(*pa, *pb);
+  // keep equal paths in file order, for the first one
+  return res != 0 ? res : (pa > pb) - (pa < pb);
+}
+
+static size_t common_prefix(const char *a, const char *b)
+{
+  size_t n = 0;
+  while (a[n] != '\0' && a[n] == b[n]) n++;
+  return n;
+}
+
+static unsigned varint_size(uint64_t v)
+{
+  unsigned n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static void varint_write(uint64_t v, FILE *outfile)
+{
+  while (v >= 0x80) {
+    (void) fputc((int) (v & 0x7f) | 0x80, outfile);
+    v >>= 7;
+  }
+  (void) fputc((int) v, outfile);
+}
+
+static uint64_t path_size(const struct path_layout *pt)
+{
+  return 16 + 8 * (uint64_t) pt->nblocks + 4 * (uint64_t) pt->count +
+    pt->len;
+}
+
+/**
+ * Sort the paths of the count files, and lay out the distinct ones.
+ */
+static void path_plan(struct path_layout *pt, char *const *paths,
+    uint32_t count)
+{
+  memset(pt, 0, sizeof *pt);
+  pt->count = count;
+  pt->sorted = malloc((count > 0 ? count : 1) * sizeof(char *const *));
+  pt->ids = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+  pt->off = malloc((count / IDX_PATH_BLOCK + 1) * sizeof(uint64_t));
+  if (pt->sorted == NULL || pt->ids == NULL || pt->off == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    pt->sorted[i] = &paths[i];
+  }
+  qsort(pt->sorted, count, sizeof(char *const *), path_cmp);
+
+  const char *prev = NULL;
+  for (uint32_t i = 0; i < count; i++) {
+    const char *pth = *pt->sorted[i];
+    if (prev == NULL || strcmp(prev, pth) != 0) {
+      size_t len = strlen(pth);
+      if (len >= UINT32_MAX) {
+        error_exit("path too long for index");
+      }
+      if (len > pt->max) pt->max = len;
+      if (pt->npaths % IDX_PATH_BLOCK == 0) {
+        pt->off[pt->nblocks++] = pt->len;
+        pt->len += len + 1;
+      } else {
+        size_t shared = common_prefix(prev, pth);
+        pt->len += varint_size(shared) + len - shared + 1;
+      }
+      pt->sorted[pt->npaths++] = pt->sorted[i];
+      prev = pth;
+    }
+    pt->ids[pt->sorted[i] - paths] = pt->npaths - 1;
+  }
+}
+
+/**
+ * Write the PREF section as laid out, and free the layout.
+ */
+static void path_write(struct path_layout *pt, FILE *outfile)
+{
+  u32_write(pt->count, outfile);
+  u32_write(pt->npaths, outfile);
+  u32_write(IDX_PATH_BLOCK, outfile);
+  u32_write(pt->max, outfile);
+  for (uint32_t b = 0; b < pt->nblocks; b++) {
+    u64_write(pt->off[b], outfile);
+  }
+  u32s_write(pt->ids, pt->count, outfile);
+  for (uint32_t i = 0; i < pt->npaths; i++) {
+    const char *pth = *pt->sorted[i];
+    DBG("Path: %s\n", pth);
+    size_t shared = 0;
+    if (i % IDX_PATH_BLOCK != 0) {
+      shared = common_prefix(*pt->sorted[i - 1], pth);
+      varint_write(shared, outfile);
+    }
+    (void) fputs(pth + shared, outfile);
+    (void) fputc('\0', outfile);
+  }
+  free(pt->sorted);
+  free(pt->ids);
+  free(pt->off);
+}
+
+
+/**
+ * Copy the 32-bit integers written to the temporary file f.
+ */
+static void temp_copy(FILE *f, FILE *outfile)
+{
+  uint32_t buf[4096];
+  size_t n;
+  rewind(f);
+  while ((n = fread(buf, sizeof(uint32_t), 4096, f)) > 0) {
+    u32s_write(buf, n, outfile);
+  }
+  if (ferror(f)) {
+    error_exit("cannot read temporary file");
+  }
+}
+
+
+/**
+ * Lay out the sections one after the other, and write the header.
+ */
+static void header_write(struct idx_section *sec, uint32_t nsections,
+    FILE *outfile)
+{
+  uint64_t offset = sizeof IDX_MAGIC - 1 + 2 * sizeof(uint32_t) +
+    nsections * sizeof(struct idx_section);
+  for (uint32_t i = 0; i < nsections; i++) {
+    sec[i].offset = offset;
+    offset += (sec[i].size + IDX_ALIGN - 1) / IDX_ALIGN * IDX_ALIGN;
+  }
+
+  (void) fwrite(IDX_MAGIC, sizeof IDX_MAGIC - 1, 1, outfile);
+  u32_write(IDX_VERSION, outfile);
+  u32_write(nsections, outfile);
+  for (uint32_t i = 0; i < nsections; i++) {
+    (void) fwrite(sec[i].id, sizeof sec[i].id, 1, outfile);
+    u32_write(0, outfile);
+    u64_write(sec[i].offset, outfile);
+    u64_write(sec[i].size, outfile);
+  }
+}
+
+
+void idx_write(struct idx_builder *ib, FILE *outfile)
+{
+  struct extsort tags;
+  uint32_t count = ib->hashes.count;
+  int functions = ib->tags != NULL || ib->tagfile != NULL;
+
+  // the sizes of the sections, then their offsets
+  struct path_layout pt;
+  path_plan(&pt, ib->paths.buf, ib->paths.count);
+  uint64_t namelen = 0;
+  for (uint32_t i = 0; i < ib->funcs.count; i++) {
+    namelen += strlen(ib->funcs.buf[i].name) + 1;
+  }
+  if (namelen > UINT32_MAX) {
+    error_exit("function names too long for index");
+  }
+
+  if (ib->xs == NULL && ib->tagfile != NULL) {
+    // no hashes but the dummy entry to sort externally
+    ib->tags = malloc(count * sizeof(uint32_t));
+    if (ib->tags == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    rewind(ib->tagfile);
+    if (fread(ib->tags, sizeof(uint32_t), count, ib->tagfile) != count) {
+      error_exit("cannot read temporary file");
+    }
+    (void) fclose(ib->tagfile);
+    ib->tagfile = NULL;
+  }
+  // compressed, the hashes are sorted first, for the size of their section
+  struct pack_layout pl = { 0 };
+  FILE *sorted = NULL;
+  if (ib->compress) {
+    if (ib->xs != NULL) {
+      sorted = temp_file();
+      table_write_external(ib, sorted, &tags);
+    } else {
+      table_sort(ib);
+    }
+    pack_plan(&pl, ib->hashes.buf, sorted, count);
+  }
+
+  struct idx_section sec[] = {
+    { IDX_HASH, 0, 0, (uint64_t) count * 16 },
+    { IDX_PREF, 0, 0, path_size(&pt) },
+    { IDX_FILE, 0, 0, (uint64_t) ib->paths.count * 4 },
+    { IDX_LINE, 0, 0, (uint64_t) count * 4 },
+    { IDX_FUNC, 0, 0, 8 + (uint64_t) ib->funcs.count * 16 + namelen },
+    { IDX_TAGS, 0, 0, (uint64_t) count * 4 },
+  };
+  if (ib->compress) {
+    memcpy(sec[0].id, IDX_PACK, sizeof sec[0].id);
+    sec[0].size = pack_size(&pl);
+  }
+  header_write(sec, functions ? 6 : 4, outfile);
+
+  if (ib->compress) {
+    pack_write(&pl, ib->hashes.buf, sorted, count, outfile);
+    if (sorted != NULL) (void) fclose(sorted);
+  } else if (ib->xs != NULL) {
+    table_write_external(ib, outfile, &tags);
+  } else {
+    table_sort(ib);
+    hash_idx_write(ib->hashes.buf, count, outfile);
+  }
+  pad_write(sec[0].size, outfile);
+
+  // output paths
+  path_write(&pt, outfile);
+  for (uint32_t i = 0; i < ib->paths.count; i++) {
+    free(ib->paths.buf[i]);
+  }
+  free(ib->paths.buf);
+  pad_write(sec[1].size, outfile);
+
+  // output the first hash of each file, and the line of each hash
+  u32s_write(ib->paths.first, ib->paths.count, outfile);
+  free(ib->paths.first);
+  pad_write(sec[2].size, outfile);
+  if (ib->linefile != NULL) {
+    temp_copy(ib->linefile, outfile);
+    (void) fclose(ib->linefile);
+  } else {
+    u32s_write(ib->lines, count, outfile);
+  }
+  pad_write(sec[3].size, outfile);
+
+  // output functions, and the function of each hash
+  if (functions) {
+    u32_write(ib->funcs.count, outfile);
+    u32_write(0, outfile);
+    namelen = 0;
+    for (uint32_t i = 0; i < ib->funcs.count; i++) {
+      struct idx_func *f = &ib->funcs.buf[i];
+      u32_write(f->file, outfile);
+      u32_write(f->first_line, outfile);
+      u32_write(f->last_line, outfile);
+      u32_write(namelen, outfile);
+      namelen += strlen(f->name) + 1;
+    }
+    for (uint32_t i = 0; i < ib->funcs.count; i++) {
+      (void) fputs(ib->funcs.buf[i].name, outfile);
+      (void) fputc('\0', outfile);
+      free(ib->funcs.buf[i].name);
+    }
+    pad_write(sec[4].size, outfile);
+    if (ib->tags != NULL) {
+      u32s_write(ib->tags, count, outfile);
+    } else {
+      hash_entry_t t;
+      while (xs_next(&tags, &t)) {
+        u32_write(t.next, outfile);
+      }
+      xs_free(&tags);
+    }
+  }
+  free(ib->funcs.buf);
+  free(ib->lines);
+  free(ib->tags);
+  free(ib->hashes.buf);
+  memset(ib, 0, sizeof *ib);
+}
+
+
+/**
+ * A merge of the sorted hashes of indices: the position of the next hash
+ * of each, and the indices with hashes left in a heap by their next hash.
+ * Equal hashes are taken from the indices in the order given.
+ */
+struct merge_state {
+  const struct idx_file *ix;
+  uint32_t *pos;
+  hash_t *head;   // the next hash of each index
+  int *heap;
+  int nheap;
+};
+
+static int merge_before(const struct merge_state *m, int a, int b)
+{
+  if (m->head[a] != m->head[b]) return m->head[a] < m->head[b];
+  return a < b;
+}
+
+static void merge_down(struct merge_state *m, int i)
+{
+  int k = m->heap[i];
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= m->nheap) break;
+    if (c + 1 < m->nheap && merge_before(m, m->heap[c + 1], m->heap[c])) c++;
+    if (!merge_before(m, m->heap[c], k)) break;
+    m->heap[i] = m->heap[c];
+    i = c;
+  }
+  m->heap[i] = k;
+}
+
+static void merge_init(struct merge_state *m, const struct idx_file *ix,
+    int n)
+{
+  m->ix = ix;
+  m->pos = malloc(n * sizeof(uint32_t));
+  m->head = malloc(n * sizeof(hash_t));
+  m->heap = malloc(n * sizeof(int));
+  if (m->pos == NULL || m->head == NULL || m->heap == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  // all but the dummy entries
+  m->nheap = 0;
+  for (int k = 0; k < n; k++) {
+    m->pos[k] = 1;
+    if (ix[k].count < 2) continue;
+    m->head[k] = idx_hash(&ix[k], 1);
+    m->heap[m->nheap++] = k;
+  }
+  for (int i = m->nheap / 2 - 1; i >= 0; i--) merge_down(m, i);
+}
+
+/**
+ * Take the next hash in sorted order, at position *i of index *k.  Return
+ * 1 on success, 0 at the end.
+ */
+static int merge_next(struct merge_state *m, int *k, uint32_t *i)
+{
+  if (m->nheap == 0) return 0;
+  *k = m->heap[0];
+  *i = m->pos[*k]++;
+  if (m->pos[*k] < m->ix[*k].count) {
+    m->head[*k] = idx_hash(&m->ix[*k], m->pos[*k]);
+  } else {
+    m->heap[0] = m->heap[--m->nheap];
+  }
+  if (m->nheap > 0) merge_down(m, 0);
+  return 1;
+}
+
+static void merge_free(struct merge_state *m)
+{
+  free(m->pos);
+  free(m->head);
+  free(m->heap);
+}
+
+
+/**
+ * Where what is kept of an index goes in a merge: for each file the number
+ * of hashes of dropped files before it, and its number in the merge, or
+ * UINT32_MAX if dropped, and the number of each function in the merge.
+ */
+struct merge_map {
+  uint32_t *shift;
+  uint32_t *file;
+  uint32_t *func;
+};
+
+/**
+ * The end of the input positions of file f of an index.
+ */
+static uint32_t file_end(const struct idx_file *ix, uint32_t f)
+{
+  return f + 1 < ix->path_cnt ? ix->first[f + 1] : ix->count;
+}
+
+
+void idx_merge(const struct idx_file *ix, const unsigned char *const *drop,
+    int n, size_t memory, int threads, int compress, FILE *outfile)
+{
+  // where each index starts in the input positions of the merge
+  struct merge_map *mm = malloc(n * sizeof(struct merge_map));
+  uint32_t *base = malloc(n * sizeof(uint32_t));
+  if (mm == NULL || base == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  // the sizes of the merged sections, and the paths of the files kept
+  uint64_t count = 1, npaths = 0, nfuncs = 0, namelen = 0;
+  int functions = 0;
+  uint64_t maxpaths = 0;
+  for (int k = 0; k < n; k++) {
+    maxpaths += ix[k].path_cnt;
+  }
+  char **paths = calloc(maxpaths > 0 ? maxpaths : 1, sizeof(char *));
+  if (paths == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (int k = 0; k < n; k++) {
+    char *buf = idx_path_buf(&ix[k]);
+    const unsigned char *dk = drop != NULL ? drop[k] : NULL;
+    mm[k].shift = malloc((ix[k].path_cnt + 1) * sizeof(uint32_t));
+    mm[k].file = malloc((ix[k].path_cnt + 1) * sizeof(uint32_t));
+    mm[k].func = malloc((ix[k].nfuncs + 1) * sizeof(uint32_t));
+    if (mm[k].shift == NULL || mm[k].file == NULL || mm[k].func == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    base[k] = count - 1;
+    uint32_t dropped = 0;
+    for (uint32_t f = 0; f < ix[k].path_cnt; f++) {
+      mm[k].shift[f] = dropped;
+      if (dk != NULL && dk[f]) {
+        mm[k].file[f] = UINT32_MAX;
+        dropped += file_end(&ix[k], f) - ix[k].first[f];
+        continue;
+      }
+      paths[npaths] = strdup(idx_path(&ix[k], f, buf));
+      if (paths[npaths] == NULL) {
+        error_exit("cannot allocate memory");
+      }
+      mm[k].file[f] = npaths++;
+    }
+    free(buf);
+    for (uint32_t g = 0; g < ix[k].nfuncs; g++) {
+      const struct idx_funcrec *fr = &ix[k].funcs[g];
+      if (mm[k].file[fr->file] == UINT32_MAX) {
+        mm[k].func[g] = UINT32_MAX;
+        continue;
+      }
+      mm[k].func[g] = nfuncs++;
+      namelen += strlen(ix[k].names + fr->name) + 1;
+    }
+    count += ix[k].count - 1 - dropped;
+    if (count > UINT32_MAX || npaths > UINT32_MAX || nfuncs > UINT32_MAX) {
+      error_exit("too many hashes for index");
+    }
+    if (ix[k].tags != NULL) functions = 1;
+  }
+  if (namelen > UINT32_MAX) {
+    error_exit("function names too long for index");
+  }
+  struct path_layout pt;
+  path_plan(&pt, paths, npaths);
+  // without a bound, everything is sorted in memory
+  if (memory == 0) memory = count * 8 * sizeof(hash_entry_t);
+
+  // the hashes in sorted order with their input positions in the merge,
+  // the sorted position of each input position, and their functions
+  struct merge_state m;
+  struct extsort pos, links;
+  FILE *sorted = temp_file(), *tagfile = functions ? temp_file() : NULL;
+  if (tagfile != NULL) temp_write(IDX_NOFUNC, tagfile);
+  xs_init(&pos, memory / 4, threads);
+  merge_init(&m, ix, n);
+  int k;
+  uint32_t i;
+  for (uint32_t p = 1; merge_next(&m, &k, &i); p++) {
+    uint32_t seq = idx_seq(&ix[k], i);
+    if (drop != NULL && drop[k] != NULL) {
+      // hashes before the first file belong to none
+      uint32_t f = idx_file(&ix[k], seq);
+      if (f != UINT32_MAX && mm[k].file[f] == UINT32_MAX) {
+        p--;
+        continue;
+      }
+      if (f != UINT32_MAX) seq -= mm[k].shift[f];
+    }
+    hash_entry_t e = { idx_hash(&ix[k], i), base[k] + seq, 0 };
+    if (fwrite(&e, sizeof e, 1, sorted) != 1) {
+      error_exit("cannot write temporary file");
+    }
+    hash_entry_t q = { e.seq, 0, p };
+    xs_add(&pos, &q);
+    if (tagfile != NULL) {
+      uint32_t tag = IDX_NOFUNC;
+      if (ix[k].tags != NULL && ix[k].tags[i] < ix[k].nfuncs) {
+        tag = mm[k].func[ix[k].tags[i]];
+      }
+      temp_write(tag, tagfile);
+    }
+  }
+  merge_free(&m);
+  links_sort(&pos, &links, count, NULL, NULL, memory, threads);
+
+  // compressed, the hashes are written with their links first, for the
+  // size of their section
+  const hash_entry_t dummy = { 0, 0, 0 };
+  struct pack_layout pl;
+  FILE *packed = NULL;
+  if (compress) {
+    packed = temp_file();
+    links_write(dummy, sorted, &links, count, packed);
+    pack_plan(&pl, NULL, packed, count);
+  }
+  struct idx_section sec[] = {
+    { IDX_HASH, 0, 0, count * 16 },
+    { IDX_PREF, 0, 0, path_size(&pt) },
+    { IDX_FILE, 0, 0, npaths * 4 },
+    { IDX_LINE, 0, 0, count * 4 },
+    { IDX_FUNC, 0, 0, 8 + nfuncs * 16 + namelen },
+    { IDX_TAGS, 0, 0, count * 4 },
+  };
+  if (compress) {
+    memcpy(sec[0].id, IDX_PACK, sizeof sec[0].id);
+    sec[0].size = pack_size(&pl);
+  }
+  header_write(sec, functions ? 6 : 4, outfile);
+
+  if (compress) {
+    pack_write(&pl, NULL, packed, count, outfile);
+    (void) fclose(packed);
+  } else {
+    links_write(dummy, sorted, &links, count, outfile);
+  }
+  (void) fclose(sorted);
+  pad_write(sec[0].size, outfile);
+
+  // the paths, the first hash of each file and the lines of the files
+  // kept, one index after the other
+  path_write(&pt, outfile);
+  for (uint64_t f = 0; f < npaths; f++) {
+    free(paths[f]);
+  }
+  free(paths);
+  pad_write(sec[1].size, outfile);
+  for (k = 0; k < n; k++) {
+    for (i = 0; i < ix[k].path_cnt; i++) {
+      if (mm[k].file[i] == UINT32_MAX) continue;
+      u32_write(base[k] + ix[k].first[i] - mm[k].shift[i], outfile);
+    }
+  }
+  pad_write(sec[2].size, outfile);
+  u32_write(0, outfile);
+  for (k = 0; k < n; k++) {
+    uint32_t end = ix[k].path_cnt > 0 ? ix[k].first[0] : ix[k].count;
+    u32s_write(ix[k].lines + 1, end - 1, outfile);
+    for (i = 0; i < ix[k].path_cnt; i++) {
+      if (mm[k].file[i] == UINT32_MAX) continue;
+      u32s_write(ix[k].lines + ix[k].first[i],
+          file_end(&ix[k], i) - ix[k].first[i], outfile);
+    }
+  }
+  pad_write(sec[3].size, outfile);
+
+  // the functions, and the function of each hash
+  if (functions) {
+    u32_write(nfuncs, outfile);
+    u32_write(0, outfile);
+    namelen = 0;
+    for (k = 0; k < n; k++) {
+      for (i = 0; i < ix[k].nfuncs; i++) {
+        const struct idx_funcrec *f = &ix[k].funcs[i];
+        if (mm[k].func[i] == UINT32_MAX) continue;
+        u32_write(mm[k].file[f->file], outfile);
+        u32_write(f->first_line, outfile);
+        u32_write(f->last_line, outfile);
+        u32_write(namelen, outfile);
+        namelen += strlen(ix[k].names + f->name) + 1;
+      }
+    }
+    for (k = 0; k < n; k++) {
+      for (i = 0; i < ix[k].nfuncs; i++) {
+        if (mm[k].func[i] == UINT32_MAX) continue;
+        (void) fputs(ix[k].names + ix[k].funcs[i].name, outfile);
+        (void) fputc('\0', outfile);
+      }
+    }
+    pad_write(sec[4].size, outfile);
+    temp_copy(tagfile, outfile);
+    (void) fclose(tagfile);
+  }
+  for (k = 0; k < n; k++) {
+    free(mm[k].shift);
+    free(mm[k].file);
+    free(mm[k].func);
+  }
+  free(mm);
+  free(base);
+}
@@ -0,0 +1,110 @@
+#ifndef _IDXIO_H_
+#define _IDXIO_H_
+
+#include <stdio.h>
+
+#include "common.h"
+#include "extsort.h"
+
+/*
+ * Construction of fingerprint indices, shared by fpcc-idx and fpcc-build.
+ */
+
+/**
+ * A function definition in a file of the index.
+ */
+struct idx_func {
+  uint32_t file;
+  uint32_t first_line, last_line;
+  char *name;
+};
+
+/**
+ * An index under construction: the hashes in input order with their
+ * lines, and the paths of the files they belong to, with the position of
+ * their first hash.  If functions are added, the hashes are tagged with
+ * their function.
+ */
+struct idx_builder {
+  struct {
+    uint32_t count;
+    size_t capacity;
+    hash_entry_t *buf;
+  } hashes;
+  struct {
+    uint32_t count;
+    size_t capacity;
+    char **buf;
+    uint32_t *first; // first hash of each file
+  } paths;
+  struct {
+    uint32_t count;
+    size_t capacity;
+    struct idx_func *buf;
+  } funcs;
+  uint32_t funcbase; // first function of the current file
+  uint32_t *lines;   // line of each hash
+  uint32_t *tags;    // function of each hash, NULL until one is added
+  int threads;       // threads sorting the hashes, 1 unless set
+  size_t memory;     // bound of the memory for sorting the hashes, or 0
+  int compress;      // write the hashes in the PACK section, 0 unless set
+  struct extsort *xs; // with memory, the hashes but the dummy entry
+  FILE *linefile;    // with memory, the line of each hash
+  FILE *tagfile;     // with memory, the function of each hash, NULL until
+                     // one is added
+};
+
+// the function of hashes not in a function
+#define IDX_NOFUNC UINT32_MAX
+
+/**
+ * Initialize an empty index, containing only the dummy entry.  To bound
+ * the memory, set memory before adding hashes: they are then sorted in
+ * temporary files.
+ */
+void idx_init(struct idx_builder *ib);
+
+/**
+ * Add a path; subsequent hashes belong to this file.
+ */
+void idx_add_path(struct idx_builder *ib, const char *s);
+
+/**
+ * Add a function definition to the current file.  Functions are numbered
+ * per file, in the order they are added.
+ */
+void idx_add_func(struct idx_builder *ib, const char *name,
+    int first_line, int last_line);
+
+/**
+ * Add a hash with its line number to the current file, with the number
+ * of its function in the file, or -1 if not in a function.
+ */
+void idx_add_hash(struct idx_builder *ib, hash_t h, uint32_t line,
+    int func);
+
+/**
+ * Sort the hashes, build the input order successor links, and write
+ * the index to outfile.  The builder is freed afterwards.
+ *
+ * The index is written in the format described in idxfile.h.  If
+ * functions were added, it has the FUNC and TAGS sections.  If compress
+ * is set, the hashes are written in the PACK section instead of HASH.
+ */
+void idx_write(struct idx_builder *ib, FILE *outfile);
+
+struct idx_file;
+
+/**
+ * Merge the n indices ix into one, as if it was built from their inputs
+ * one after the other, and write it to outfile like idx_write().  The
+ * sorted hashes are merged, and their links are rebuilt by sorting,
+ * externally with a bound on the memory, if memory is not 0.
+ *
+ * Files are left out with drop: if not NULL, for each index NULL or
+ * whether each of its files is dropped.
+ */
+void idx_merge(const struct idx_file *ix, const unsigned char *const *drop,
+    int n, size_t memory, int threads, int compress, FILE *outfile);
+
+#endif // _IDXIO_H_
@@ -0,0 +1,234 @@
+/**
+ * Intersection of sorted hash entries with vector instructions.
+ *
+ * The hashes of 4 entries (AVX2) or 2 entries (SSE4.1) of each array are
+ * gathered into a vector; each hash of a is compared with all hashes of
+ * b by rotating the vector of b.  A hash matches at most one other then,
+ * if neither array holds a run of it, which is checked beforehand across
+ * the entry following the block as well: a run may cross into the next
+ * block, which is compared with a block already matched.  Such blocks
+ * are merged one by one instead.
+ *
+ * The kernels are compiled for their instruction set, and chosen by the
+ * CPU at run time.
+ *
+ * An array much smaller than the other is merged by searching each of its
+ * hashes in the other instead, which takes time logarithmic in the
+ * distance skipped rather than linear.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include "isect.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ISECT_X86 1
+#include <immintrin.h>
+#else
+#define ISECT_X86 0
+#endif
+
+
+/**
+ * The state of an intersection: the next entries of both arrays, and the
+ * counts so far.
+ */
+struct isect {
+  uint32_t i, j;
+  uint32_t nboth, nexcl;
+};
+
+/**
+ * Count the hash of entry k of a as common, and as excluded if marked so
+ * in xa.
+ */
+static inline void match(struct isect *st, const uint8_t *xa, uint32_t k)
+{
+  st->nboth++;
+  if (xa != NULL) st->nexcl += xa[k];
+}
+
+/**
+ * Merge one entry of a or b, or one of each if they match.
+ */
+static inline void step(struct isect *st, const hash_entry_t *a,
+    const hash_entry_t *b, const uint8_t *xa)
+{
+  hash_t ha = a[st->i].hash, hb = b[st->j].hash;
+  if (ha < hb) {
+    st->i++;
+  } else if (ha > hb) {
+    st->j++;
+  } else {
+    match(st, xa, st->i);
+    st->i++;
+    st->j++;
+  }
+}
+
+/**
+ * Merge the rest of a and b one by one.
+ */
+static uint32_t finish(struct isect *st, const hash_entry_t *a, uint32_t na,
+    const hash_entry_t *b, uint32_t nb, const uint8_t *xa, uint32_t *nexcl)
+{
+  while (st->i < na && st->j < nb) {
+    step(st, a, b, xa);
+  }
+  *nexcl = st->nexcl;
+  return st->nboth;
+}
+
+
+#if ISECT_X86
+
+/**
+ * The hashes of the 4 entries at p, in order.
+ */
+__attribute__((target("avx2")))
+static inline __m256i load4(const hash_entry_t *p)
+{
+  __m256i lo = _mm256_loadu_si256((const __m256i *) p);
+  __m256i hi = _mm256_loadu_si256((const __m256i *) (p + 2));
+  // hashes 0, 2 | 1, 3 to 0, 1 | 2, 3
+  return _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(lo, hi), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static uint32_t count_avx2(const hash_entry_t *a, uint32_t na,
+    const hash_entry_t *b, uint32_t nb, const uint8_t *xa, uint32_t *nexcl)
+{
+  struct isect st = { 0, 0, 0, 0 };
+  while (st.i + 4 < na && st.j + 4 < nb) {
+    const hash_entry_t *pa = a + st.i, *pb = b + st.j;
+    __m256i va = load4(pa), vb = load4(pb);
+    // a run in a block, or into the next entry
+    __m256i run = _mm256_or_si256(
+        _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(va, 0x39)),
+        _mm256_cmpeq_epi64(vb, _mm256_permute4x64_epi64(vb, 0x39)));
+    if (!_mm256_testz_si256(run, run) || pa[3].hash == pa[4].hash ||
+        pb[3].hash == pb[4].hash) {
+      for (int k = 0; k < 4 && st.i < na && st.j < nb; k++) {
+        step(&st, a, b, xa);
+      }
+      continue;
+    }
+    __m256i eq = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi64(va, vb),
+          _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39))),
+        _mm256_or_si256(
+          _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)),
+          _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93))));
+    unsigned mask = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+    for (int k = 0; mask != 0; k++, mask >>= 1) {
+      if (mask & 1) match(&st, xa, st.i + k);
+    }
+    hash_t amax = pa[3].hash, bmax = pb[3].hash;
+    if (amax <= bmax) st.i += 4;
+    if (bmax <= amax) st.j += 4;
+  }
+  return finish(&st, a, na, b, nb, xa, nexcl);
+}
+
+
+/**
+ * The hashes of the 2 entries at p, in order.
+ */
+__attribute__((target("sse4.1")))
+static inline __m128i load2(const hash_entry_t *p)
+{
+  return _mm_unpacklo_epi64(_mm_loadu_si128((const __m128i *) p),
+      _mm_loadu_si128((const __m128i *) (p + 1)));
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t count_sse41(const hash_entry_t *a, uint32_t na,
+    const hash_entry_t *b, uint32_t nb, const uint8_t *xa, uint32_t *nexcl)
+{
+  struct isect st = { 0, 0, 0, 0 };
+  while (st.i + 2 < na && st.j + 2 < nb) {
+    const hash_entry_t *pa = a + st.i, *pb = b + st.j;
+    // a run in a block, or into the next entry
+    if (pa[0].hash == pa[1].hash || pa[1].hash == pa[2].hash ||
+        pb[0].hash == pb[1].hash || pb[1].hash == pb[2].hash) {
+      for (int k = 0; k < 2 && st.i < na && st.j < nb; k++) {
+        step(&st, a, b, xa);
+      }
+      continue;
+    }
+    __m128i va = load2(pa), vb = load2(pb);
+    __m128i eq = _mm_or_si128(_mm_cmpeq_epi64(va, vb),
+        _mm_cmpeq_epi64(va, _mm_shuffle_epi32(vb, 0x4e)));
+    unsigned mask = _mm_movemask_pd(_mm_castsi128_pd(eq));
+    if (mask & 1) match(&st, xa, st.i);
+    if (mask & 2) match(&st, xa, st.i + 1);
+    hash_t amax = pa[1].hash, bmax = pb[1].hash;
+    if (amax <= bmax) st.i += 2;
+    if (bmax <= amax) st.j += 2;
+  }
+  return finish(&st, a, na, b, nb, xa, nexcl);
+}
+
+#endif // ISECT_X86
+
+
+/**
+ * Merge the few entries of a into the many of b, skipping the entries of
+ * b less than the next one of a by exponential search: steps of 1, 2, 4
+ * and so on bound the first entry not less than it, which is then found
+ * by binary search.
+ */
+static uint32_t count_gallop(const hash_entry_t *a, uint32_t na,
+    const hash_entry_t *b, uint32_t nb, const uint8_t *xa, uint32_t *nexcl)
+{
+  struct isect st = { 0, 0, 0, 0 };
+  while (st.i < na && st.j < nb) {
+    hash_t h = a[st.i].hash;
+    if (b[st.j].hash < h) {
+      // b[lo] < h, and b[hi] >= h unless hi is nb
+      uint32_t lo = st.j, hi;
+      for (uint32_t step = 1; ; step *= 2) {
+        hi = nb - lo > step ? lo + step : nb;
+        if (hi == nb || b[hi].hash >= h) break;
+        lo = hi;
+      }
+      while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (b[mid].hash < h) lo = mid; else hi = mid;
+      }
+      st.j = hi;
+      if (st.j == nb) break;
+    }
+    if (b[st.j].hash == h) {
+      match(&st, xa, st.i);
+      st.j++;
+    }
+    st.i++;
+  }
+  *nexcl = st.nexcl;
+  return st.nboth;
+}
+
+
+uint32_t isect_count(const hash_entry_t *a, uint32_t na, const uint8_t *xa,
+    const hash_entry_t *b, uint32_t nb, const uint8_t *xb, uint32_t *nexcl)
+{
+  if (na > nb) {
+    const hash_entry_t *t = a;
+    a = b;
+    b = t;
+    uint32_t n = na;
+    na = nb;
+    nb = n;
+    xa = xb;
+  }
+  if ((uint64_t) na * ISECT_GALLOP_RATIO <= nb)
+    return count_gallop(a, na, b, nb, xa, nexcl);
+#if ISECT_X86
+  if (__builtin_cpu_supports("avx2"))
+    return count_avx2(a, na, b, nb, xa, nexcl);
+  if (__builtin_cpu_supports("sse4.1"))
+    return count_sse41(a, na, b, nb, xa, nexcl);
+#endif
+  struct isect st = { 0, 0, 0, 0 };
+  return finish(&st, a, na, b, nb, xa, nexcl);
+}
@@ -0,0 +1,35 @@
+#ifndef _ISECT_H_
+#define _ISECT_H_
+
+#include <stdint.h>
+
+#include "common.h"
+
+/*
+ * Counting the common hashes of two sorted arrays of hash entries, for
+ * count() of fpcc-comp, with vector instructions where the CPU has them.
+ *
+ * Blocks of hashes of both arrays are compared all against all at once,
+ * and the block with the lower last hash is passed.  This matches each
+ * hash once only if it occurs once, so runs of equal hashes are matched
+ * one by one, like the scalar merge does: two arrays holding a hash c0
+ * and c1 times have min(c0, c1) of it in common.
+ */
+
+// Arrays this many times as large as the other are intersected by
+// searching the hashes of the smaller one.
+#define ISECT_GALLOP_RATIO 16
+
+/**
+ * Count the common hashes of the na entries a and the nb entries b, both
+ * sorted, and of these in *nexcl those excluded by the base: xa and xb,
+ * which may be NULL, are 1 for each entry of a and b excluded, and 0
+ * otherwise.  The entries of a run of a hash must be marked from the first
+ * one on, so the k-th match of a hash is marked in both arrays alike.
+ * Entries of one are searched in the other if it has ISECT_GALLOP_RATIO
+ * times as many.
+ */
+uint32_t isect_count(const hash_entry_t *a, uint32_t na, const uint8_t *xa,
+    const hash_entry_t *b, uint32_t nb, const uint8_t *xb, uint32_t *nexcl);
+
+#endif // _ISECT_H_
@@ -36,25 +36,18 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "idxfile.h"
+#include "storeio.h"
 
 const char *program_name = "fpcc-map";
 
-/**
- * The fingerprint index as stored in a file by fpcc-idx.
- */
-struct index {
-  uint32_t hash_cnt, path_cnt;
-  hash_entry_t *hashes;
-  char **paths;
-};
-
 // Matching regions (consecutive hashes) below this value are not emitted.
 // The units are number of hashes.
 static int min_region_size = DEFAULT_MIN_REGION_SIZE;
 
 // the two implemented alternative algorithms
-void string_to_string(struct index *, struct index *);
-void iterated_lcs(struct index *, struct index *);
+void string_to_string(struct store_view *, struct store_view *);
+void iterated_lcs(struct store_view *, struct store_view *);
 
 
 void usage(void)
@@ -71,63 +64,15 @@ void usage(void)
 
 
 /**
- * Load the fingerprint index from a file to the provided idx.
+ * Load the fingerprint index or store from a file to the provided sv.
  */
-void load_file(const char *fname, struct index *idx)
+void load_file(const char *fname, struct store_view *sv)
 {
-  FILE *f = fopen(fname, "r");
-  if (f == NULL) {
-    goto fail;
-  }
-  if (fread(&idx->hash_cnt, sizeof idx->hash_cnt, 1, f) != 1) {
-    goto fail;
-  }
-  idx->hashes = malloc((idx->hash_cnt) * sizeof(hash_entry_t));
-  if (idx->hashes == NULL) {
-    error_exit("can't allocate buffer");
+  if (store_open(sv, fname) != 0) {
+    char msg[PATH_MAX];
+    (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
+    error_exit(msg);
   }
-  if (fread(idx->hashes, sizeof(hash_entry_t),
-        idx->hash_cnt, f) != idx->hash_cnt) {
-    goto fail;
-  }
-  // now the paths
-  if (fread(&idx->path_cnt, sizeof idx->path_cnt, 1, f) != 1) {
-    goto fail;
-  }
-  // one more field that stays NULL
-  idx->paths = calloc(idx->path_cnt + 1, sizeof(char *));
-  if (idx->paths == NULL) {
-    error_exit("can't allocate buffer");
-  }
-  // A NULL at the end enables following iteration scheme
-  /*
-  for (char **pptr = idx1.paths; *pptr != NULL; pptr++) {
-    DBG("Path: %s\n", *pptr);
-  }
-  */
-
-  size_t len = 0;
-  for (int i = 0; i < idx->path_cnt; i++) {
-    if (getdelim(&idx->paths[i], &len, '\0', f) == -1) {
-      goto fail;
-    }
-  }
-
-  (void) fclose(f);
-  return;
-
-fail: ;
-  char msg[PATH_MAX];
-  (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
-  error_exit(msg);
-}
-
-
-void cleanup_idx(struct index *idx)
-{
-  free(idx->hashes);
-  for (char **pptr = idx->paths; *pptr != NULL; free(*pptr++)) ;
-  free(idx->paths);
 }
 
 /**
@@ -137,11 +82,11 @@ void cleanup_idx(struct index *idx)
  * start and count are line numbers.
  */
 void record(int match_size,
-    char *fname1, int beg1, int end1,
-    char *fname2, int beg2, int end2)
+    const char *fname1, long beg1, long end1,
+    const char *fname2, long beg2, long end2)
 {
   if (match_size >= min_region_size) {
-    ssize_t res = printf("%s:%d,%d -- %s:%d,%d\n",
+    ssize_t res = printf("%s:%ld,%ld -- %s:%ld,%ld\n",
         fname1, beg1, end1-beg1, fname2, beg2, end2-beg2);
     if (res < 0) {
       error_exit("cannot output match");
@@ -175,7 +120,7 @@ int main(int argc, char *argv[])
   // exactly two arguments
   if (argc - optind != 2) usage();
 
-  struct index idx_source, idx_target;
+  struct store_view idx_source, idx_target;
 
   load_file(argv[optind], &idx_target);
   load_file(argv[optind + 1], &idx_source);
@@ -188,8 +133,8 @@ int main(int argc, char *argv[])
     string_to_string(&idx_source, &idx_target);
   }
 
-  cleanup_idx(&idx_source);
-  cleanup_idx(&idx_target);
+  store_close(&idx_source);
+  store_close(&idx_target);
 
   exit(EXIT_SUCCESS);
 }
@@ -200,50 +145,67 @@ int main(int argc, char *argv[])
 // Algorithm 1: String-to-String Correction
 ///////////////////////////////////////////////////////////////////////////////
 
+/**
+ * The position of the input successor of the hash at position i of
+ * segment k that is not dropped, or 0 if there is none.
+ */
+static uint32_t live_next(const struct store_view *sv, int k, uint32_t i)
+{
+  const struct idx_file *idx = &sv->segs[k];
+  do {
+    i = idx_next(idx, i);
+  } while (i > 0 && store_dead(sv, k, idx_seq(idx, i)));
+  return i;
+}
+
 /**
  * An iterator for hash_entries of a specified hash value
  */
 struct hash_iter {
-  // invariant: ptr points to the next element,
-  // last to the last of all available hashes
-  hash_entry_t *ptr, *last;
+  // invariant: pos is the position of the next element in segment seg, or
+  // the number of its hashes if there is none
+  const struct store_view *sv;
+  int seg;
+  uint32_t pos;
+  hash_t hash;
 };
 
 /**
  * Initialize an iterator for a certain hash value of a given index.
- * An index can contain more than one hash of the same value.
- *
- * Q: Why is an entry passed as argument and not just the hash value?
- * A: Because we can utilize hash_cmp which operates on hash_entry_t*.
+ * An index can contain more than one hash of the same value, and so can
+ * each segment of a store.
  */
-void hash_iter_init(struct hash_iter *it, struct index *idx,
-    hash_entry_t *entry)
+void hash_iter_init(struct hash_iter *it, const struct store_view *sv,
+    hash_t hash)
 {
-  it->ptr = bsearch(entry, idx->hashes, idx->hash_cnt, sizeof(hash_entry_t),
-      (int (*)(const void *, const void *))hash_cmp);
-  // find the first hash of a certain value (bsearch found any)
-  if (it->ptr != NULL) {
-    while (hash_cmp(it->ptr, it->ptr-1) == 0) it->ptr--;
-  }
-
-  // store the last of the hashes to avoid indexing out of bounds
-  // while iterating
-  it->last = (idx->hash_cnt > 0) ? &idx->hashes[idx->hash_cnt - 1] : NULL;
+  it->sv = sv;
+  it->hash = hash;
+  it->seg = 0;
+  // the first hash of the value, after the dummy entry
+  it->pos = sv->nsegs > 0 ? idx_seek(&sv->segs[0], 1, hash) : 0;
 }
 
 /**
- * Get the next element from the iterator, or NULL if there is no more.
+ * Get the position of the next element from the iterator, and its
+ * segment in *seg, or 0 if there is no more.  The dropped hashes of a
+ * store are skipped.
  */
-hash_entry_t *hash_iter_next(struct hash_iter *it)
+uint32_t hash_iter_next(struct hash_iter *it, int *seg)
 {
-  hash_entry_t *res = it->ptr;
-  if (it->ptr != NULL && it->ptr != it->last &&
-      hash_cmp(it->ptr, it->ptr+1) == 0) {
-    it->ptr++;
-  } else {
-    it->ptr = NULL;
+  while (it->seg < it->sv->nsegs) {
+    const struct idx_file *idx = &it->sv->segs[it->seg];
+    if (it->pos >= idx->count || idx_hash(idx, it->pos) != it->hash) {
+      // on to the next segment
+      if (++it->seg < it->sv->nsegs)
+        it->pos = idx_seek(&it->sv->segs[it->seg], 1, it->hash);
+      continue;
+    }
+    uint32_t pos = it->pos++;
+    if (store_dead(it->sv, it->seg, idx_seq(idx, pos))) continue;
+    *seg = it->seg;
+    return pos;
   }
-  return res;
+  return 0;
 }
 
 /**
@@ -251,65 +213,81 @@ hash_entry_t *hash_iter_next(struct hash_iter *it)
  * subchains in source to "construct" target.
  *
  * In contrast to the original report, we have binary search
- * for finding prefixes in the source.
+ * for finding prefixes in the source.  The segments of a store are
+ * taken one after the other; as each starts a file, chains end with them.
  */
-void string_to_string(struct index *idx_src, struct index *idx_tgt)
+void string_to_string(struct store_view *sv_src, struct store_view *sv_tgt)
 {
+  char *path_tgt = store_path_buf(sv_tgt),
+       *path_src = store_path_buf(sv_src);
+
   // iterate target in input order
-  int k = idx_tgt->hashes[0].next;
-  while (k > 0) {
-    hash_entry_t *src, *tgt = &idx_tgt->hashes[k];
-    DBG("target %016lx l%d f%d n%d\n", tgt->hash, tgt->linepos,
-        tgt->filecnt, tgt->next);
-
-    // walk through source and find the longest common prefix
-    struct hash_iter it;
-    hash_entry_t *tgt_end = tgt;
-    // store the best match (longest chain)
-    hash_entry_t *best_src, *best_src_end;
-    int best_count = 0;
-    hash_iter_init(&it, idx_src, tgt);
-    while ((src = hash_iter_next(&it)) != NULL) {
-      DBG("source %016lx l%d f%d n%d\n", src->hash, src->linepos,
-          src->filecnt, src->next);
-
-      // follow both chains as long as they're the same, count
-      hash_entry_t *t = tgt, *s = src;
-      hash_entry_t *tn, *sn; // next elements
-      int count = 1;
-      while (s->next != 0 && t->next != 0) {
-        sn = &idx_src->hashes[s->next];
-        tn = &idx_tgt->hashes[t->next];
-        if (sn->filecnt == s->filecnt &&
-            tn->filecnt == t->filecnt &&
-            hash_cmp(sn, tn) == 0) {
-          // extend the chain
-          s = sn;
-          t = tn;
-          count++;
-        } else break;
-      }
+  for (int kt = 0; kt < sv_tgt->nsegs; kt++) {
+    const struct idx_file *idx_tgt = &sv_tgt->segs[kt];
+    uint32_t k = live_next(sv_tgt, kt, 0);
+    while (k > 0) {
+      uint32_t src, tgt = k;
+      hash_t hash = idx_hash(idx_tgt, tgt);
+      DBG("target %016lx s%u n%u\n", hash, idx_seq(idx_tgt, tgt),
+          idx_next(idx_tgt, tgt));
+
+      // walk through source and find the longest common prefix
+      struct hash_iter it;
+      uint32_t tgt_end = tgt;
+      // store the best match (longest chain)
+      const struct idx_file *best_idx = NULL;
+      uint32_t best_src = 0, best_src_end = 0;
+      int best_count = 0, ks;
+      hash_iter_init(&it, sv_src, hash);
+      while ((src = hash_iter_next(&it, &ks)) != 0) {
+        const struct idx_file *idx_src = &sv_src->segs[ks];
+        DBG("source %016lx s%u n%u\n", hash, idx_seq(idx_src, src),
+            idx_next(idx_src, src));
+
+        // follow both chains as long as they're the same, count
+        uint32_t t = tgt, s = src;
+        uint32_t tn, sn; // next elements
+        int count = 1;
+        while ((sn = idx_next(idx_src, s)) != 0 &&
+            (tn = idx_next(idx_tgt, t)) != 0) {
+          if (!idx_starts_file(idx_src, idx_seq(idx_src, sn)) &&
+              !idx_starts_file(idx_tgt, idx_seq(idx_tgt, tn)) &&
+              idx_hash(idx_src, sn) == idx_hash(idx_tgt, tn)) {
+            // extend the chain
+            s = sn;
+            t = tn;
+            count++;
+          } else break;
+        }
 
-      // store the start/end of the longest common chain
-      if (count > best_count) {
-        best_src = src;
-        best_src_end = s;
-        tgt_end = t;
-        best_count = count;
+        // store the start/end of the longest common chain
+        if (count > best_count) {
+          best_idx = idx_src;
+          best_src = src;
+          best_src_end = s;
+          tgt_end = t;
+          best_count = count;
+        }
+        DBG("chain length: %d\n", count);
       }
-      DBG("chain length: %d\n", count);
-    }
-    if (best_count > 0) {
-      DBG("best chain length: %d\n", best_count);
-      record(best_count,
-          idx_tgt->paths[tgt->filecnt],
-          tgt->linepos, tgt_end->linepos,
-          idx_src->paths[best_src->filecnt],
-          best_src->linepos, best_src_end->linepos
-          );
+      if (best_count > 0) {
+        uint32_t ts = idx_seq(idx_tgt, tgt),
+                 te = idx_seq(idx_tgt, tgt_end);
+        uint32_t ss = idx_seq(best_idx, best_src),
+                 se = idx_seq(best_idx, best_src_end);
+        DBG("best chain length: %d\n", best_count);
+        record(best_count,
+            idx_path(idx_tgt, idx_file(idx_tgt, ts), path_tgt),
+            idx_line(idx_tgt, ts), idx_line(idx_tgt, te),
+            idx_path(best_idx, idx_file(best_idx, ss), path_src),
+            idx_line(best_idx, ss), idx_line(best_idx, se)
+            );
+      }
+      k = live_next(sv_tgt, kt, tgt_end);
     }
-    k = tgt_end->next;
   }
+  free(path_tgt);
+  free(path_src);
 }
 
 
@@ -318,21 +296,39 @@ void string_to_string(struct index *idx_src, struct index *idx_tgt)
 ///////////////////////////////////////////////////////////////////////////////
 
 /**
- * Supplemental data element for hash entry
+ * Supplemental data element for hash entry.  The chain is copied from the
+ * index, which is read-only, as matching regions are cut out of it.
  */
 struct hash_entry_suppl {
+  hash_t hash;
   int prev; // index of the previous hash in the chain
+  int next; // index of the next hash in the chain
   int term; // terminator flag indicates chain boundaries
 };
 
 /**
  * Create an array of hash_entry_suppl the same size as the number of
- * hash_entries in the index, and initialize it.
+ * hash_entries in the index, or in all segments of a store, one after the
+ * other, segment k from off[k] on, and initialize it.  The dropped hashes
+ * of a store are left out of the chain.
  */
-struct hash_entry_suppl *suppl_create(struct index *idx)
+struct hash_entry_suppl *suppl_create(const struct store_view *sv,
+    uint32_t **off)
 {
+  *off = malloc((sv->nsegs > 0 ? sv->nsegs : 1) * sizeof(uint32_t));
+  if (*off == NULL) {
+    error_exit("can't allocate buffer");
+  }
+  uint64_t total = 0;
+  for (int k = 0; k < sv->nsegs; k++) {
+    (*off)[k] = total;
+    total += sv->segs[k].count;
+  }
+  if (total > INT_MAX) {
+    error_exit("too many hashes");
+  }
   struct hash_entry_suppl *suppl =
-    malloc(idx->hash_cnt * sizeof(struct hash_entry_suppl));
+    malloc((total > 0 ? total : 1) * sizeof(struct hash_entry_suppl));
   if (suppl == NULL) {
     error_exit("can't allocate buffer");
   }
@@ -340,28 +336,48 @@ struct hash_entry_suppl *suppl_create(struct index *idx)
   // iterate once through the hashes in order and
   // store the previous pointer and set the term flag
   // upon change of the filename
-  for (int previ = 0, curi = idx->hashes[0].next; curi > 0;
-      previ = curi, curi = idx->hashes[curi].next) {
-    suppl[curi ].prev = previ;
-    suppl[previ].term =
-      (idx->hashes[previ].filecnt != idx->hashes[curi].filecnt);
+  suppl[0].hash = 0;
+  suppl[0].next = 0;
+  int previ = 0;
+  for (int k = 0; k < sv->nsegs; k++) {
+    const struct idx_file *idx = &sv->segs[k];
+    for (uint32_t i = live_next(sv, k, 0); i > 0; i = live_next(sv, k, i)) {
+      int curi = (*off)[k] + i;
+      suppl[curi ].hash = idx_hash(idx, i);
+      suppl[curi ].prev = previ;
+      suppl[curi ].next = 0;
+      suppl[previ].next = curi;
+      suppl[previ].term = idx_starts_file(idx, idx_seq(idx, i));
+      previ = curi;
+    }
   }
   return suppl;
 }
 
+/**
+ * The segment of the hash at position g of the suppl of a store, with
+ * segment k from off[k] on.
+ */
+static int suppl_seg(const struct store_view *sv, const uint32_t *off,
+    int g)
+{
+  int k = sv->nsegs - 1;
+  while (off[k] > (uint32_t) g) k--;
+  return k;
+}
+
 /**
  * Unlink a subchain from the hashes chain.
  * The subchain is specified via its begin and end index.
  */
-void unlink_subchain(hash_entry_t *hashes, struct hash_entry_suppl *suppl,
-    int ibegin, int iend)
+void unlink_subchain(struct hash_entry_suppl *suppl, int ibegin, int iend)
 {
   // link the predecessor of ibegin to the successor of iend
-  hashes[suppl[ibegin].prev].next = hashes[iend].next;
+  suppl[suppl[ibegin].prev].next = suppl[iend].next;
   // set the terminate flag for the predecessor of ibegin
   suppl[suppl[ibegin].prev].term = 1;
   // link the successor of iend to the predecessor of ibegin (prev-link)
-  suppl[hashes[iend].next].prev = suppl[ibegin].prev;
+  suppl[suppl[iend].next].prev = suppl[ibegin].prev;
 }
 
 
@@ -375,38 +391,42 @@ void unlink_subchain(hash_entry_t *hashes, struct hash_entry_suppl *suppl,
  * list is easier to handle).
  *
  */
-void iterated_lcs(struct index *idx_src, struct index *idx_tgt)
+void iterated_lcs(struct store_view *sv_src, struct store_view *sv_tgt)
 {
   int longest;
   int *dp0, *dp1;
+  char *path_tgt = store_path_buf(sv_tgt),
+       *path_src = store_path_buf(sv_src);
+
+  // create supplemental data structures
+  uint32_t *offs, *offt;
+  struct hash_entry_suppl *suppls = suppl_create(sv_src, &offs),
+                          *supplt = suppl_create(sv_tgt, &offt);
+  size_t nt = sv_tgt->nsegs > 0 ? offt[sv_tgt->nsegs - 1] +
+    sv_tgt->segs[sv_tgt->nsegs - 1].count : 1;
 
   // actual and last row of the dynamic programming table
-  dp0 = malloc(idx_tgt->hash_cnt * sizeof(int));
+  dp0 = malloc(nt * sizeof(int));
   if (dp0 == NULL) {
     error_exit("can't allocate buffer");
   }
-  dp1 = malloc(idx_tgt->hash_cnt * sizeof(int));
+  dp1 = malloc(nt * sizeof(int));
   if (dp1 == NULL) {
     error_exit("can't allocate buffer");
   }
 
-  // create supplemental data structures
-  struct hash_entry_suppl *suppls = suppl_create(idx_src),
-                          *supplt = suppl_create(idx_tgt);
-
-  hash_entry_t *hs = idx_src->hashes, *ht = idx_tgt->hashes;
   do {
     // these indices will point to the end of a matching region in both hashes
     int ls = -1, lt = -1;
     longest = 0;
-    for (int ks = hs[0].next; ks > 0; ks = hs[ks].next) {
+    for (int ks = suppls[0].next; ks > 0; ks = suppls[ks].next) {
       int ps = suppls[ks].prev;
       // swap pointers: dp0 gets dp1,
       // dp1 is the fresh row, its contents are discarded
       int *tmp = dp0; dp0 = dp1; dp1 = tmp;
-      for (int kt = ht[0].next; kt > 0; kt = ht[kt].next) {
+      for (int kt = supplt[0].next; kt > 0; kt = supplt[kt].next) {
         int pt = supplt[kt].prev;
-        if (hash_cmp(&hs[ks], &ht[kt]) == 0) {
+        if (suppls[ks].hash == supplt[kt].hash) {
           if (suppls[ps].term != 0 || supplt[pt].term != 0) {
             dp1[kt] = 1;
           } else {
@@ -434,14 +454,25 @@ void iterated_lcs(struct index *idx_src, struct index *idx_tgt)
         kt = supplt[kt].prev;
       }
 
+      // a region lies in one segment, as each starts a file
+      int segt = suppl_seg(sv_tgt, offt, kt),
+          segs = suppl_seg(sv_src, offs, ks);
+      const struct idx_file *idx_tgt = &sv_tgt->segs[segt],
+                            *idx_src = &sv_src->segs[segs];
+      uint32_t ts = idx_seq(idx_tgt, kt - offt[segt]),
+               te = idx_seq(idx_tgt, lt - offt[segt]);
+      uint32_t ss = idx_seq(idx_src, ks - offs[segs]),
+               se = idx_seq(idx_src, ls - offs[segs]);
       record(longest,
-          idx_tgt->paths[ht[kt].filecnt], ht[kt].linepos, ht[lt].linepos,
-          idx_src->paths[hs[ks].filecnt], hs[ks].linepos, hs[ls].linepos
+          idx_path(idx_tgt, idx_file(idx_tgt, ts), path_tgt),
+          idx_line(idx_tgt, ts), idx_line(idx_tgt, te),
+          idx_path(idx_src, idx_file(idx_src, ss), path_src),
+          idx_line(idx_src, ss), idx_line(idx_src, se)
           );
 
       // cut out the chains
-      unlink_subchain(hs, suppls, ks, ls);
-      unlink_subchain(ht, supplt, kt, lt);
+      unlink_subchain(suppls, ks, ls);
+      unlink_subchain(supplt, kt, lt);
     }
   } while (longest > 0);
 
@@ -450,6 +481,10 @@ void iterated_lcs(struct index *idx_src, struct index *idx_tgt)
   free(dp1);
   free(suppls);
   free(supplt);
+  free(offs);
+  free(offt);
+  free(path_tgt);
+  free(path_src);
 }
 
 
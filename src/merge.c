@@ -0,0 +1,128 @@
+/**
+ * fpcc-merge - Merge fingerprint indices into one.
+ *
+ * The sorted hashes of the indices are merged, so the indices need not be
+ * built again from their files.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "idxfile.h"
+#include "storeio.h"
+#include "idxio.h"
+
+const char *program_name = "fpcc-merge";
+
+
+void usage(void)
+{
+  (void) fprintf(stderr,
+      "USAGE: %s [-z] [-j threads] [-M memory] -o outfile file...\n",
+      program_name);
+  exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt_o=0, opt_j=0, opt_M=0, opt_z=0;
+  int threads = 1;
+  size_t memory = 0;
+  const char *outname = NULL;
+  int c;
+
+  if (argc > 0) program_name = argv[0];
+
+  while ((c = getopt(argc, argv, "j:M:o:z")) != -1) {
+    switch (c) {
+      case 'j':
+        if (opt_j++ > 0) usage();
+        threads = parse_num(optarg);
+        if (threads <= 0)
+          usage();
+        break;
+      case 'M':
+        if (opt_M++ > 0) usage();
+        memory = parse_size(optarg);
+        if (memory == 0)
+          usage();
+        break;
+      case 'o':
+        if (opt_o++ > 0) usage();
+        outname = optarg;
+        break;
+      case 'z':
+        if (opt_z++ > 0) usage();
+        break;
+      case '?':
+      default:
+        usage();
+    }
+  }
+  // outfile is mandatory, and at least one index
+  if (opt_o == 0) usage();
+  if (argc - optind < 1) usage();
+
+  // all indices are mapped at once, and stores are merged as their segments
+  int n = argc - optind, nsegs = 0;
+  struct store_view *sv = malloc(n * sizeof(struct store_view));
+  if (sv == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  struct stat out;
+  int out_exists = stat(outname, &out) == 0;
+  for (int k = 0; k < n; k++) {
+    const char *fname = argv[optind + k];
+    struct stat st;
+    // the indices are used in place, and must not be overwritten
+    if (out_exists && stat(fname, &st) == 0 &&
+        st.st_dev == out.st_dev && st.st_ino == out.st_ino) {
+      error_exit("outfile is one of the indices");
+    }
+    if (store_open(&sv[k], fname) != 0) {
+      char msg[PATH_MAX];
+      (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
+      error_exit(msg);
+    }
+    nsegs += sv[k].nsegs;
+  }
+  struct idx_file *ix = malloc((nsegs > 0 ? nsegs : 1) *
+      sizeof(struct idx_file));
+  const unsigned char **drop = malloc((nsegs > 0 ? nsegs : 1) *
+      sizeof(unsigned char *));
+  if (ix == NULL || drop == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  nsegs = 0;
+  for (int k = 0; k < n; k++) {
+    for (int j = 0; j < sv[k].nsegs; j++) {
+      ix[nsegs] = sv[k].segs[j];
+      drop[nsegs++] = sv[k].drop[j];
+    }
+  }
+
+  FILE *outfile = fopen(outname, "w");
+  if (outfile == NULL) {
+    error_exit("cannot open outfile");
+  }
+  idx_merge(ix, drop, nsegs, memory, threads, opt_z, outfile);
+  if (fclose(outfile) != 0) {
+    error_exit("cannot close outfile");
+  }
+
+  free(ix);
+  free(drop);
+  for (int k = 0; k < n; k++) {
+    store_close(&sv[k]);
+  }
+  free(sv);
+  exit(EXIT_SUCCESS);
+}
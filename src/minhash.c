@@ -0,0 +1,146 @@
+/**
+ * MinHash sketches and locality-sensitive hashing.
+ *
+ * The hashes of an index are already sorted, so the hashes of the base
+ * are skipped while they are sketched, without a lookup.  The hashes are
+ * mixed before binning, as the hash values of fpcc-sig -r need not be
+ * uniform.
+ *
+ * For each band, the key of each sketch is the mix of its rows; sorting
+ * the keys with the sketch number groups the sketches of equal keys in
+ * order, each group giving all pairs of its sketches.  Pairs found in
+ * several bands are removed by sorting all of them.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "extsort.h"
+#include "minhash.h"
+
+
+/**
+ * The finalizer of splitmix64, a bijection spreading the bits of x.
+ */
+static uint64_t mix(uint64_t x)
+{
+  x = (x ^ x >> 30) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ x >> 27) * 0x94d049bb133111ebULL;
+  return x ^ x >> 31;
+}
+
+
+void mh_sketch(uint64_t *sketch, unsigned m, const struct store_view *sv,
+    const struct store_view *base)
+{
+  for (unsigned b = 0; b < m; b++) {
+    sketch[b] = MH_EMPTY;
+  }
+  struct store_iter it, ib;
+  store_iter_init(&it, sv);
+  int inbase = 0;
+  if (base != NULL) {
+    store_iter_init(&ib, base);
+    inbase = store_iter_next(&ib);
+  }
+  int nonempty = 0;
+  while (store_iter_next(&it)) {
+    hash_t h = it.hash;
+    if (inbase && ib.hash < h) inbase = store_iter_seek(&ib, h);
+    if (inbase && ib.hash == h) continue;
+    uint64_t x = mix(h);
+    unsigned b = (x >> 32) * m >> 32;
+    if (x < sketch[b]) sketch[b] = x;
+    nonempty = 1;
+  }
+  store_iter_free(&it);
+  if (base != NULL) store_iter_free(&ib);
+  if (!nonempty) return;
+
+  // densify: from the last bin with hashes on, backwards
+  unsigned last = m - 1;
+  while (sketch[last] == MH_EMPTY) last--;
+  uint64_t fill = sketch[last];
+  unsigned dist = 0;
+  for (unsigned k = 1; k < m; k++) {
+    unsigned b = (last + m - k) % m;
+    if (sketch[b] != MH_EMPTY) {
+      fill = sketch[b];
+      dist = 0;
+    } else {
+      sketch[b] = mix(fill + ++dist);
+    }
+  }
+}
+
+
+static void pair_add(uint64_t **pairs, size_t *n, size_t *capacity,
+    uint64_t pair)
+{
+  if (*n == *capacity) {
+    *capacity = *capacity > 0 ? 2 * *capacity : 1024;
+    uint64_t *new_pairs = realloc(*pairs, *capacity * sizeof(uint64_t));
+    if (new_pairs == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    *pairs = new_pairs;
+  }
+  (*pairs)[(*n)++] = pair;
+}
+
+
+size_t mh_candidates(uint64_t **pairs, const uint64_t *sketches,
+    uint32_t n, unsigned bands, unsigned rows)
+{
+  const size_t m = (size_t) bands * rows;
+  hash_entry_t *keys = malloc((n > 0 ? n : 1) * sizeof(hash_entry_t));
+  if (keys == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  size_t npairs = 0, capacity = 0;
+  *pairs = NULL;
+
+  for (unsigned band = 0; band < bands; band++) {
+    uint32_t nkeys = 0;
+    for (uint32_t s = 0; s < n; s++) {
+      const uint64_t *rowp = sketches + s * m + band * rows;
+      if (rowp[0] == MH_EMPTY) continue;
+      uint64_t key = band;
+      for (unsigned r = 0; r < rows; r++) {
+        key = mix(key ^ rowp[r]);
+      }
+      hash_entry_t e = { key, s, 0 };
+      keys[nkeys++] = e;
+    }
+    hashes_sort(keys, nkeys, 1);
+    for (uint32_t a = 0; a < nkeys; a++) {
+      for (uint32_t b = a + 1; b < nkeys && keys[b].hash == keys[a].hash;
+          b++) {
+        pair_add(pairs, &npairs, &capacity,
+            (uint64_t) keys[a].seq << 32 | keys[b].seq);
+      }
+    }
+  }
+  free(keys);
+
+  // the pairs in order, once
+  hash_entry_t *sorted = malloc((npairs > 0 ? npairs : 1) *
+      sizeof(hash_entry_t));
+  if (sorted == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (size_t k = 0; k < npairs; k++) {
+    hash_entry_t e = { (*pairs)[k], 0, 0 };
+    sorted[k] = e;
+  }
+  hashes_sort(sorted, npairs, 1);
+  size_t unique = 0;
+  for (size_t k = 0; k < npairs; k++) {
+    if (unique == 0 || sorted[k].hash != (*pairs)[unique - 1]) {
+      (*pairs)[unique++] = sorted[k].hash;
+    }
+  }
+  free(sorted);
+  return unique;
+}
@@ -0,0 +1,43 @@
+#ifndef _MINHASH_H_
+#define _MINHASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "storeio.h"
+
+/*
+ * MinHash sketches of indices, and candidate pairs of similar indices by
+ * locality-sensitive hashing, for fpcc-comp -a.
+ *
+ * A sketch is the minimum of the mixed hashes in each of m bins, by one
+ * permutation: the high bits of a mixed hash choose its bin.  Two indices
+ * agree in a bin with a probability of about the Jaccard similarity of
+ * their hashes.  The bins are split into bands of rows; indices agreeing
+ * in all rows of a band are a candidate pair, so a pair of similarity s
+ * is a candidate with a probability of 1 - (1 - s^rows)^bands.
+ */
+
+// the minimum of a bin without hashes, and of all bins of an index
+// without any
+#define MH_EMPTY UINT64_MAX
+
+/**
+ * Sketch the hashes of the index or store sv that are not in base, which
+ * may be NULL, into the m minima of sketch.  Empty bins take the minimum
+ * of the next bin with hashes, rotated by their distance.
+ */
+void mh_sketch(uint64_t *sketch, unsigned m, const struct store_view *sv,
+    const struct store_view *base);
+
+/**
+ * Find the candidate pairs among the n sketches of bands * rows minima,
+ * one after the other.  Store them in *pairs, to be freed by the caller,
+ * as the lower index shifted left by 32 or'ed with the higher one, in
+ * ascending order, and return their number.  Sketches of no hashes are
+ * not paired.
+ */
+size_t mh_candidates(uint64_t **pairs, const uint64_t *sketches,
+    uint32_t n, unsigned bands, unsigned rows);
+
+#endif // _MINHASH_H_
@@ -10,6 +10,8 @@
 #include <unistd.h>
 
 #include "common.h"
+#include "idxfile.h"
+#include "storeio.h"
 
 const char *program_name = "fpcc-paths";
 
@@ -22,45 +24,30 @@ void usage(void)
 
 
 /**
- * Load the fingerprint index from a file to the provided idx.
+ * Print the paths of the fingerprint index in a file, or of the live files
+ * of a store.
  */
 void load_file(const char *fname)
 {
-  FILE *f = fopen(fname, "r");
-  uint32_t hash_cnt, path_cnt;
+  struct store_view sv;
 
-  if (f == NULL) {
-    goto fail;
+  if (store_open(&sv, fname) != 0) {
+    char msg[PATH_MAX];
+    (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
+    error_exit(msg);
   }
-  // skip the hashes
-  if (fread(&hash_cnt, sizeof hash_cnt, 1, f) != 1) {
-    goto fail;
-  }
-  if (fseek(f, hash_cnt * sizeof(hash_entry_t), SEEK_CUR) != 0) {
-    goto fail;
-  }
-  // read the paths
-  if (fread(&path_cnt, sizeof path_cnt, 1, f) != 1) {
-    goto fail;
-  }
-  char *path_buf = malloc(PATH_MAX);
-  size_t len = PATH_MAX;
-  for (int i = 0; i < path_cnt; i++) {
-    if (getdelim(&path_buf, &len, '\0', f) == -1) {
-      goto fail;
-    }
-    if (puts(path_buf) == EOF) {
-      error_exit("cannot print path");
+  char *buf = store_path_buf(&sv);
+  for (int k = 0; k < sv.nsegs; k++) {
+    const struct idx_file *idx = &sv.segs[k];
+    for (uint32_t i = 0; i < idx->path_cnt; i++) {
+      if (sv.drop[k] != NULL && sv.drop[k][i]) continue;
+      if (puts(idx_path(idx, i, buf)) == EOF) {
+        error_exit("cannot print path");
+      }
     }
   }
-  free(path_buf);
-  (void) fclose(f);
-  return;
-
-fail: ;
-  char msg[PATH_MAX];
-  (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
-  error_exit(msg);
+  free(buf);
+  store_close(&sv);
 }
 
 
@@ -12,180 +12,205 @@
 #include <stdio.h>
 #include <unistd.h>
 
-#include <openssl/md5.h>
 #include "common.h"
+#include "fprint.h"
 
 const char *program_name = "fpcc-sig";
 
-// we are using our generated scanner
-extern int yylex (void);
-extern FILE *yyin;
-extern int yylineno;
+// the outfile for each of the parameters, or NULL for stdout, and its
+// output
+static const char **outnames;
+static FILE **outs;
+static int nouts;
 
-int Ntoken     = DEFAULT_NTOKEN;
-int Winnowsize = DEFAULT_WINNOWSIZE;
 
-static int ntoken; // number of tokens read for current file
-static int *tokenbuf; // buffer for tokens
+/**
+ * Add the outfile for the next parameters, opened by open_outs().
+ */
+static void add_out(const char *name)
+{
+  const char **new_outnames = realloc(outnames,
+      (nouts + 1) * sizeof(const char *));
+  if (new_outnames == NULL)
+    error_exit("cannot allocate memory");
+  outnames = new_outnames;
+  outnames[nouts++] = name;
+}
 
 
-void winnow(int w);
+/**
+ * Open the outfiles, once the options are checked, so that an invalid
+ * command line truncates none of them.
+ */
+static void open_outs(void)
+{
+  outs = malloc(nouts * sizeof(FILE *));
+  if (outs == NULL)
+    error_exit("cannot allocate memory");
+  for (int i = 0; i < nouts; i++) {
+    outs[i] = outnames[i] != NULL ? fopen(outnames[i], "w") : stdout;
+    if (outs[i] == NULL)
+      error_exit("cannot open outfile");
+  }
+}
+
 
 void usage(void)
 {
-  (void) fprintf(stderr, "USAGE: %s [-n chainlength] [-w winnow]"
-                         " file...\n", program_name);
-  (void) fprintf(stderr, "  defaults: chainlength=%d winnow=%d\n",
-      DEFAULT_NTOKEN, DEFAULT_WINNOWSIZE);
+  (void) fprintf(stderr, "USAGE: %s [-0] [-f] [-k] [-m] [-r] [-R]"
+                         " [-C cachefile] [-e ext,...] [-j threads] [-l lexer]"
+                         " [-n chainlength] [-p chainlength,winnow,outfile...]"
+                         " [-t tokfile] [-T tokfile] [-w winnow] [file...]\n",
+                         program_name);
+  (void) fprintf(stderr, "  lexer: flex (default) or fast\n");
+  (void) fprintf(stderr, "  file - or none: read the list of files"
+                         " from stdin\n");
+  (void) fprintf(stderr, "  -T: save the tokens to tokfile, -t: fingerprint"
+                         " the tokens of tokfile\n");
+  (void) fprintf(stderr, "  defaults: chainlength=%d winnow=%d ext=%s\n",
+      DEFAULT_NTOKEN, DEFAULT_WINNOWSIZE, DEFAULT_EXTENSIONS);
   exit(EXIT_FAILURE);
 }
 
 
 /**
- * Print an canonicalized absolute pathname
+ * Output the fingerprint of a file: the absolute filename,
+ * followed by the hashes with line number.
+ * With functions, these are listed after the filename as
+ *   @ first_line last_line name
+ * and the hashes carry the index of their function, or -1.
  */
-void printfname(const char *fname)
+void print_result(const struct fpresult *res)
 {
-  char absfname[PATH_MAX] = {'\0'};
-  if (realpath(fname, absfname) == NULL) {
-    error_exit("cannot canonicalize pathname");
-  }
-  if (printf("%s\n", absfname) < 0)
+  FILE *out = outs[res->param];
+  if (fprintf(out, "%s\n", res->path) < 0)
     error_exit("cannot print file path");
+  if (Functions) {
+    for (size_t i = 0; i < res->nfuncs; i++) {
+      if (fprintf(out, "@ %d %d %s\n", res->funcs[i].first_line,
+            res->funcs[i].last_line, res->funcs[i].name) < 0)
+        error_exit("cannot print function");
+    }
+    for (size_t i = 0; i < res->count; i++) {
+      if (fprintf(out, "%016lx %d %d\n", res->recs[i].hash,
+            res->recs[i].linepos, res->recs[i].func) < 0)
+        error_exit("cannot print hash");
+    }
+    return;
+  }
+  for (size_t i = 0; i < res->count; i++) {
+    if (fprintf(out, "%016lx %d\n", res->recs[i].hash,
+          res->recs[i].linepos) < 0)
+      error_exit("cannot print hash");
+  }
 }
 
 
 int main(int argc, char *argv[])
 {
-  int opt_n=0, opt_w=0;
+  int opt_n=0, opt_w=0, opt_j=0, opt_l=0, opt_e=0, opt_C=0;
+  int opt_t=0, opt_T=0, opt_p=0;
+  char *stdin_list[] = { "-" };
   int c;
 
   if (argc > 0) program_name = argv[0];
 
-  while ((c = getopt(argc, argv, "n:w:")) != -1) {
+  while ((c = getopt(argc, argv, "0C:e:fj:kl:mn:p:Rrt:T:w:")) != -1) {
     switch (c) {
+      case '0':
+        if (Nullsep++ > 0) usage();
+        break;
+      case 'C':
+        if (opt_C++ > 0) usage();
+        Cachefile = optarg;
+        break;
+      case 'e':
+        if (opt_e++ > 0) usage();
+        Extensions = optarg;
+        break;
+      case 'j':
+        if (opt_j++ > 0) usage();
+        Nthreads = parse_num(optarg);
+        if (Nthreads <= 0)
+          usage();
+        break;
+      case 'l':
+        if (opt_l++ > 0) usage();
+        if (strcmp(optarg, "fast") == 0)
+          Fastlex = 1;
+        else if (strcmp(optarg, "flex") != 0)
+          usage();
+        break;
       case 'n':
         if (opt_n++ > 0) usage();
         Ntoken = parse_num(optarg);
         if (Ntoken <= 0)
           usage();
         break;
+      case 'p':
+        opt_p++;
+        add_out(fp_parse_param(optarg));
+        break;
+      case 't':
+        if (opt_t++ > 0) usage();
+        Tokenload = optarg;
+        break;
+      case 'T':
+        if (opt_T++ > 0) usage();
+        Tokensave = optarg;
+        break;
       case 'w':
         if (opt_w++ > 0) usage();
         Winnowsize = parse_num(optarg);
+        if (Winnowsize <= 0)
+          usage();
+        break;
+      case 'f':
+        if (Functions++ > 0) usage();
+        break;
+      case 'k':
+        if (Cachecheck++ > 0) usage();
+        break;
+      case 'm':
+        if (Mmap++ > 0) usage();
+        break;
+      case 'r':
+        if (Rolling++ > 0) usage();
+        break;
+      case 'R':
+        if (Recursive++ > 0) usage();
         break;
       case '?':
       default:
         usage();
     }
   }
-  // at least one file needs to be specified
-  if (argc - optind < 1) usage();
-
-  // allocate k-gram buffer
-  tokenbuf = malloc(Ntoken * sizeof(int));
-  if (tokenbuf == NULL)
-    error_exit("cannot allocate buffer");
-
-  // for each file specified, call winnowing routine
-  for (int i = optind; i < argc; i++) {
-    // TODO allow stdin
-    yyin = fopen(argv[i], "r");
-    if (yyin == NULL) {
-      (void) fprintf(stderr,
-          "%s: cannot open %s: %s\n", program_name, argv[i], strerror(errno));
-      continue;
-    }
-    yylineno = 1;
-    // print absolute filename
-    printfname(argv[i]);
-    ntoken = 0;
-    winnow(Winnowsize); // main winnowing routine
-    (void) fclose(yyin);
-  }
-  (void) free(tokenbuf);
-  return 0;
-}
-
-
-hash_t hash(void)
-{
-  MD5_CTX md5;
-  union {
-    unsigned char digest[16];
-    hash_t h;
-  } result;
-
-  MD5_Init(&md5);
-  for (int i=0, j=ntoken; i < Ntoken; i++) {
-    // for hashing, we start at the most recent value and work backwards
-    MD5_Update(&md5, &tokenbuf[--j % Ntoken], sizeof tokenbuf[0]);
-  }
-  MD5_Final(result.digest, &md5);
-  return result.h;
-}
-
-/**
- * Get the next hash.
- *
- * Continuously reads tokens from lexer, forms n-grams,
- * and returns their hashes.
- * Return the hash for the next n-gram or 0 if no tokens are left.
- */
-hash_t next_hash(void)
-{
-  int tok;
-  while ((tok = yylex()) != 0) {
-    tokenbuf[ntoken % Ntoken] = tok;
-    // fill the first chain
-    if (++ntoken < Ntoken) continue;
-    return hash();
+  // extensions only apply to directories, contents only to the cache
+  if (opt_e > 0 && !Recursive) usage();
+  if (Cachecheck && Cachefile == NULL) usage();
+  // the cache holds no functions
+  if (Functions && Cachefile != NULL) usage();
+  // each -p has its own chainlength and winnow size, and outfile
+  if (opt_p && (opt_n || opt_w || Cachefile != NULL)) usage();
+  // the tokens are saved as scanned, without names of identifiers
+  if ((opt_t || opt_T) && Cachefile != NULL) usage();
+  if (opt_t && (opt_T || Functions || Recursive || opt_e)) usage();
+  if (opt_t && argc - optind > 0) usage();
+  if (!opt_p) add_out(NULL);
+  open_outs();
+
+  // a token file replaces the files; without files, read the list from stdin
+  if (opt_t)
+    fp_run(NULL, 0, print_result);
+  else if (argc - optind < 1)
+    fp_run(stdin_list, 1, print_result);
+  else
+    fp_run(&argv[optind], argc - optind, print_result);
+  for (int i = 0; i < nouts; i++) {
+    if (fclose(outs[i]) != 0)
+      error_exit("cannot close outfile");
   }
+  free(outs);
+  free(outnames);
   return 0;
 }
-
-
-/**
- * Output a given hash with line number
- */
-void record(hash_t h)
-{
-  if (printf("%016lx %d\n", h, yylineno) < 0)
-    error_exit("cannot print hash");
-}
-
-
-void winnow(int w) {
-  // circular buffer implementing window of size w
-  hash_t h, window[w];
-  for (int i=0; i<w; ++i) window[i] = UINT64_MAX;
-  int r = 0;      // window right end
-  int min = 0;    // index of minimum hash
-  // At the end of each iteration, min holds the
-  // position of the rightmost minimal hash in the
-  // current window.  record(x) is called only the
-  // first time an instance of x is selected as the
-  // rightmost minimal hash of a window.
-  while ((h = next_hash()) != 0) {
-    r = (r + 1) % w; // shift the window by one
-    window[r] = h;   // and add one new hash
-    if (min == r) {
-      // The previous minimum is no longer in this
-      // window.  Scan leftward starting from r
-      // for the rightmost minimal hash.  Note min
-      // starts with the index of the rightmost
-      // hash.
-      for (int i = (r-1+w)%w; i != r; i = (i-1+w)%w)
-        if (window[i] < window[min]) min = i;
-      record(window[min]);
-    } else {
-      // Otherwise, the previous minimum is still in
-      // this window. Compare against the new value
-      // and update min if necessary.
-      if (window[r] <= window[min]) {  // '<' for robust winnowing
-        min = r;
-        record(window[min]);
-      }
-    }
-  }
-}
@@ -0,0 +1,343 @@
+/**
+ * Counting common hashes by an inverted index.
+ *
+ * The sorted hashes of all indices are merged with a heap of the indices
+ * by their next hash, so the indices holding a hash are found in the
+ * order of the indices, with the number of times each holds it.  A pair
+ * of indices holding a hash c0 and c1 times has min(c0, c1) common hashes
+ * of it, as the hashes are matched one by one, and of these as many are
+ * in the base as the base holds.
+ *
+ * The pairs are kept in a table by open addressing.  The indices holding
+ * a frequent hash are kept as a group; of the pairs in the distinct
+ * groups, those that may reach the threshold are marked for counting
+ * again, each once.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+
+
+/**
+ * The state of merging the hashes of the indices: an iterator at the next
+ * hash of each index, and a heap of the indices with hashes left.
+ */
+struct sp_merge {
+  struct store_iter *it;
+  uint32_t *heap;
+  uint32_t nheap;
+};
+
+static int merge_before(const struct sp_merge *m, uint32_t a, uint32_t b)
+{
+  hash_t ha = m->it[a].hash, hb = m->it[b].hash;
+  return ha < hb || (ha == hb && a < b);
+}
+
+static void merge_down(struct sp_merge *m, uint32_t i)
+{
+  for (;;) {
+    uint32_t c = 2 * i + 1;
+    if (c >= m->nheap) break;
+    if (c + 1 < m->nheap && merge_before(m, m->heap[c + 1], m->heap[c])) c++;
+    if (!merge_before(m, m->heap[c], m->heap[i])) break;
+    uint32_t t = m->heap[c];
+    m->heap[c] = m->heap[i];
+    m->heap[i] = t;
+    i = c;
+  }
+}
+
+
+/**
+ * A table of pairs by open addressing; keys of all ones mark free slots.
+ */
+struct sp_table {
+  struct sp_pair *slots;
+  size_t capacity, count;
+};
+
+static size_t table_slot(const struct sp_table *t, uint64_t key)
+{
+  uint64_t h = key * 0x9e3779b97f4a7c15ULL;
+  size_t slot = (h ^ h >> 32) & (t->capacity - 1);
+  while (t->slots[slot].key != UINT64_MAX && t->slots[slot].key != key)
+    slot = (slot + 1) & (t->capacity - 1);
+  return slot;
+}
+
+static void table_alloc(struct sp_table *t, size_t capacity)
+{
+  t->capacity = capacity;
+  t->slots = malloc(capacity * sizeof(struct sp_pair));
+  if (t->slots == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  memset(t->slots, 0xff, capacity * sizeof(struct sp_pair));
+}
+
+/**
+ * The pair of indices a and b, a < b, added if it is not in the table.
+ */
+static struct sp_pair *table_get(struct sp_table *t, uint32_t a, uint32_t b)
+{
+  if (2 * (t->count + 1) > t->capacity) {
+    // rehash into a table of twice the size
+    struct sp_table old = *t;
+    table_alloc(t, 2 * old.capacity);
+    for (size_t k = 0; k < old.capacity; k++) {
+      if (old.slots[k].key == UINT64_MAX) continue;
+      t->slots[table_slot(t, old.slots[k].key)] = old.slots[k];
+    }
+    free(old.slots);
+  }
+  uint64_t key = (uint64_t) a << 32 | b;
+  struct sp_pair *p = &t->slots[table_slot(t, key)];
+  if (p->key == UINT64_MAX) {
+    p->key = key;
+    p->nboth = p->nexcl = 0;
+    p->recount = 0;
+    t->count++;
+  }
+  return p;
+}
+
+
+static int pair_cmp(const void *a, const void *b)
+{
+  uint64_t k1 = ((const struct sp_pair *) a)->key;
+  uint64_t k2 = ((const struct sp_pair *) b)->key;
+  return k1 < k2 ? -1 : k1 > k2;
+}
+
+
+/**
+ * A group of the indices holding a frequent hash, in order.
+ */
+struct sp_group {
+  uint64_t hash;                // of the indices
+  const uint32_t *ids;
+  size_t count;
+};
+
+static int group_cmp(const void *a, const void *b)
+{
+  const struct sp_group *g1 = a, *g2 = b;
+  if (g1->hash != g2->hash) return g1->hash < g2->hash ? -1 : 1;
+  if (g1->count != g2->count) return g1->count < g2->count ? -1 : 1;
+  return memcmp(g1->ids, g2->ids, g1->count * sizeof(uint32_t));
+}
+
+
+/**
+ * A growing array of 32-bit integers.
+ */
+struct sp_array {
+  uint32_t *buf;
+  size_t count, capacity;
+};
+
+static void array_add(struct sp_array *a, uint32_t v)
+{
+  if (a->count == a->capacity) {
+    a->capacity = a->capacity > 0 ? 2 * a->capacity : 1024;
+    uint32_t *buf = realloc(a->buf, a->capacity * sizeof(uint32_t));
+    if (buf == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    a->buf = buf;
+  }
+  a->buf[a->count++] = v;
+}
+
+
+size_t sp_count(struct sp_pair **pairs, const struct store_view *const *sv,
+    uint32_t n, const struct store_view *base, int thresh)
+{
+  struct sp_merge m = { NULL, NULL, 0 };
+  m.it = malloc((n > 0 ? n : 1) * sizeof(struct store_iter));
+  m.heap = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  // the number of frequent hashes of each index
+  uint64_t *freq = calloc(n > 0 ? n : 1, sizeof(uint64_t));
+  uint32_t *gsig = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  uint32_t *gmult = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  if (m.it == NULL || m.heap == NULL || freq == NULL || gsig == NULL ||
+      gmult == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (uint32_t s = 0; s < n; s++) {
+    store_iter_init(&m.it[s], sv[s]);
+    if (store_iter_next(&m.it[s])) m.heap[m.nheap++] = s;
+  }
+  for (uint32_t i = m.nheap / 2; i-- > 0; ) {
+    merge_down(&m, i);
+  }
+
+  struct sp_table t = { NULL, 0, 0 };
+  table_alloc(&t, 1024);
+  // the indices holding each frequent hash, each followed by UINT32_MAX
+  struct sp_array fgroups = { NULL, 0, 0 };
+  struct store_iter ib;
+  int inbase = 0;
+  if (base != NULL) {
+    store_iter_init(&ib, base);
+    inbase = store_iter_next(&ib);
+  }
+  while (m.nheap > 0) {
+    // the indices holding the next hash, in order
+    hash_t h = m.it[m.heap[0]].hash;
+    uint32_t g = 0;
+    while (m.nheap > 0) {
+      uint32_t s = m.heap[0];
+      if (m.it[s].hash != h) break;
+      uint32_t mult = 0;
+      int more;
+      do {
+        mult++;
+      } while ((more = store_iter_next(&m.it[s])) && m.it[s].hash == h);
+      gsig[g] = s;
+      gmult[g++] = mult;
+      if (!more) m.heap[0] = m.heap[--m.nheap];
+      merge_down(&m, 0);
+    }
+
+    if (g > SP_MAX_POSTINGS) {
+      for (uint32_t a = 0; a < g; a++) {
+        freq[gsig[a]] += gmult[a];
+        array_add(&fgroups, gsig[a]);
+      }
+      array_add(&fgroups, UINT32_MAX);
+      continue;
+    }
+    if (g < 2) continue;
+    uint32_t nbase = 0;
+    if (inbase && ib.hash < h) inbase = store_iter_seek(&ib, h);
+    while (inbase && ib.hash == h) {
+      inbase = store_iter_next(&ib);
+      nbase++;
+    }
+    for (uint32_t a = 0; a < g; a++) {
+      for (uint32_t b = a + 1; b < g; b++) {
+        struct sp_pair *p = table_get(&t, gsig[a], gsig[b]);
+        uint32_t both = gmult[a] < gmult[b] ? gmult[a] : gmult[b];
+        p->nboth += both;
+        p->nexcl += both < nbase ? both : nbase;
+      }
+    }
+  }
+  for (uint32_t s = 0; s < n; s++) {
+    store_iter_free(&m.it[s]);
+  }
+  if (base != NULL) store_iter_free(&ib);
+  free(m.it);
+  free(m.heap);
+  free(gsig);
+  free(gmult);
+
+  // the pairs found may have frequent hashes in common
+  for (size_t k = 0; k < t.capacity; k++) {
+    struct sp_pair *p = &t.slots[k];
+    if (p->key == UINT64_MAX) continue;
+    if (freq[p->key >> 32] > 0 && freq[p->key & UINT32_MAX] > 0)
+      p->recount = 1;
+  }
+  // the distinct groups of indices holding a frequent hash: frequent
+  // hashes are mostly held by the same indices
+  size_t ngroups = 0;
+  for (size_t k = 0; k < fgroups.count; k++) {
+    if (fgroups.buf[k] == UINT32_MAX) ngroups++;
+  }
+  struct sp_group *groups = malloc((ngroups > 0 ? ngroups : 1) *
+      sizeof(struct sp_group));
+  if (groups == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  ngroups = 0;
+  for (size_t k = 0; k < fgroups.count; ) {
+    struct sp_group *gr = &groups[ngroups++];
+    // FNV-1a
+    gr->hash = 0xcbf29ce484222325ULL;
+    gr->ids = &fgroups.buf[k];
+    for (; fgroups.buf[k] != UINT32_MAX; k++) {
+      gr->hash = (gr->hash ^ fgroups.buf[k]) * 0x100000001b3ULL;
+    }
+    gr->count = &fgroups.buf[k++] - gr->ids;
+  }
+  qsort(groups, ngroups, sizeof(struct sp_group), group_cmp);
+  size_t ndistinct = 0;
+  for (size_t k = 0; k < ngroups; k++) {
+    if (ndistinct == 0 || group_cmp(&groups[ndistinct - 1], &groups[k]) != 0)
+      groups[ndistinct++] = groups[k];
+  }
+
+  // the distinct groups of each index, from ingroup[start[s]] on
+  size_t *start = calloc((size_t) n + 1, sizeof(size_t));
+  if (start == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (size_t k = 0; k < ndistinct; k++) {
+    for (size_t a = 0; a < groups[k].count; a++) {
+      start[groups[k].ids[a] + 1]++;
+    }
+  }
+  for (uint32_t s = 0; s < n; s++) {
+    start[s + 1] += start[s];
+  }
+  uint32_t *ingroup = malloc((start[n] > 0 ? start[n] : 1) *
+      sizeof(uint32_t));
+  uint32_t *seen = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+  if (ingroup == NULL || seen == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (size_t k = 0; k < ndistinct; k++) {
+    for (size_t a = 0; a < groups[k].count; a++) {
+      ingroup[start[groups[k].ids[a]]++] = k;
+    }
+  }
+  // start[s] is now where the groups of s + 1 start
+  memmove(start + 1, start, n * sizeof(size_t));
+  start[0] = 0;
+  memset(seen, 0xff, n * sizeof(uint32_t));
+
+  // the pairs with only frequent hashes in common, if the frequent hashes
+  // of the smaller index reach the threshold; the indices sharing a group
+  // with the smaller one are visited once, and of indices of the same
+  // size, the pair is marked from the first that reaches it
+#define REACHES(s) (100 * freq[s] >= (uint64_t) thresh * sv[s]->count)
+  for (uint32_t sa = 0; sa < n; sa++) {
+    if (start[sa] == start[sa + 1] || !REACHES(sa)) continue;
+    for (size_t k = start[sa]; k < start[sa + 1]; k++) {
+      const struct sp_group *gr = &groups[ingroup[k]];
+      for (size_t b = 0; b < gr->count; b++) {
+        uint32_t sb = gr->ids[b];
+        if (seen[sb] == sa) continue;
+        seen[sb] = sa;
+        if (sb == sa || sv[sb]->count < sv[sa]->count) continue;
+        if (sb < sa && sv[sb]->count == sv[sa]->count && REACHES(sb))
+          continue;
+        struct sp_pair *p = sa < sb ? table_get(&t, sa, sb) :
+          table_get(&t, sb, sa);
+        p->recount = 1;
+      }
+    }
+  }
+#undef REACHES
+  free(seen);
+  free(ingroup);
+  free(start);
+  free(groups);
+  free(fgroups.buf);
+  free(freq);
+
+  // compact the pairs, in order
+  size_t npairs = 0;
+  for (size_t k = 0; k < t.capacity; k++) {
+    if (t.slots[k].key != UINT64_MAX) t.slots[npairs++] = t.slots[k];
+  }
+  qsort(t.slots, npairs, sizeof(struct sp_pair), pair_cmp);
+  *pairs = t.slots;
+  return npairs;
+}
@@ -0,0 +1,46 @@
+#ifndef _SPARSE_H_
+#define _SPARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "storeio.h"
+
+/*
+ * Counting the common hashes of all pairs of indices by an inverted index,
+ * for fpcc-comp -s: the indices holding each hash are found by merging
+ * their sorted hashes, and only pairs of indices holding a common hash
+ * are counted, as count() in fpcc-comp does.
+ *
+ * Hashes held by more than SP_MAX_POSTINGS indices would add too many
+ * pairs, so they are not counted.  Instead, the pairs holding such a hash
+ * are counted again with count(), if their common hashes could reach the
+ * threshold: as the common hashes are at most as many as the smaller
+ * index holds, at least the frequent hashes of it must reach it.
+ */
+
+#define SP_MAX_POSTINGS 256
+
+/**
+ * A pair of indices with common hashes, the lower index shifted left by
+ * 32 or'ed with the higher one, and their number of common hashes and of
+ * common hashes of the base.  If recount is set, frequent hashes were
+ * not counted.
+ */
+struct sp_pair {
+  uint64_t key;
+  int nboth, nexcl;
+  int recount;
+};
+
+/**
+ * Count the common hashes of the pairs of the n indices or stores sv, and
+ * of these the hashes of base, which may be NULL.  Pairs with only
+ * frequent hashes in common are left out if they cannot reach thresh
+ * percent.  Store the pairs in *pairs, to be freed by the caller, in
+ * ascending order, and return their number.
+ */
+size_t sp_count(struct sp_pair **pairs, const struct store_view *const *sv,
+    uint32_t n, const struct store_view *base, int thresh);
+
+#endif // _SPARSE_H_
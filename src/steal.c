@@ -0,0 +1,217 @@
+/**
+ * Running chunks of work with work stealing.
+ *
+ * The chunks of a thread are those of a residue modulo the number of
+ * threads, from the k-th to the one before the h-th, so half of them are
+ * stolen by splitting the range.  A chunk is run into a buffer of its
+ * own, which is written when all chunks before it were written, or right
+ * away if unordered.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "steal.h"
+
+
+/**
+ * The chunks of a thread: base + stride * k for k from lo to hi - 1.
+ */
+struct ws_deque {
+  size_t base, lo, hi;
+  pthread_mutex_t lock;
+};
+
+/**
+ * The results of a chunk, once done.
+ */
+struct ws_result {
+  char *buf;
+  size_t len;
+  int done;
+};
+
+struct ws {
+  size_t n;
+  int nthreads;
+  int ordered;
+  FILE *file;
+  ws_run_t run;
+  void *arg;
+  struct ws_deque *deques;
+  struct ws_result *results; // if ordered
+  size_t next;               // next chunk to write, if ordered
+  pthread_mutex_t out_lock;
+};
+
+struct ws_thread {
+  struct ws *ws;
+  int id;
+  pthread_t thread;
+};
+
+
+/**
+ * Take the next chunk of deque d into *chunk; return 0 if it is empty.
+ */
+static int take(struct ws *ws, struct ws_deque *d, size_t *chunk)
+{
+  int res = 0;
+  (void) pthread_mutex_lock(&d->lock);
+  if (d->lo < d->hi) {
+    *chunk = d->base + (size_t) ws->nthreads * d->lo++;
+    res = 1;
+  }
+  (void) pthread_mutex_unlock(&d->lock);
+  return res;
+}
+
+/**
+ * Steal the later half of the chunks of the thread with most left into
+ * deque d of thread id; return 0 if no chunks are left.
+ */
+static int steal(struct ws *ws, int id, struct ws_deque *d)
+{
+  for (;;) {
+    int victim = -1;
+    size_t most = 0;
+    for (int t = 0; t < ws->nthreads; t++) {
+      if (t == id) continue;
+      struct ws_deque *v = &ws->deques[t];
+      (void) pthread_mutex_lock(&v->lock);
+      size_t left = v->hi - v->lo;
+      (void) pthread_mutex_unlock(&v->lock);
+      if (left > most) {
+        most = left;
+        victim = t;
+      }
+    }
+    if (victim == -1) return 0;
+
+    // the victim may have taken chunks meanwhile
+    struct ws_deque *v = &ws->deques[victim];
+    (void) pthread_mutex_lock(&v->lock);
+    size_t base = v->base, hi = v->hi, left = v->hi - v->lo;
+    if (left > 0) v->hi -= (left + 1) / 2;
+    size_t lo = v->hi;
+    (void) pthread_mutex_unlock(&v->lock);
+    if (left == 0) continue;
+    // not locked with the victim, which may be stealing from d
+    (void) pthread_mutex_lock(&d->lock);
+    d->base = base;
+    d->lo = lo;
+    d->hi = hi;
+    (void) pthread_mutex_unlock(&d->lock);
+    return 1;
+  }
+}
+
+
+/**
+ * Write the results of a chunk in buf to the file, or keep them until
+ * the chunks before are written.
+ */
+static void emit(struct ws *ws, size_t chunk, char *buf, size_t len)
+{
+  (void) pthread_mutex_lock(&ws->out_lock);
+  if (!ws->ordered) {
+    if (fwrite(buf, 1, len, ws->file) != len) {
+      error_exit("cannot print result");
+    }
+    free(buf);
+  } else {
+    struct ws_result *r = &ws->results[chunk];
+    r->buf = buf;
+    r->len = len;
+    r->done = 1;
+    for (; ws->next < ws->n && ws->results[ws->next].done; ws->next++) {
+      r = &ws->results[ws->next];
+      if (fwrite(r->buf, 1, r->len, ws->file) != r->len) {
+        error_exit("cannot print result");
+      }
+      free(r->buf);
+      r->buf = NULL;
+    }
+  }
+  (void) pthread_mutex_unlock(&ws->out_lock);
+}
+
+
+static void *ws_thread_run(void *arg)
+{
+  struct ws_thread *wt = arg;
+  struct ws *ws = wt->ws;
+  struct ws_deque *d = &ws->deques[wt->id];
+  size_t chunk;
+  while (take(ws, d, &chunk) || (steal(ws, wt->id, d) &&
+        take(ws, d, &chunk))) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&buf, &len);
+    if (out == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    ws->run(ws->arg, chunk, out);
+    if (fclose(out) != 0) {
+      error_exit("cannot allocate memory");
+    }
+    emit(ws, chunk, buf, len);
+  }
+  return NULL;
+}
+
+
+void ws_run(size_t n, int nthreads, int ordered, FILE *file, ws_run_t run,
+    void *arg)
+{
+  if (nthreads <= 1) {
+    for (size_t c = 0; c < n; c++) run(arg, c, file);
+    return;
+  }
+  struct ws ws = { n, nthreads, ordered, file, run, arg, NULL, NULL, 0 };
+  ws.deques = malloc(nthreads * sizeof(struct ws_deque));
+  struct ws_thread *threads = malloc(nthreads * sizeof(struct ws_thread));
+  if (ordered) ws.results = calloc(n > 0 ? n : 1, sizeof(struct ws_result));
+  if (ws.deques == NULL || threads == NULL ||
+      (ordered && ws.results == NULL)) {
+    error_exit("cannot allocate memory");
+  }
+  (void) pthread_mutex_init(&ws.out_lock, NULL);
+  // chunk c is dealt to thread c modulo nthreads
+  for (int t = 0; t < nthreads; t++) {
+    struct ws_deque *d = &ws.deques[t];
+    d->base = t;
+    d->lo = 0;
+    d->hi = (size_t) t < n ? (n - t + nthreads - 1) / nthreads : 0;
+    (void) pthread_mutex_init(&d->lock, NULL);
+  }
+  // results written so far go first
+  if (fflush(file) != 0) {
+    error_exit("cannot print result");
+  }
+  for (int i = 0; i < nthreads; i++) {
+    threads[i].ws = &ws;
+    threads[i].id = i;
+    if (i == 0) continue;
+    errno = pthread_create(&threads[i].thread, NULL, ws_thread_run,
+        &threads[i]);
+    if (errno != 0) {
+      error_exit("cannot create thread");
+    }
+  }
+  // the calling thread takes part
+  (void) ws_thread_run(&threads[0]);
+  for (int i = 1; i < nthreads; i++) {
+    (void) pthread_join(threads[i].thread, NULL);
+  }
+  for (int t = 0; t < nthreads; t++) {
+    (void) pthread_mutex_destroy(&ws.deques[t].lock);
+  }
+  (void) pthread_mutex_destroy(&ws.out_lock);
+  free(ws.results);
+  free(ws.deques);
+  free(threads);
+}
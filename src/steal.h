@@ -0,0 +1,31 @@
+#ifndef _STEAL_H_
+#define _STEAL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Running chunks of work by a number of threads with work stealing.
+ *
+ * The chunks are dealt to the threads in turn, chunk c to thread c modulo
+ * the number of threads.  Each thread runs its own chunks in order, and
+ * when it has none left steals the later half of the chunks of the thread
+ * with most left.  As all threads run chunks of about the same part of
+ * the order, the results of the chunks done ahead of the earliest pending
+ * one are few.
+ */
+
+/**
+ * Run a chunk of work, writing its results to out.
+ */
+typedef void (*ws_run_t)(void *arg, size_t chunk, FILE *out);
+
+/**
+ * Run chunks 0 to n-1 with run by nthreads threads, and write their
+ * results to file, in the order of the chunks if ordered, and as the
+ * chunks are done otherwise.
+ */
+void ws_run(size_t n, int nthreads, int ordered, FILE *file, ws_run_t run,
+    void *arg);
+
+#endif // _STEAL_H_
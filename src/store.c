@@ -0,0 +1,463 @@
+/**
+ * fpcc-store - Maintain a corpus store of fingerprint indices.
+ *
+ * Indices of new or changed files are added as segments, deleted files are
+ * recorded as tombstones, and a compaction merges the live files of all
+ * segments into one.  Adding takes time in the size of the index added,
+ * not of the store; when the store has too many segments afterwards, it is
+ * compacted in the background.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "idxfile.h"
+#include "idxio.h"
+#include "storeio.h"
+
+// compact in the background after adding, with more segments
+#define DEFAULT_MAX_SEGMENTS 8
+
+// locked by a compaction, which is written to a temporary file first
+#define STORE_COMPACT "COMPACT"
+
+const char *program_name = "fpcc-store";
+
+// options of compactions
+static size_t Memory = 0;
+static int Threads = 1;
+static int Compress = 0;
+
+
+void usage(void)
+{
+  (void) fprintf(stderr,
+      "USAGE: %s [-m segments] [-z] [-j threads] [-M memory] -a index store\n"
+      "       %s -d store path...\n"
+      "       %s [-z] [-j threads] [-M memory] -c store\n"
+      "       %s -l store\n",
+      program_name, program_name, program_name, program_name);
+  exit(EXIT_FAILURE);
+}
+
+
+static void store_error(const char *what, const char *path)
+{
+  char msg[PATH_MAX];
+  (void) snprintf(msg, sizeof msg, "%s '%s'", what, path);
+  error_exit(msg);
+}
+
+
+/**
+ * Read the manifest of a store, which must be locked, or exit.
+ */
+static void manifest_read(struct store *st, const char *dir)
+{
+  if (store_read(st, dir) != 0) {
+    store_error("error reading store", dir);
+  }
+}
+
+
+/**
+ * Write a file and make it durable.
+ */
+static void file_close(FILE *f, const char *path)
+{
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0) {
+    store_error("cannot write", path);
+  }
+}
+
+
+/**
+ * Append records to the manifest, which must be locked exclusively.
+ */
+static void manifest_append(const char *dir, const char *text, size_t len)
+{
+  char *manifest = store_file(dir, STORE_MANIFEST);
+  FILE *f = fopen(manifest, "a");
+  if (f == NULL || fwrite(text, 1, len, f) != len) {
+    store_error("cannot write", manifest);
+  }
+  file_close(f, manifest);
+  free(manifest);
+}
+
+
+/**
+ * Replace the manifest with the segment seg, unless 0, and the records
+ * of st from the first one on.  The store must be locked exclusively.
+ */
+static void manifest_replace(const char *dir, uint32_t seg,
+    const struct store *st, size_t first)
+{
+  char *manifest = store_file(dir, STORE_MANIFEST);
+  char *tmp = store_file(dir, STORE_MANIFEST ".tmp");
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    store_error("cannot write", tmp);
+  }
+  (void) fprintf(f, "%s\n", STORE_MAGIC);
+  if (seg > 0) (void) fprintf(f, "seg %u\n", (unsigned) seg);
+  for (size_t r = first; r < st->nrecs; r++) {
+    if (st->recs[r].path != NULL) {
+      (void) fprintf(f, "del %s\n", st->recs[r].path);
+    } else {
+      (void) fprintf(f, "seg %u\n", (unsigned) st->recs[r].seg);
+    }
+  }
+  file_close(f, tmp);
+  if (rename(tmp, manifest) != 0) {
+    store_error("cannot write", manifest);
+  }
+  free(tmp);
+  free(manifest);
+}
+
+
+/**
+ * Create the store in directory dir, unless it exists.
+ */
+static void store_create(const char *dir)
+{
+  if (store_exists(dir)) return;
+  if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+    store_error("cannot create store", dir);
+  }
+  int fd = store_lock(dir, LOCK_EX);
+  if (!store_exists(dir)) {
+    struct store empty = { NULL, NULL, 0, 0, 1 };
+    manifest_replace(dir, 0, &empty, 0);
+  }
+  (void) close(fd);
+}
+
+
+/**
+ * Merge the live files of all segments into one, and replace them in the
+ * manifest.  Records added meanwhile are kept.  Return 0, or -1 if another
+ * compaction is running.
+ */
+static int compact(const char *dir)
+{
+  char *lock = store_file(dir, STORE_COMPACT);
+  int cfd = open(lock, O_RDONLY | O_CREAT, 0666);
+  if (cfd == -1) {
+    store_error("cannot open", lock);
+  }
+  if (flock(cfd, LOCK_EX | LOCK_NB) == -1) {
+    free(lock);
+    (void) close(cfd);
+    return -1;
+  }
+
+  // the segments as of now; adding continues while they are merged
+  struct store st;
+  struct idx_file *segs;
+  unsigned char **drop;
+  int fd = store_lock(dir, LOCK_SH);
+  manifest_read(&st, dir);
+  int n = store_segments(&st, &segs, &drop);
+  if (n < 0) {
+    store_error("error reading store", dir);
+  }
+  (void) close(fd);
+
+  // a single segment without dropped files is kept, without tombstones
+  int merge = n > 1;
+  for (int k = 0; k < n; k++) {
+    if (drop[k] != NULL) merge = 1;
+  }
+  char *tmp = store_file(dir, STORE_COMPACT ".tmp");
+  if (merge) {
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+      store_error("cannot write", tmp);
+    }
+    idx_merge(segs, (const unsigned char *const *) drop, n, Memory, Threads,
+        Compress, f);
+    file_close(f, tmp);
+  }
+  store_segments_free(segs, drop, n);
+
+  if (merge || st.nrecs > (size_t) n) {
+    // the manifest was only appended to meanwhile
+    struct store now;
+    fd = store_lock(dir, LOCK_EX);
+    manifest_read(&now, dir);
+    if (now.nrecs < st.nrecs) {
+      store_error("store changed while compacting", dir);
+    }
+    uint32_t seg = 0;
+    for (size_t r = 0; r < st.nrecs && n == 1 && !merge; r++) {
+      if (st.recs[r].path == NULL) seg = st.recs[r].seg;
+    }
+    if (merge) {
+      char *fname = store_segment(dir, seg = now.next);
+      if (rename(tmp, fname) != 0) {
+        store_error("cannot write", fname);
+      }
+      free(fname);
+    }
+    manifest_replace(dir, seg, &now, st.nrecs);
+    (void) close(fd);
+    store_free(&now);
+  }
+  if (merge) {
+    // readers opening the old segments hold the lock, and have them mapped
+    for (size_t r = 0; r < st.nrecs; r++) {
+      if (st.recs[r].path != NULL) continue;
+      char *fname = store_segment(dir, st.recs[r].seg);
+      (void) unlink(fname);
+      free(fname);
+    }
+  }
+  store_free(&st);
+  free(tmp);
+  free(lock);
+  (void) close(cfd);
+  return 0;
+}
+
+
+/**
+ * Copy the file src to dst.
+ */
+static void file_copy(const char *src, const char *dst)
+{
+  FILE *in = fopen(src, "r"), *out = fopen(dst, "w");
+  if (in == NULL) {
+    store_error("cannot open", src);
+  }
+  if (out == NULL) {
+    store_error("cannot write", dst);
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof buf, in)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) {
+      store_error("cannot write", dst);
+    }
+  }
+  if (ferror(in)) {
+    store_error("error reading", src);
+  }
+  (void) fclose(in);
+  file_close(out, dst);
+}
+
+
+/**
+ * Add the index in file fname as a new segment, replacing the files it
+ * holds, and create the store if needed.  Return the number of segments.
+ */
+static uint32_t add(const char *dir, const char *fname)
+{
+  struct idx_file ix;
+  if (idx_open(&ix, fname) != 0) {
+    store_error("error reading", fname);
+  }
+  store_create(dir);
+
+  // the tombstones for its files, followed by the segment
+  char *buf = idx_path_buf(&ix);
+  size_t len = 0, cap = 64;
+  for (uint32_t i = 0; i < ix.path_cnt; i++) {
+    cap += strlen(idx_path(&ix, i, buf)) + 5;
+  }
+  char *text = malloc(cap);
+  if (text == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (uint32_t i = 0; i < ix.path_cnt; i++) {
+    len += snprintf(text + len, cap - len, "del %s\n",
+        idx_path(&ix, i, buf));
+  }
+  free(buf);
+  idx_close(&ix);
+
+  // copied before the store is locked, under a name of its own
+  char name[64];
+  (void) snprintf(name, sizeof name, "add-%ld.tmp", (long) getpid());
+  char *tmp = store_file(dir, name);
+  file_copy(fname, tmp);
+
+  struct store st;
+  int fd = store_lock(dir, LOCK_EX);
+  manifest_read(&st, dir);
+  char *seg = store_segment(dir, st.next);
+  if (rename(tmp, seg) != 0) {
+    store_error("cannot write", seg);
+  }
+  len += snprintf(text + len, cap - len, "seg %u\n", (unsigned) st.next);
+  manifest_append(dir, text, len);
+  (void) close(fd);
+
+  uint32_t nsegs = st.nsegs + 1;
+  store_free(&st);
+  free(seg);
+  free(tmp);
+  free(text);
+  return nsegs;
+}
+
+
+/**
+ * Record tombstones for the n paths.
+ */
+static void delete(const char *dir, char **paths, int n)
+{
+  size_t len = 0, cap = 1;
+  for (int i = 0; i < n; i++) {
+    if (paths[i][0] == '\0' || strchr(paths[i], '\n') != NULL) usage();
+    cap += strlen(paths[i]) + 5;
+  }
+  char *text = malloc(cap);
+  if (text == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (int i = 0; i < n; i++) {
+    len += snprintf(text + len, cap - len, "del %s\n", paths[i]);
+  }
+  int fd = store_lock(dir, LOCK_EX);
+  manifest_append(dir, text, len);
+  (void) close(fd);
+  free(text);
+}
+
+
+/**
+ * Print each segment with its number of files, live files and hashes.
+ */
+static void list(const char *dir)
+{
+  struct store st;
+  struct idx_file *segs;
+  unsigned char **drop;
+  int fd = store_lock(dir, LOCK_SH);
+  manifest_read(&st, dir);
+  int n = store_segments(&st, &segs, &drop);
+  if (n < 0) {
+    store_error("error reading store", dir);
+  }
+  (void) close(fd);
+
+  int k = 0;
+  for (size_t r = 0; r < st.nrecs; r++) {
+    if (st.recs[r].path != NULL) continue;
+    uint32_t live = 0;
+    for (uint32_t f = 0; f < segs[k].path_cnt; f++) {
+      if (drop[k] == NULL || !drop[k][f]) live++;
+    }
+    if (printf("%u.sig: %u files, %u live, %u hashes\n",
+          (unsigned) st.recs[r].seg, (unsigned) segs[k].path_cnt,
+          (unsigned) live, (unsigned) segs[k].count - 1) < 0) {
+      error_exit("cannot print result");
+    }
+    k++;
+  }
+  store_segments_free(segs, drop, n);
+  store_free(&st);
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt_a=0, opt_c=0, opt_d=0, opt_l=0, opt_m=0, opt_j=0, opt_M=0;
+  int max_segments = DEFAULT_MAX_SEGMENTS;
+  const char *index = NULL;
+  int c;
+
+  if (argc > 0) program_name = argv[0];
+
+  while ((c = getopt(argc, argv, "a:cdj:lm:M:z")) != -1) {
+    switch (c) {
+      case 'a':
+        if (opt_a++ > 0) usage();
+        index = optarg;
+        break;
+      case 'c':
+        if (opt_c++ > 0) usage();
+        break;
+      case 'd':
+        if (opt_d++ > 0) usage();
+        break;
+      case 'j':
+        if (opt_j++ > 0) usage();
+        Threads = parse_num(optarg);
+        if (Threads <= 0)
+          usage();
+        break;
+      case 'l':
+        if (opt_l++ > 0) usage();
+        break;
+      case 'm':
+        if (opt_m++ > 0) usage();
+        max_segments = parse_num(optarg);
+        if (max_segments < 0)
+          usage();
+        break;
+      case 'M':
+        if (opt_M++ > 0) usage();
+        Memory = parse_size(optarg);
+        if (Memory == 0)
+          usage();
+        break;
+      case 'z':
+        if (Compress++ > 0) usage();
+        break;
+      case '?':
+      default:
+        usage();
+    }
+  }
+  // exactly one action on a store
+  if (opt_a + opt_c + opt_d + opt_l != 1) usage();
+  if (argc - optind < 1) usage();
+  if (!opt_d && argc - optind != 1) usage();
+  if (opt_m && !opt_a) usage();
+  if ((opt_d || opt_l) && (opt_j || opt_M || Compress)) usage();
+  const char *dir = argv[optind];
+
+  if (opt_a) {
+    uint32_t nsegs = add(dir, index);
+    // compact in a child, which the caller need not wait for
+    if (max_segments > 0 && nsegs > (uint32_t) max_segments) {
+      (void) fflush(NULL);
+      pid_t pid = fork();
+      if (pid == -1) {
+        error_exit("cannot fork");
+      }
+      if (pid == 0) {
+        (void) compact(dir);
+      }
+    }
+    exit(EXIT_SUCCESS);
+  }
+
+  if (!store_exists(dir)) {
+    store_error("no store", dir);
+  }
+  if (opt_d) {
+    if (argc - optind < 2) usage();
+    delete(dir, &argv[optind + 1], argc - optind - 1);
+  } else if (opt_c) {
+    if (compact(dir) != 0) {
+      store_error("compaction running in", dir);
+    }
+  } else {
+    list(dir);
+  }
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,448 @@
+/**
+ * Reading corpus stores.
+ *
+ * The segments of a manifest are opened with the manifest locked, so a
+ * compaction cannot remove them meanwhile, and the files of each segment
+ * deleted by a later tombstone are found.  The segments are read in place:
+ * the hashes of deleted files are marked by their input positions, and
+ * skipped while the sorted hashes of the segments are merged on the fly,
+ * so opening a store takes time in the size of its deleted files only.
+ * The segments are few, as a store is compacted once it has more than
+ * fpcc-store -m of them, so the next hash is found by a linear scan.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "storeio.h"
+
+
+char *store_file(const char *dir, const char *name)
+{
+  size_t len = strlen(dir) + strlen(name) + 2;
+  char *path = malloc(len);
+  if (path == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  (void) snprintf(path, len, "%s/%s", dir, name);
+  return path;
+}
+
+
+char *store_segment(const char *dir, uint32_t seg)
+{
+  char name[32];
+  (void) snprintf(name, sizeof name, "%u.sig", (unsigned) seg);
+  return store_file(dir, name);
+}
+
+
+int store_exists(const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return 0;
+  char *manifest = store_file(path, STORE_MANIFEST);
+  int res = access(manifest, F_OK) == 0;
+  free(manifest);
+  return res;
+}
+
+
+int store_lock(const char *dir, int op)
+{
+  char *lock = store_file(dir, STORE_LOCK);
+  // readers may not be allowed to create it
+  int fd = open(lock, O_RDONLY | O_CREAT, 0666);
+  if (fd == -1) fd = open(lock, O_RDONLY);
+  free(lock);
+  if (fd == -1) {
+    error_exit("cannot open lock of store");
+  }
+  while (flock(fd, op) == -1) {
+    if (errno != EINTR) {
+      error_exit("cannot lock store");
+    }
+  }
+  return fd;
+}
+
+
+int store_read(struct store *st, const char *dir)
+{
+  memset(st, 0, sizeof *st);
+  char *manifest = store_file(dir, STORE_MANIFEST);
+  FILE *f = fopen(manifest, "r");
+  free(manifest);
+  if (f == NULL) return -1;
+
+  st->dir = strdup(dir);
+  st->next = 1;
+  size_t capacity = 0;
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t len;
+  int res = 0;
+  for (size_t n = 0; (len = getline(&line, &linecap, f)) != -1; n++) {
+    // a record is complete with its newline
+    if (len == 0 || line[len - 1] != '\n') {
+      res = -2;
+      break;
+    }
+    line[len - 1] = '\0';
+    if (n == 0) {
+      if (strcmp(line, STORE_MAGIC) != 0) {
+        res = -2;
+        break;
+      }
+      continue;
+    }
+    if (st->nrecs == capacity) {
+      capacity += 256;
+      struct store_rec *recs = realloc(st->recs,
+          capacity * sizeof(struct store_rec));
+      if (recs == NULL) {
+        error_exit("cannot allocate memory");
+      }
+      st->recs = recs;
+    }
+    struct store_rec *rec = &st->recs[st->nrecs];
+    char *end;
+    if (strncmp(line, "seg ", 4) == 0) {
+      errno = 0;
+      unsigned long seg = strtoul(line + 4, &end, 10);
+      if (errno != 0 || end == line + 4 || *end != '\0' ||
+          seg >= UINT32_MAX) {
+        res = -2;
+        break;
+      }
+      rec->seg = seg;
+      rec->path = NULL;
+      st->nsegs++;
+      if (seg >= st->next) st->next = seg + 1;
+    } else if (strncmp(line, "del ", 4) == 0 && line[4] != '\0') {
+      rec->seg = 0;
+      rec->path = strdup(line + 4);
+    } else {
+      res = -2;
+      break;
+    }
+    st->nrecs++;
+  }
+  if (res == 0 && ferror(f)) res = -1;
+  int err = errno;
+  free(line);
+  (void) fclose(f);
+  if (res != 0) {
+    store_free(st);
+    errno = err;
+  }
+  return res;
+}
+
+
+void store_free(struct store *st)
+{
+  for (size_t i = 0; i < st->nrecs; i++) {
+    free(st->recs[i].path);
+  }
+  free(st->recs);
+  free(st->dir);
+  memset(st, 0, sizeof *st);
+}
+
+
+/**
+ * A set of paths, by open addressing; free slots are NULL.
+ */
+struct path_set {
+  const char **slots;
+  size_t capacity, count;
+};
+
+static size_t path_slot(const struct path_set *set, const char *path)
+{
+  // FNV-1a
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char *p = path; *p != '\0'; p++) {
+    h = (h ^ (unsigned char) *p) * 0x100000001b3ULL;
+  }
+  size_t slot = h & (set->capacity - 1);
+  while (set->slots[slot] != NULL && strcmp(set->slots[slot], path) != 0)
+    slot = (slot + 1) & (set->capacity - 1);
+  return slot;
+}
+
+static int set_has(const struct path_set *set, const char *path)
+{
+  return set->count > 0 && set->slots[path_slot(set, path)] != NULL;
+}
+
+static void set_add(struct path_set *set, const char *path)
+{
+  if (2 * (set->count + 1) > set->capacity) {
+    // rehash into a table of twice the size
+    struct path_set old = *set;
+    set->capacity = old.capacity > 0 ? 2 * old.capacity : 64;
+    set->slots = calloc(set->capacity, sizeof(const char *));
+    if (set->slots == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    for (size_t i = 0; i < old.capacity; i++) {
+      if (old.slots[i] != NULL)
+        set->slots[path_slot(set, old.slots[i])] = old.slots[i];
+    }
+    free(old.slots);
+  }
+  size_t slot = path_slot(set, path);
+  if (set->slots[slot] == NULL) {
+    set->slots[slot] = path;
+    set->count++;
+  }
+}
+
+
+int store_segments(const struct store *st, struct idx_file **segs,
+    unsigned char ***drop)
+{
+  int n = st->nsegs;
+  *segs = calloc(n > 0 ? n : 1, sizeof(struct idx_file));
+  *drop = calloc(n > 0 ? n : 1, sizeof(unsigned char *));
+  if (*segs == NULL || *drop == NULL) {
+    error_exit("cannot allocate memory");
+  }
+
+  // from the last record on, collect the tombstones following each segment
+  struct path_set dead = { NULL, 0, 0 };
+  int k = n;
+  for (size_t r = st->nrecs; r-- > 0; ) {
+    const struct store_rec *rec = &st->recs[r];
+    if (rec->path != NULL) {
+      set_add(&dead, rec->path);
+      continue;
+    }
+    struct idx_file *ix = &(*segs)[--k];
+    char *fname = store_segment(st->dir, rec->seg);
+    int res = idx_open(ix, fname);
+    if (res == -1) {
+      int err = errno;
+      free(fname);
+      free(dead.slots);
+      store_segments_free(*segs, *drop, n);
+      errno = err;
+      return -1;
+    }
+    if (res != 0) {
+      char msg[PATH_MAX];
+      (void) snprintf(msg, sizeof msg, "error reading '%s'", fname);
+      error_exit(msg);
+    }
+    free(fname);
+    char *buf = idx_path_buf(ix);
+    for (uint32_t f = 0; f < ix->path_cnt && dead.count > 0; f++) {
+      if (!set_has(&dead, idx_path(ix, f, buf))) continue;
+      if ((*drop)[k] == NULL) {
+        (*drop)[k] = calloc(ix->path_cnt, 1);
+        if ((*drop)[k] == NULL) {
+          error_exit("cannot allocate memory");
+        }
+      }
+      (*drop)[k][f] = 1;
+    }
+    free(buf);
+  }
+  free(dead.slots);
+  return n;
+}
+
+
+void store_segments_free(struct idx_file *segs, unsigned char **drop,
+    int n)
+{
+  for (int k = 0; k < n; k++) {
+    idx_close(&segs[k]);
+    free(drop[k]);
+  }
+  free(segs);
+  free(drop);
+}
+
+
+/**
+ * Mark the hashes of the files of segment k dropped, and return their
+ * number.
+ */
+static uint32_t mark_dead(struct store_view *sv, int k)
+{
+  const struct idx_file *ix = &sv->segs[k];
+  uint32_t ndead = 0;
+  sv->dead[k] = calloc((ix->count + 63) / 64, sizeof(uint64_t));
+  if (sv->dead[k] == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  for (uint32_t f = 0; f < ix->path_cnt; f++) {
+    if (!sv->drop[k][f]) continue;
+    uint32_t end = f + 1 < ix->path_cnt ? ix->first[f + 1] : ix->count;
+    for (uint32_t seq = ix->first[f]; seq < end; seq++) {
+      sv->dead[k][seq / 64] |= (uint64_t) 1 << seq % 64;
+    }
+    ndead += end - ix->first[f];
+  }
+  return ndead;
+}
+
+
+int store_open(struct store_view *sv, const char *path)
+{
+  memset(sv, 0, sizeof *sv);
+  int n;
+  if (!store_exists(path)) {
+    struct idx_file ix;
+    int res = idx_open(&ix, path);
+    if (res != 0) return res;
+    sv->segs = malloc(sizeof(struct idx_file));
+    sv->drop = calloc(1, sizeof(unsigned char *));
+    if (sv->segs == NULL || sv->drop == NULL) {
+      error_exit("cannot allocate memory");
+    }
+    sv->segs[0] = ix;
+    n = 1;
+  } else {
+    // the segments are opened while the manifest is locked
+    struct store st;
+    int fd = store_lock(path, LOCK_SH);
+    n = store_read(&st, path);
+    if (n == 0) {
+      n = store_segments(&st, &sv->segs, &sv->drop);
+      store_free(&st);
+    }
+    int err = errno;
+    (void) close(fd);
+    errno = err;
+    if (n < 0) return n;
+  }
+
+  sv->nsegs = n;
+  sv->dead = calloc(n > 0 ? n : 1, sizeof(uint64_t *));
+  if (sv->dead == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  uint64_t count = 1;
+  for (int k = 0; k < n; k++) {
+    count += sv->segs[k].count - 1;
+    if (sv->drop[k] != NULL) count -= mark_dead(sv, k);
+    if (sv->segs[k].path_max > sv->path_max)
+      sv->path_max = sv->segs[k].path_max;
+  }
+  if (count > UINT32_MAX) {
+    error_exit("too many hashes for index");
+  }
+  sv->count = count;
+  return 0;
+}
+
+
+void store_close(struct store_view *sv)
+{
+  for (int k = 0; k < sv->nsegs; k++) {
+    free(sv->dead[k]);
+  }
+  free(sv->dead);
+  store_segments_free(sv->segs, sv->drop, sv->nsegs);
+  memset(sv, 0, sizeof *sv);
+}
+
+
+char *store_path_buf(const struct store_view *sv)
+{
+  char *buf = malloc(sv->path_max + 1);
+  if (buf == NULL) {
+    error_exit("cannot allocate memory");
+  }
+  return buf;
+}
+
+
+/**
+ * Skip the dropped hashes of segment k from its next position on, and
+ * take the hash there.
+ */
+static void iter_skip(struct store_iter *it, int k)
+{
+  const struct idx_file *ix = &it->sv->segs[k];
+  uint32_t p = it->pos[k];
+  if (it->sv->dead[k] != NULL) {
+    while (p < ix->count && store_dead(it->sv, k, idx_seq(ix, p))) p++;
+  }
+  it->pos[k] = p;
+  if (p < ix->count) it->head[k] = idx_hash(ix, p);
+}
+
+
+void store_iter_init(struct store_iter *it, const struct store_view *sv)
+{
+  it->sv = sv;
+  if (sv->nsegs <= 1) {
+    it->pos = &it->pos1;
+    it->head = &it->head1;
+  } else {
+    it->pos = malloc(sv->nsegs * sizeof(uint32_t));
+    it->head = malloc(sv->nsegs * sizeof(hash_t));
+    if (it->pos == NULL || it->head == NULL) {
+      error_exit("cannot allocate memory");
+    }
+  }
+  // after the dummy entries
+  for (int k = 0; k < sv->nsegs; k++) {
+    it->pos[k] = 1;
+    iter_skip(it, k);
+  }
+  it->seg = -1;
+  it->i = 0;
+  it->hash = 0;
+}
+
+
+void store_iter_free(struct store_iter *it)
+{
+  if (it->pos != &it->pos1) {
+    free(it->pos);
+    free(it->head);
+  }
+}
+
+
+int store_iter_next(struct store_iter *it)
+{
+  // the least hash, of the first segment holding it
+  int best = -1;
+  for (int k = 0; k < it->sv->nsegs; k++) {
+    if (it->pos[k] >= it->sv->segs[k].count) continue;
+    if (best < 0 || it->head[k] < it->head[best]) best = k;
+  }
+  if (best < 0) return 0;
+  it->seg = best;
+  it->i = it->pos[best]++;
+  it->hash = it->head[best];
+  iter_skip(it, best);
+  return 1;
+}
+
+
+int store_iter_seek(struct store_iter *it, hash_t h)
+{
+  for (int k = 0; k < it->sv->nsegs; k++) {
+    const struct idx_file *ix = &it->sv->segs[k];
+    if (it->pos[k] >= ix->count || it->head[k] >= h) continue;
+    it->pos[k] = idx_seek(ix, it->pos[k] + 1, h);
+    iter_skip(it, k);
+  }
+  return store_iter_next(it);
+}
@@ -0,0 +1,170 @@
+#ifndef _STOREIO_H_
+#define _STOREIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "idxfile.h"
+
+/*
+ * Corpus stores: a directory of indices, the segments, with a manifest of
+ * them and of the files deleted, shared by fpcc-store and the tools
+ * reading indices.
+ *
+ * The manifest, STORE_MANIFEST in the directory, starts with the line
+ * STORE_MAGIC, followed by one record per line, in the order they were
+ * made:
+ *
+ *   seg N      the segment in file N.sig of the directory
+ *   del PATH   a tombstone: file PATH is deleted from the segments before
+ *
+ * A file of a segment is live unless a tombstone for its path follows the
+ * segment.  A segment is added after tombstones for its files, so it
+ * replaces their older versions.
+ *
+ * The manifest is appended to, or replaced by a compaction, while the lock
+ * file STORE_LOCK is locked exclusively, and read while it is locked
+ * shared.  Segments are only removed after a compaction replaced them in
+ * the manifest.
+ */
+
+#define STORE_MAGIC    "fpcc-store 1"
+#define STORE_MANIFEST "MANIFEST"
+#define STORE_LOCK     "LOCK"
+
+/**
+ * A record of the manifest: a segment, or a tombstone for path.
+ */
+struct store_rec {
+  uint32_t seg;
+  char *path;  // NULL for a segment
+};
+
+/**
+ * A manifest as read.
+ */
+struct store {
+  char *dir;
+  struct store_rec *recs;
+  size_t nrecs;
+  uint32_t nsegs;
+  uint32_t next;  // number of the next segment
+};
+
+/**
+ * Whether path is a store, i.e. a directory with a manifest.
+ */
+int store_exists(const char *path);
+
+/**
+ * Lock the store in directory dir, shared or exclusively with op like
+ * flock(2).  Return the file descriptor to close for unlocking; exit on
+ * error.
+ */
+int store_lock(const char *dir, int op);
+
+/**
+ * Read the manifest of the store in directory dir, which must be locked.
+ * Return 0 on success, -1 if it cannot be read, with errno set, and -2 if
+ * it is not a manifest.
+ */
+int store_read(struct store *st, const char *dir);
+
+void store_free(struct store *st);
+
+/**
+ * The path of file name in directory dir, to be freed by the caller.
+ */
+char *store_file(const char *dir, const char *name);
+
+/**
+ * The path of segment seg in directory dir, to be freed by the caller.
+ */
+char *store_segment(const char *dir, uint32_t seg);
+
+/**
+ * Open the segments of a manifest as read, in the order of the manifest,
+ * with which of their files are dropped by tombstones; drop[k] is NULL if
+ * none.  Return the number of segments, or -1 if one cannot be opened, as
+ * it was compacted meanwhile, with errno set; exit on other errors.
+ */
+int store_segments(const struct store *st, struct idx_file **segs,
+    unsigned char ***drop);
+
+void store_segments_free(struct idx_file *segs, unsigned char **drop,
+    int n);
+
+/**
+ * A store opened for reading: its segments in the order of the manifest,
+ * used in place, with the hashes of the files dropped by tombstones.  The
+ * live hashes are read as the index they would be merged into, with
+ * store_iter.  An index file is opened as a store of one segment.
+ */
+struct store_view {
+  int nsegs;
+  struct idx_file *segs;
+  unsigned char **drop;  // whether each file of each segment is dropped,
+                         // or NULL if none
+  uint64_t **dead;       // whether the hash at each input position of each
+                         // segment is dropped, or NULL if none
+  uint32_t count;        // number of live hashes, with one dummy entry
+  uint32_t path_max;     // length of the longest path of the segments
+};
+
+/**
+ * Open the index or store at path.  Return like idx_open().
+ */
+int store_open(struct store_view *sv, const char *path);
+
+void store_close(struct store_view *sv);
+
+/**
+ * Whether the hash at input position seq of segment k is dropped.
+ */
+static inline int store_dead(const struct store_view *sv, int k,
+    uint32_t seq)
+{
+  return sv->dead[k] != NULL && (sv->dead[k][seq / 64] >> seq % 64 & 1);
+}
+
+/**
+ * A buffer for the paths of all segments, to be freed by the caller.
+ */
+char *store_path_buf(const struct store_view *sv);
+
+/**
+ * An iterator over the live hashes of a store in sorted order, equal
+ * hashes in the order of the segments, as in the index the live files
+ * would be merged into.  The current hash is at position i of segment
+ * seg.
+ */
+struct store_iter {
+  const struct store_view *sv;
+  uint32_t *pos;    // the next live position of each segment
+  hash_t *head;     // and its hash
+  int seg;
+  uint32_t i;
+  hash_t hash;
+  uint32_t pos1;    // for a single segment, not to allocate
+  hash_t head1;
+};
+
+/**
+ * Start an iterator before the first hash of sv.
+ */
+void store_iter_init(struct store_iter *it, const struct store_view *sv);
+
+void store_iter_free(struct store_iter *it);
+
+/**
+ * Move to the next hash.  Return 0 if there is none.
+ */
+int store_iter_next(struct store_iter *it);
+
+/**
+ * Move to the first hash after the current one that is not less than h,
+ * skipping them with idx_seek().  Return 0 if there is none.
+ */
+int store_iter_seek(struct store_iter *it, hash_t h);
+
+#endif // _STOREIO_H_
@@ -0,0 +1,617 @@
+/**
+ * A hand-written C tokenizer.
+ *
+ * It implements the same rules as the flex scanner in ccode.lex, including
+ * its longest-match semantics, and returns the same token IDs and line
+ * numbers.  Comments, whitespace, preprocessor lines and string literals
+ * are skipped with SSE2 when available, and keywords are recognized with
+ * a perfect hash instead of a state machine.
+ *
+ * To compare both on a corpus, build the token dumpers
+ *   flex -o lex.yy.c ccode.lex && gcc -DLEXMAIN -o lexmain lex.yy.c
+ *   gcc -DTOKMAIN -o tokmain tokenize.c -lpthread
+ * and diff their output, see misc/tokdiff.sh.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tokenize.h"
+#include "ccode.tab.h"
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Keywords
+///////////////////////////////////////////////////////////////////////////////
+
+static const struct keyword {
+  const char *name;
+  int tok;
+} keywords[] = {
+  {"auto", AUTO}, {"break", BREAK}, {"case", CASE}, {"char", CHAR},
+  {"const", CONST}, {"continue", CONTINUE}, {"default", DEFAULT},
+  {"do", DO}, {"double", DOUBLE}, {"else", ELSE}, {"enum", ENUM},
+  {"extern", EXTERN}, {"float", FLOAT}, {"for", FOR}, {"goto", GOTO},
+  {"if", IF}, {"inline", INLINE}, {"int", INT}, {"long", LONG},
+  {"register", REGISTER}, {"restrict", RESTRICT}, {"return", RETURN},
+  {"short", SHORT}, {"signed", SIGNED}, {"sizeof", SIZEOF},
+  {"static", STATIC}, {"struct", STRUCT}, {"switch", SWITCH},
+  {"typedef", TYPEDEF}, {"union", UNION}, {"unsigned", UNSIGNED},
+  {"void", VOID}, {"volatile", VOLATILE}, {"while", WHILE},
+  {"_Alignas", ALIGNAS}, {"_Alignof", ALIGNOF}, {"_Atomic", ATOMIC},
+  {"_Bool", BOOL}, {"_Complex", COMPLEX}, {"_Generic", GENERIC},
+  {"_Imaginary", IMAGINARY}, {"_Noreturn", NORETURN},
+  {"_Static_assert", STATIC_ASSERT}, {"_Thread_local", THREAD_LOCAL},
+  {"__func__", FUNC_NAME},
+};
+
+#define KW_MINLEN 2
+#define KW_MAXLEN 14
+#define KW_SLOTS 128
+
+/*
+ * A perfect hash over the keywords, found by search: the length,
+ * the first two and the last character determine the slot.
+ */
+#define KW_HASH(s, len) \
+  (((len) + 13 * (unsigned char)(s)[0] + (unsigned char)(s)[1] + \
+    15 * (unsigned char)(s)[(len) - 1]) % KW_SLOTS)
+
+static const struct keyword *kwtable[KW_SLOTS];
+static pthread_once_t kwtable_once = PTHREAD_ONCE_INIT;
+
+static void kwtable_init(void)
+{
+  for (size_t i = 0; i < sizeof keywords / sizeof keywords[0]; i++) {
+    const char *name = keywords[i].name;
+    unsigned h = KW_HASH(name, strlen(name));
+    assert(kwtable[h] == NULL); // the hash is perfect
+    kwtable[h] = &keywords[i];
+  }
+}
+
+/**
+ * Return the token of an identifier s of length len.
+ */
+static int keyword(const char *s, size_t len)
+{
+  if (len < KW_MINLEN || len > KW_MAXLEN) return IDENTIFIER;
+  const struct keyword *kw = kwtable[KW_HASH(s, len)];
+  if (kw != NULL && strncmp(kw->name, s, len) == 0 && kw->name[len] == '\0')
+    return kw->tok;
+  return IDENTIFIER;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Character classes
+///////////////////////////////////////////////////////////////////////////////
+
+enum {
+  C_L  = 1,  // [a-zA-Z_]
+  C_D  = 2,  // [0-9]
+  C_H  = 4,  // [a-fA-F0-9]
+  C_O  = 8,  // [0-7]
+  C_WS = 16, // [ \t\v\n\f]
+};
+
+static const unsigned char cclass[256] = {
+  ['\t'] = C_WS, ['\n'] = C_WS, ['\v'] = C_WS, ['\f'] = C_WS, [' '] = C_WS,
+  ['0'] = C_D|C_H|C_O, ['1'] = C_D|C_H|C_O, ['2'] = C_D|C_H|C_O,
+  ['3'] = C_D|C_H|C_O, ['4'] = C_D|C_H|C_O, ['5'] = C_D|C_H|C_O,
+  ['6'] = C_D|C_H|C_O, ['7'] = C_D|C_H|C_O, ['8'] = C_D|C_H,
+  ['9'] = C_D|C_H,
+  ['A'] = C_L|C_H, ['B'] = C_L|C_H, ['C'] = C_L|C_H, ['D'] = C_L|C_H,
+  ['E'] = C_L|C_H, ['F'] = C_L|C_H, ['G'] = C_L, ['H'] = C_L, ['I'] = C_L,
+  ['J'] = C_L, ['K'] = C_L, ['L'] = C_L, ['M'] = C_L, ['N'] = C_L,
+  ['O'] = C_L, ['P'] = C_L, ['Q'] = C_L, ['R'] = C_L, ['S'] = C_L,
+  ['T'] = C_L, ['U'] = C_L, ['V'] = C_L, ['W'] = C_L, ['X'] = C_L,
+  ['Y'] = C_L, ['Z'] = C_L, ['_'] = C_L,
+  ['a'] = C_L|C_H, ['b'] = C_L|C_H, ['c'] = C_L|C_H, ['d'] = C_L|C_H,
+  ['e'] = C_L|C_H, ['f'] = C_L|C_H, ['g'] = C_L, ['h'] = C_L, ['i'] = C_L,
+  ['j'] = C_L, ['k'] = C_L, ['l'] = C_L, ['m'] = C_L, ['n'] = C_L,
+  ['o'] = C_L, ['p'] = C_L, ['q'] = C_L, ['r'] = C_L, ['s'] = C_L,
+  ['t'] = C_L, ['u'] = C_L, ['v'] = C_L, ['w'] = C_L, ['x'] = C_L,
+  ['y'] = C_L, ['z'] = C_L,
+};
+
+#define IS(c, cls) (cclass[(unsigned char)(c)] & (cls))
+
+/**
+ * Number of characters of class cls at the start of s.
+ * The zero padding stops the scan at the end of the input.
+ */
+static size_t span(const char *s, int cls)
+{
+  size_t n = 0;
+  while (IS(s[n], cls)) n++;
+  return n;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Scans over comments, whitespace, lines and strings
+///////////////////////////////////////////////////////////////////////////////
+
+#ifdef __SSE2__
+static inline __m128i load16(const char *p)
+{
+  return _mm_loadu_si128((const __m128i *) p);
+}
+
+static inline unsigned mask_eq(__m128i v, char c)
+{
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+#endif
+
+/**
+ * Skip whitespace, counting newlines.
+ */
+static void skip_ws(struct tokenizer *t)
+{
+  const char *p = t->p;
+#ifdef __SSE2__
+  while (p + 16 <= t->end) {
+    __m128i v = load16(p);
+    unsigned nl = mask_eq(v, '\n');
+    unsigned ws = nl | mask_eq(v, ' ') | mask_eq(v, '\t') |
+      mask_eq(v, '\v') | mask_eq(v, '\f');
+    if (ws != 0xffff) {
+      // only up to the first non-whitespace character
+      unsigned n = __builtin_ctz(~ws);
+      t->lineno += __builtin_popcount(nl & ((1u << n) - 1));
+      t->p = p + n;
+      return;
+    }
+    t->lineno += __builtin_popcount(nl);
+    p += 16;
+  }
+#endif
+  for (; p < t->end && IS(*p, C_WS); p++) {
+    if (*p == '\n') t->lineno++;
+  }
+  t->p = p;
+}
+
+/**
+ * Skip to the end of the line, excluding the newline.
+ */
+static void skip_line(struct tokenizer *t)
+{
+  const char *p = t->p;
+#ifdef __SSE2__
+  while (p + 16 <= t->end) {
+    unsigned nl = mask_eq(load16(p), '\n');
+    if (nl != 0) {
+      t->p = p + __builtin_ctz(nl);
+      return;
+    }
+    p += 16;
+  }
+#endif
+  while (p < t->end && *p != '\n') p++;
+  t->p = p;
+}
+
+/**
+ * Skip the body of a block comment including the closing delimiter,
+ * counting newlines.  An unterminated comment extends to the end.
+ */
+static void skip_comment(struct tokenizer *t)
+{
+  const char *p = t->p;
+  for (;;) {
+#ifdef __SSE2__
+    // find the next '*', counting the newlines before it
+    while (p + 16 <= t->end) {
+      __m128i v = load16(p);
+      unsigned star = mask_eq(v, '*');
+      unsigned nl = mask_eq(v, '\n');
+      if (star != 0) {
+        unsigned n = __builtin_ctz(star);
+        t->lineno += __builtin_popcount(nl & ((1u << n) - 1));
+        p += n;
+        break;
+      }
+      t->lineno += __builtin_popcount(nl);
+      p += 16;
+    }
+#endif
+    while (p < t->end && *p != '*') {
+      if (*p == '\n') t->lineno++;
+      p++;
+    }
+    if (p >= t->end) break;
+    // at a '*'
+    p++;
+    if (p < t->end && *p == '/') {
+      p++;
+      break;
+    }
+  }
+  t->p = p < t->end ? p : t->end;
+}
+
+/**
+ * Length of an escape sequence at s (starting with a backslash), or 0 if
+ * there is no valid one:  \\(['"\?\\abfnrtv]|[0-7]{1,3}|x[a-fA-F0-9]+)
+ */
+static size_t escape(const char *s)
+{
+  switch (s[1]) {
+    case '\'': case '"': case '?': case '\\':
+    case 'a': case 'b': case 'f': case 'n': case 'r': case 't': case 'v':
+      return 2;
+    case 'x': {
+      size_t n = span(s + 2, C_H);
+      return n > 0 ? 2 + n : 0;
+    }
+    default:
+      if (IS(s[1], C_O)) {
+        size_t n = 2;
+        while (n < 4 && IS(s[n], C_O)) n++;
+        return n;
+      }
+      return 0;
+  }
+}
+
+/**
+ * Match the quoted part of a character constant or string literal at s:
+ * the quote q, one or more (at least min) characters or escapes, and the
+ * closing quote.  Return the end of the match or NULL.
+ */
+static const char *quoted(const char *s, const char *end, char q, int min)
+{
+  const char *p = s + 1;
+  int items = 0;
+  for (;;) {
+#ifdef __SSE2__
+    // skip plain characters
+    while (p + 16 <= end) {
+      __m128i v = load16(p);
+      unsigned stop = mask_eq(v, q) | mask_eq(v, '\\') | mask_eq(v, '\n');
+      if (stop != 0) {
+        unsigned n = __builtin_ctz(stop);
+        items += n;
+        p += n;
+        break;
+      }
+      items += 16;
+      p += 16;
+    }
+#endif
+    if (p >= end || *p == '\n') return NULL;
+    if (*p == q) return items >= min ? p + 1 : NULL;
+    if (*p == '\\') {
+      size_t n = escape(p);
+      if (n == 0 || p + n > end) return NULL;
+      p += n;
+    } else {
+      p++;
+    }
+    items++;
+  }
+}
+
+/**
+ * Length of a string literal prefix at s (u8|u|U|L) if followed by a quote.
+ */
+static size_t string_prefix(const char *s)
+{
+  if (s[0] == 'u' && s[1] == '8') return s[2] == '"' ? 2 : 0;
+  if (s[0] == 'u' || s[0] == 'U' || s[0] == 'L') return s[1] == '"' ? 1 : 0;
+  return 0;
+}
+
+/**
+ * Match a sequence of string literals, each followed by whitespace:
+ * ({SP}?\"([^"\\\n]|{ES})*\"{WS}*)+
+ * On success, advance the tokenizer past it and return 1.
+ */
+static int string(struct tokenizer *t, const char *s)
+{
+  int lineno = t->lineno;
+  const char *p = s, *mend = NULL;
+  for (;;) {
+    const char *q = p + string_prefix(p);
+    if (q >= t->end || *q != '"') break;
+    if ((q = quoted(q, t->end, '"', 0)) == NULL) break;
+    struct tokenizer ws = {q, t->end, lineno};
+    skip_ws(&ws);
+    p = mend = ws.p;
+    lineno = ws.lineno;
+  }
+  if (mend == NULL) return 0;
+  t->p = mend;
+  t->lineno = lineno;
+  return 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Numbers
+///////////////////////////////////////////////////////////////////////////////
+
+// ([Ee][+-]?{D}+) and ([Pp][+-]?{D}+)
+static size_t exponent(const char *s, char e)
+{
+  if (s[0] != e && s[0] != e - 'a' + 'A') return 0;
+  size_t n = (s[1] == '+' || s[1] == '-') ? 2 : 1;
+  size_t d = span(s + n, C_D);
+  return d > 0 ? n + d : 0;
+}
+
+// (f|F|l|L)
+static size_t float_suffix(const char *s)
+{
+  return (s[0] == 'f' || s[0] == 'F' || s[0] == 'l' || s[0] == 'L');
+}
+
+// (((u|U)(l|L|ll|LL)?)|((l|L|ll|LL)(u|U)?))
+static size_t int_suffix(const char *s)
+{
+  if (s[0] == 'u' || s[0] == 'U') {
+    if (s[1] == 'l' || s[1] == 'L') return s[2] == s[1] ? 3 : 2;
+    return 1;
+  }
+  if (s[0] == 'l' || s[0] == 'L') {
+    size_t n = s[1] == s[0] ? 2 : 1;
+    return (s[n] == 'u' || s[n] == 'U') ? n + 1 : n;
+  }
+  return 0;
+}
+
+/**
+ * Match the longest integer or floating constant at s, which starts with
+ * a digit, or a dot followed by a digit.  On equal length, the integer
+ * rules take precedence as they do in the scanner.
+ */
+static int number(const char *s, size_t *len)
+{
+  size_t best = 0, n, e;
+  int tok = 0;
+#define CANDIDATE(l, t) \
+  do { if ((l) > best) { best = (l); tok = (t); } } while (0)
+
+  int hex = s[0] == '0' && (s[1] == 'x' || s[1] == 'X');
+  size_t h1 = hex ? span(s + 2, C_H) : 0;
+  size_t d1 = span(s, C_D);
+
+  // {HP}{H}+{IS}?
+  if (h1 > 0) CANDIDATE(2 + h1 + int_suffix(s + 2 + h1), I_CONSTANT);
+  // {NZ}{D}*{IS}?
+  if (s[0] >= '1' && s[0] <= '9')
+    CANDIDATE(d1 + int_suffix(s + d1), I_CONSTANT);
+  // "0"{O}*{IS}?
+  if (s[0] == '0') {
+    n = 1 + span(s + 1, C_O);
+    CANDIDATE(n + int_suffix(s + n), I_CONSTANT);
+  }
+
+  // {D}+{E}{FS}?
+  if (d1 > 0 && (e = exponent(s + d1, 'e')) > 0) {
+    n = d1 + e;
+    CANDIDATE(n + float_suffix(s + n), F_CONSTANT);
+  }
+  if (s[d1] == '.') {
+    // {D}*"."{D}+{E}?{FS}?
+    size_t d2 = span(s + d1 + 1, C_D);
+    if (d2 > 0) {
+      n = d1 + 1 + d2;
+      n += exponent(s + n, 'e');
+      CANDIDATE(n + float_suffix(s + n), F_CONSTANT);
+    }
+    // {D}+"."{E}?{FS}?
+    if (d1 > 0) {
+      n = d1 + 1;
+      n += exponent(s + n, 'e');
+      CANDIDATE(n + float_suffix(s + n), F_CONSTANT);
+    }
+  }
+  if (hex) {
+    // {HP}{H}+{P}{FS}?
+    if (h1 > 0 && (e = exponent(s + 2 + h1, 'p')) > 0) {
+      n = 2 + h1 + e;
+      CANDIDATE(n + float_suffix(s + n), F_CONSTANT);
+    }
+    if (s[2 + h1] == '.') {
+      // {HP}{H}*"."{H}+{P}{FS}?
+      size_t h2 = span(s + 3 + h1, C_H);
+      if (h2 > 0 && (e = exponent(s + 3 + h1 + h2, 'p')) > 0) {
+        n = 3 + h1 + h2 + e;
+        CANDIDATE(n + float_suffix(s + n), F_CONSTANT);
+      }
+      // {HP}{H}+"."{P}{FS}?
+      if (h1 > 0 && (e = exponent(s + 3 + h1, 'p')) > 0) {
+        n = 3 + h1 + e;
+        CANDIDATE(n + float_suffix(s + n), F_CONSTANT);
+      }
+    }
+  }
+#undef CANDIDATE
+  *len = best;
+  return tok;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Tokens
+///////////////////////////////////////////////////////////////////////////////
+
+void tok_init(struct tokenizer *t, const char *buf, size_t len)
+{
+  (void) pthread_once(&kwtable_once, kwtable_init);
+  t->p = buf;
+  t->end = buf + len;
+  t->lineno = 1;
+}
+
+
+int tok_next(struct tokenizer *t)
+{
+  const char *p, *q;
+  size_t n;
+  int tok;
+
+  // return the token tok of length len
+#define TOKEN(tok, len) do { t->p = p + (len); return (tok); } while (0)
+
+  while ((p = t->text = t->p) < t->end) {
+    switch (*p) {
+      case ' ': case '\t': case '\n': case '\v': case '\f':
+        skip_ws(t);
+        continue;
+
+      case '#':
+        skip_line(t);
+        continue;
+
+      case '/':
+        if (p[1] == '*') {
+          t->p = p + 2;
+          skip_comment(t);
+          continue;
+        }
+        if (p[1] == '/') {
+          skip_line(t);
+          continue;
+        }
+        if (p[1] == '=') TOKEN(DIV_ASSIGN, 2);
+        TOKEN('/', 1);
+
+      case '0': case '1': case '2': case '3': case '4':
+      case '5': case '6': case '7': case '8': case '9':
+        tok = number(p, &n);
+        TOKEN(tok, n);
+
+      case '.':
+        if (IS(p[1], C_D)) {
+          tok = number(p, &n);
+          TOKEN(tok, n);
+        }
+        if (p[1] == '.' && p[2] == '.') TOKEN(ELLIPSIS, 3);
+        TOKEN('.', 1);
+
+      case '\'':
+        if ((q = quoted(p, t->end, '\'', 1)) != NULL) TOKEN(I_CONSTANT, q - p);
+        t->p = p + 1; // discard bad character
+        continue;
+
+      case '"':
+        if (string(t, p)) return STRING_LITERAL;
+        t->p = p + 1; // discard bad character
+        continue;
+
+      case '>':
+        if (p[1] == '>') {
+          if (p[2] == '=') TOKEN(RIGHT_ASSIGN, 3);
+          TOKEN(RIGHT_OP, 2);
+        }
+        if (p[1] == '=') TOKEN(GE_OP, 2);
+        TOKEN('>', 1);
+      case '<':
+        if (p[1] == '<') {
+          if (p[2] == '=') TOKEN(LEFT_ASSIGN, 3);
+          TOKEN(LEFT_OP, 2);
+        }
+        if (p[1] == '=') TOKEN(LE_OP, 2);
+        if (p[1] == '%') TOKEN('{', 2);
+        if (p[1] == ':') TOKEN('[', 2);
+        TOKEN('<', 1);
+      case '+':
+        if (p[1] == '=') TOKEN(ADD_ASSIGN, 2);
+        if (p[1] == '+') TOKEN(INC_OP, 2);
+        TOKEN('+', 1);
+      case '-':
+        if (p[1] == '=') TOKEN(SUB_ASSIGN, 2);
+        if (p[1] == '-') TOKEN(DEC_OP, 2);
+        if (p[1] == '>') TOKEN(PTR_OP, 2);
+        TOKEN('-', 1);
+      case '*':
+        if (p[1] == '=') TOKEN(MUL_ASSIGN, 2);
+        TOKEN('*', 1);
+      case '%':
+        if (p[1] == '=') TOKEN(MOD_ASSIGN, 2);
+        if (p[1] == '>') TOKEN('}', 2);
+        TOKEN('%', 1);
+      case '&':
+        if (p[1] == '=') TOKEN(AND_ASSIGN, 2);
+        if (p[1] == '&') TOKEN(AND_OP, 2);
+        TOKEN('&', 1);
+      case '^':
+        if (p[1] == '=') TOKEN(XOR_ASSIGN, 2);
+        TOKEN('^', 1);
+      case '|':
+        if (p[1] == '=') TOKEN(OR_ASSIGN, 2);
+        if (p[1] == '|') TOKEN(OR_OP, 2);
+        TOKEN('|', 1);
+      case '=':
+        if (p[1] == '=') TOKEN(EQ_OP, 2);
+        TOKEN('=', 1);
+      case '!':
+        if (p[1] == '=') TOKEN(NE_OP, 2);
+        TOKEN('!', 1);
+      case ':':
+        if (p[1] == '>') TOKEN(']', 2);
+        TOKEN(':', 1);
+      case ';': case ',': case '(': case ')': case '{': case '}':
+      case '[': case ']': case '~': case '?':
+        TOKEN(*p, 1);
+
+      default:
+        if (IS(*p, C_L)) {
+          n = 1 + span(p + 1, C_L | C_D);
+          // a prefixed character constant or string literal is longer
+          if (n == 1 && (*p == 'L' || *p == 'u' || *p == 'U') &&
+              p[1] == '\'' && (q = quoted(p + 1, t->end, '\'', 1)) != NULL)
+            TOKEN(I_CONSTANT, q - p);
+          if (n <= 2 && string_prefix(p) == n && string(t, p))
+            return STRING_LITERAL;
+          TOKEN(keyword(p, n), n);
+        }
+        t->p = p + 1; // discard bad character
+        continue;
+    }
+  }
+#undef TOKEN
+  return 0;
+}
+
+
+#ifdef TOKMAIN
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Print the tokens of stdin, in the format of the LEXMAIN scanner.
+ */
+int main()
+{
+  struct tokenizer t;
+  size_t len = 0, cap = 1 << 16;
+  char *buf = malloc(cap + TOK_PAD);
+  size_t n;
+  int tok;
+  while (buf != NULL && (n = fread(buf + len, 1, cap - len, stdin)) > 0) {
+    len += n;
+    if (len == cap) buf = realloc(buf, (cap *= 2) + TOK_PAD);
+  }
+  if (buf == NULL) return 1;
+  memset(buf + len, 0, TOK_PAD);
+  tok_init(&t, buf, len);
+  while ((tok = tok_next(&t)) != 0) {
+    printf("tok: %d line: %d\n", tok, t.lineno);
+  }
+  free(buf);
+  return 0;
+}
+#endif /* TOKMAIN */
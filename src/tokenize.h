@@ -0,0 +1,32 @@
+#ifndef _TOKENIZE_H_
+#define _TOKENIZE_H_
+
+#include <stddef.h>
+
+/*
+ * A hand-written C tokenizer, an alternative to the flex scanner of
+ * ccode.lex.  It returns the same token IDs (from ccode.tab.h) and line
+ * numbers, but scans a whole file in memory.
+ */
+
+// Number of zero bytes the input buffer must be followed by.
+#define TOK_PAD 16
+
+struct tokenizer {
+  const char *p;   // next character to scan
+  const char *end; // end of the input
+  int lineno;      // line number after the last token
+  const char *text; // start of the last token, which ends at p
+};
+
+/**
+ * Start tokenizing buf of len bytes, followed by TOK_PAD zero bytes.
+ */
+void tok_init(struct tokenizer *t, const char *buf, size_t len);
+
+/**
+ * Return the ID of the next token, or 0 at the end of the input.
+ */
+int tok_next(struct tokenizer *t);
+
+#endif // _TOKENIZE_H_
@@ -0,0 +1,245 @@
+/**
+ * Token files.
+ *
+ * A token file holds the token streams of files as scanned, so they can be
+ * fingerprinted again without scanning, e.g. to try other chainlengths or
+ * winnow sizes.  The hashes only depend on the tokens and their line
+ * numbers, so they are the same as from scanning the files.
+ *
+ * Format of the token file, in host byte order:
+ *   header:  magic "fpcctoks", uint32 version
+ *   records: uint32 path length, path, NUL, uint32 number of tokens,
+ *            uint32 length of the encoding, encoded tokens
+ *
+ * Tokens are encoded in a byte each, most of the time: single characters
+ * as themselves, the tokens from IDENTIFIER on as 128 + their offset.
+ * A line number is only encoded where it changes: by TF_NEWLINE before the
+ * token if it is one greater than the one of the previous token, otherwise
+ * by TF_LINE and the difference as a varint.  Other tokens are TF_TOKEN and
+ * their ID as a varint.  The first token is relative to line 1.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tokfile.h"
+
+#define TOKFILE_MAGIC "fpcctoks"
+#define TOKFILE_VERSION 1
+
+// codes of the encoding
+#define TF_NAMED   128  // first code of the named tokens
+#define TF_TOKEN   253  // a token ID follows
+#define TF_LINE    254  // a line difference follows
+#define TF_NEWLINE 255  // the line of the next token is one greater
+
+
+/**
+ * Append a varint to buf at pos, return the new position.
+ */
+static size_t put_varint(unsigned char *buf, size_t pos, uint32_t v)
+{
+  while (v >= 0x80) {
+    buf[pos++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  buf[pos++] = v;
+  return pos;
+}
+
+
+/**
+ * Read a varint at *p, not beyond end, and advance *p.
+ * Return 0 if the varint is truncated.
+ */
+static int get_varint(const unsigned char **p, const unsigned char *end,
+    uint32_t *v)
+{
+  uint32_t r = 0;
+  for (int shift = 0; *p < end && shift < 35; shift += 7) {
+    unsigned char b = *(*p)++;
+    r |= (uint32_t) (b & 0x7f) << shift;
+    if (b < 0x80) {
+      *v = r;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+size_t tok_encode(const struct tokstream *ts, unsigned char **buf,
+    size_t *size)
+{
+  // a token takes at most 2 codes and 2 varints
+  size_t need = ts->count * 12;
+  if (*size < need) {
+    unsigned char *new_buf = realloc(*buf, need);
+    if (new_buf == NULL)
+      error_exit("cannot allocate memory");
+    *buf = new_buf;
+    *size = need;
+  }
+
+  unsigned char *b = *buf;
+  size_t pos = 0;
+  int line = 1;
+  for (size_t i = 0; i < ts->count; i++) {
+    int tok = ts->tok[i];
+    if (ts->line[i] != line) {
+      if (ts->line[i] == line + 1) {
+        b[pos++] = TF_NEWLINE;
+      } else {
+        b[pos++] = TF_LINE;
+        pos = put_varint(b, pos, (uint32_t) ts->line[i] - (uint32_t) line);
+      }
+      line = ts->line[i];
+    }
+    if (tok > 0 && tok < TF_NAMED) {
+      b[pos++] = tok;
+    } else if (tok >= IDENTIFIER && tok - IDENTIFIER < TF_TOKEN - TF_NAMED) {
+      b[pos++] = TF_NAMED + tok - IDENTIFIER;
+    } else {
+      b[pos++] = TF_TOKEN;
+      pos = put_varint(b, pos, tok);
+    }
+  }
+  return pos;
+}
+
+
+void tok_decode(const struct tokrec *rec, struct tokstream *ts)
+{
+  const unsigned char *p = rec->data, *end = rec->data + rec->len;
+  uint32_t line = 1, v;
+  while (p < end) {
+    int tok = *p++;
+    if (tok == TF_NEWLINE) {
+      line++;
+      continue;
+    }
+    if (tok == TF_LINE) {
+      if (!get_varint(&p, end, &v)) break;
+      line += v;
+      continue;
+    }
+    if (tok == TF_TOKEN) {
+      if (!get_varint(&p, end, &v)) break;
+      tok = v;
+    } else if (tok >= TF_NAMED) {
+      tok = IDENTIFIER + tok - TF_NAMED;
+    }
+    ts_add(ts, tok, (int) line, NULL, 0);
+  }
+  if (p < end || ts->count != rec->count)
+    error_exit("corrupt token file");
+}
+
+
+void tokfile_open(struct tokfile *tf, const char *name)
+{
+  struct stat st;
+  int fd = open(name, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1)
+    error_exit("cannot open token file");
+  tf->len = st.st_size;
+  tf->pos = sizeof TOKFILE_MAGIC - 1 + sizeof(uint32_t);
+  tf->map = NULL;
+  if (tf->len > 0) {
+    void *map = mmap(NULL, tf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+      error_exit("cannot map token file");
+    (void) madvise(map, tf->len, MADV_SEQUENTIAL);
+    tf->map = map;
+  }
+  (void) close(fd);
+
+  uint32_t version;
+  if (tf->len < tf->pos ||
+      memcmp(tf->map, TOKFILE_MAGIC, sizeof TOKFILE_MAGIC - 1) != 0)
+    error_exit("not a token file");
+  memcpy(&version, tf->map + sizeof TOKFILE_MAGIC - 1, sizeof version);
+  if (version != TOKFILE_VERSION)
+    error_exit("unsupported token file version");
+}
+
+
+/**
+ * Read a uint32 at the position of tf, return 0 if truncated.
+ */
+static int get_u32(struct tokfile *tf, uint32_t *v)
+{
+  if (tf->len - tf->pos < sizeof *v) return 0;
+  memcpy(v, tf->map + tf->pos, sizeof *v);
+  tf->pos += sizeof *v;
+  return 1;
+}
+
+
+int tokfile_next(struct tokfile *tf, struct tokrec *rec)
+{
+  uint32_t pathlen, len;
+  if (tf->pos == tf->len) return 0;
+  if (!get_u32(tf, &pathlen) || tf->len - tf->pos < (size_t) pathlen + 1 ||
+      tf->map[tf->pos + pathlen] != '\0')
+    error_exit("corrupt token file");
+  rec->path = (const char *) tf->map + tf->pos;
+  tf->pos += pathlen + 1;
+  if (!get_u32(tf, &rec->count) || !get_u32(tf, &len) ||
+      tf->len - tf->pos < len)
+    error_exit("corrupt token file");
+  rec->data = tf->map + tf->pos;
+  rec->len = len;
+  tf->pos += len;
+  return 1;
+}
+
+
+void tokfile_close(struct tokfile *tf)
+{
+  if (tf->map != NULL) (void) munmap((void *) tf->map, tf->len);
+  tf->map = NULL;
+}
+
+
+FILE *tokfile_create(const char *name)
+{
+  FILE *f = fopen(name, "w");
+  if (f == NULL)
+    error_exit("cannot create token file");
+  uint32_t version = TOKFILE_VERSION;
+  if (fwrite(TOKFILE_MAGIC, sizeof TOKFILE_MAGIC - 1, 1, f) != 1 ||
+      fwrite(&version, sizeof version, 1, f) != 1)
+    error_exit("cannot write token file");
+  return f;
+}
+
+
+void tokfile_write(FILE *f, const char *path, size_t count,
+    const unsigned char *data, size_t len)
+{
+  uint32_t pathlen = strlen(path);
+  uint32_t count32 = count, len32 = len;
+  if (count > UINT32_MAX || len > UINT32_MAX)
+    error_exit("file too large for token file");
+  if (fwrite(&pathlen, sizeof pathlen, 1, f) != 1 ||
+      fwrite(path, 1, pathlen + 1, f) != pathlen + 1 ||
+      fwrite(&count32, sizeof count32, 1, f) != 1 ||
+      fwrite(&len32, sizeof len32, 1, f) != 1 ||
+      fwrite(data, 1, len, f) != len)
+    error_exit("cannot write token file");
+}
+
+
+void tokfile_finish(FILE *f)
+{
+  if (fclose(f) != 0)
+    error_exit("cannot write token file");
+}
@@ -0,0 +1,71 @@
+#ifndef _TOKFILE_H_
+#define _TOKFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "fparse.h"
+
+/*
+ * Token files: the token streams of a set of files as scanned, with their
+ * line numbers, so they can be fingerprinted again with other parameters
+ * without scanning.
+ */
+
+/**
+ * A token file being read, mapped into memory.
+ */
+struct tokfile {
+  const unsigned char *map;
+  size_t len;
+  size_t pos; // next record
+};
+
+/**
+ * The token stream of a file in a token file.
+ */
+struct tokrec {
+  const char *path;
+  uint32_t count;             // number of tokens
+  const unsigned char *data;  // encoded tokens
+  size_t len;
+};
+
+/**
+ * Encode the tokens of ts, storing the encoding in *buf of size *size,
+ * which is grown as needed.  Return the length of the encoding.
+ */
+size_t tok_encode(const struct tokstream *ts, unsigned char **buf,
+    size_t *size);
+
+/**
+ * Decode the tokens of a record, appending them to ts without names.
+ */
+void tok_decode(const struct tokrec *rec, struct tokstream *ts);
+
+/**
+ * Open a token file for reading, exit on error.
+ */
+void tokfile_open(struct tokfile *tf, const char *name);
+
+/**
+ * Read the next record.  Return 1 on success, 0 at the end.
+ */
+int tokfile_next(struct tokfile *tf, struct tokrec *rec);
+
+void tokfile_close(struct tokfile *tf);
+
+/**
+ * Create a token file for writing, exit on error.
+ */
+FILE *tokfile_create(const char *name);
+
+/**
+ * Append the encoded tokens of a file.
+ */
+void tokfile_write(FILE *f, const char *path, size_t count,
+    const unsigned char *data, size_t len);
+
+void tokfile_finish(FILE *f);
+
+#endif // _TOKFILE_H_
@@ -0,0 +1,157 @@
+/**
+ * File names to fingerprint, from arguments, stdin and directory trees.
+ *
+ * Author: Daniel Prokesch <daniel.prokesch@gmail.com>
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "walk.h"
+
+extern const char *program_name;
+
+
+void names_init(struct names *n, char *const args[], int nargs, int sep)
+{
+  memset(n, 0, sizeof *n);
+  n->args = args;
+  n->nargs = nargs;
+  n->sep = sep;
+}
+
+
+const char *names_next(struct names *n)
+{
+  for (;;) {
+    if (n->list != NULL) {
+      ssize_t len = getdelim(&n->buf, &n->bufsize, n->sep, n->list);
+      if (len == -1) {
+        if (ferror(n->list))
+          error_exit("cannot read file list");
+        n->list = NULL;
+        continue;
+      }
+      if (len > 0 && n->buf[len - 1] == n->sep) n->buf[--len] = '\0';
+      if (len == 0) continue; // skip empty names
+      return n->buf;
+    }
+    if (n->next == n->nargs) return NULL;
+    const char *arg = n->args[n->next++];
+    if (strcmp(arg, "-") != 0) return arg;
+    n->list = stdin;
+  }
+}
+
+
+void names_free(struct names *n)
+{
+  free(n->buf);
+  n->buf = NULL;
+}
+
+
+int walk_isdir(const char *path)
+{
+  struct stat st;
+  return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+/**
+ * Check whether the file name ends with one of the extensions.
+ */
+static int match_ext(const char *name, const char *exts)
+{
+  if (*exts == '\0') return 1;
+  const char *ext = strrchr(name, '.');
+  if (ext == NULL) return 0;
+  size_t len = strlen(++ext);
+  for (const char *e = exts; ; e++) {
+    size_t elen = strcspn(e, ",");
+    if (elen == len && strncmp(e, ext, len) == 0) return 1;
+    e += elen;
+    if (*e == '\0') return 0;
+  }
+}
+
+
+static int entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct entry *) a)->path,
+      ((const struct entry *) b)->path);
+}
+
+
+size_t walk_dir(const char *dir, const char *exts, struct entry **entries)
+{
+  size_t count = 0, capacity = 0;
+  size_t dirlen = strlen(dir);
+  if (dirlen > 0 && dir[dirlen - 1] == '/') dirlen--;
+
+  *entries = NULL;
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    (void) fprintf(stderr, "%s: cannot open directory %s: %s\n",
+        program_name, dir, strerror(errno));
+    return 0;
+  }
+
+  struct dirent *de;
+  while ((errno = 0, de = readdir(d)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN &&
+        !match_ext(de->d_name, exts))
+      continue;
+
+    char *path = malloc(dirlen + strlen(de->d_name) + 2);
+    if (path == NULL)
+      error_exit("cannot allocate memory");
+    memcpy(path, dir, dirlen);
+    path[dirlen] = '/';
+    strcpy(path + dirlen + 1, de->d_name);
+
+    int isdir = de->d_type == DT_DIR;
+    if (de->d_type == DT_LNK || de->d_type == DT_UNKNOWN) {
+      // look at the file itself, a link only if it leads to a regular file
+      struct stat st;
+      int ok = lstat(path, &st) == 0;
+      if (ok && S_ISLNK(st.st_mode))
+        ok = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+      isdir = ok && S_ISDIR(st.st_mode);
+      if (!isdir && !(ok && S_ISREG(st.st_mode) &&
+            match_ext(de->d_name, exts))) {
+        free(path);
+        continue;
+      }
+    } else if (de->d_type != DT_DIR && de->d_type != DT_REG) {
+      free(path);
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity > 0 ? 2 * capacity : 16;
+      struct entry *new_entries = realloc(*entries,
+          capacity * sizeof(struct entry));
+      if (new_entries == NULL)
+        error_exit("cannot allocate memory");
+      *entries = new_entries;
+    }
+    (*entries)[count].path = path;
+    (*entries)[count].isdir = isdir;
+    count++;
+  }
+  if (errno != 0) {
+    (void) fprintf(stderr, "%s: cannot read directory %s: %s\n",
+        program_name, dir, strerror(errno));
+  }
+  (void) closedir(d);
+
+  qsort(*entries, count, sizeof(struct entry), entry_cmp);
+  return count;
+}
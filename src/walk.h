@@ -0,0 +1,58 @@
+#ifndef _WALK_H_
+#define _WALK_H_
+
+#include <stdio.h>
+
+/*
+ * The files to fingerprint: names given as arguments or read from stdin,
+ * and the entries of directories walked recursively.
+ */
+
+/**
+ * A sequence of file names: the arguments, where "-" stands for a list
+ * of names read from stdin, separated by newlines or by sep.
+ */
+struct names {
+  char *const *args;
+  int nargs;
+  int next;      // next argument
+  int sep;       // separator of names read from stdin
+  FILE *list;    // stdin while reading a list
+  char *buf;     // the name read last
+  size_t bufsize;
+};
+
+/**
+ * An entry of a directory to be fingerprinted or walked.
+ */
+struct entry {
+  char *path;
+  int isdir;
+};
+
+void names_init(struct names *n, char *const args[], int nargs, int sep);
+
+/**
+ * Return the next file name, valid until the next call,
+ * or NULL at the end.
+ */
+const char *names_next(struct names *n);
+
+void names_free(struct names *n);
+
+/**
+ * Return whether path is a directory, following symbolic links.
+ */
+int walk_isdir(const char *path);
+
+/**
+ * List the entries of a directory, sorted by name: its subdirectories, and
+ * the regular files whose name ends with one of the comma-separated
+ * extensions exts, or all if exts is empty.  Symbolic links to regular
+ * files are included, those to directories are not followed.
+ * Return the number of entries stored in *entries, to be freed by the
+ * caller.  A directory that cannot be read is reported and left empty.
+ */
+size_t walk_dir(const char *dir, const char *exts, struct entry **entries);
+
+#endif // _WALK_H_